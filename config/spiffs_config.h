@@ -19,6 +19,22 @@ typedef int8_t s8_t;
 typedef uint8_t u8_t;
 // ----------- >8 ------------
 
+// Filesystem wrapper geometry, shared by fs.c and tools using the same build.
+
+// Logical page size used for all filesystems.
+#ifndef FS_SPIFFS_LOG_PAGE_SZ
+#define FS_SPIFFS_LOG_PAGE_SZ           (128UL)
+#endif
+// Logical block size used for all filesystems.
+#ifndef FS_SPIFFS_LOG_BLOCK_SZ
+#define FS_SPIFFS_LOG_BLOCK_SZ          (32UL * 1024UL)
+#endif
+// Largest partition size any filesystem will be used with. If defined, the
+// SPIFFS type widths are validated at compile time and fs_init only checks the
+// partition size against this value. Not defined by default, in which case the
+// type widths are validated at runtime for every partition.
+//#define FS_SPIFFS_MAX_PARTITION_SZ      (4UL * 1024UL * 1024UL)
+
 // compile time switches
 
 // Set generic spiffs debug output call.
@@ -341,19 +357,43 @@ typedef uint8_t u8_t;
 // the logical block size (log_block_size), and the logical page size
 // (log_page_size)
 
+// When FS_SPIFFS_MAX_PARTITION_SZ is configured, the index types are selected
+// from it, 16-bit types are used when they are sufficient and 32-bit types
+// otherwise. Note that the type widths are part of the on-flash format.
+// The most significant bit of spiffs_obj_id is the index flag, so a 16-bit
+// object id only goes up to 0x7FFF, which also covers the page indexes.
+#if defined(FS_SPIFFS_MAX_PARTITION_SZ) && \
+    ((FS_SPIFFS_MAX_PARTITION_SZ / FS_SPIFFS_LOG_BLOCK_SZ) > 0xFFFFUL)
+#define FS_SPIFFS_WIDE_BLOCK_IX         (1)
+#endif
+#if defined(FS_SPIFFS_MAX_PARTITION_SZ) && \
+    ((2 + (FS_SPIFFS_MAX_PARTITION_SZ / (2 * FS_SPIFFS_LOG_PAGE_SZ)) * 2) > 0x7FFFUL)
+#define FS_SPIFFS_WIDE_PAGE_IX          (1)
+#endif
+
 // Block index type. Make sure the size of this type can hold
 // the highest number of all blocks - i.e. spiffs_file_system_size / log_block_size
+#ifdef FS_SPIFFS_WIDE_BLOCK_IX
+typedef u32_t spiffs_block_ix;
+#else
 typedef u16_t spiffs_block_ix;
+#endif
+#ifdef FS_SPIFFS_WIDE_PAGE_IX
 // Page index type. Make sure the size of this type can hold
 // the highest page number of all pages - i.e. spiffs_file_system_size / log_page_size
-typedef u16_t spiffs_page_ix;
+typedef u32_t spiffs_page_ix;
 // Object id type - most significant bit is reserved for index flag. Make sure the
 // size of this type can hold the highest object id on a full system,
 // i.e. 2 + (spiffs_file_system_size / (2*log_page_size))*2
-typedef u16_t spiffs_obj_id;
+typedef u32_t spiffs_obj_id;
 // Object span index type. Make sure the size of this type can
 // hold the largest possible span index on the system -
 // i.e. (spiffs_file_system_size / log_page_size) - 1
+typedef u32_t spiffs_span_ix;
+#else
+typedef u16_t spiffs_page_ix;
+typedef u16_t spiffs_obj_id;
 typedef u16_t spiffs_span_ix;
+#endif
 
 #endif /* SPIFFS_CONFIG_H_ */
@@ -26,10 +26,16 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
 #include "platform_mutex.h"
 #include "spi_flash.h"
 #include "spiffs.h"
+#include "spiffs_nucleus.h"
 #include "cmsis_os2.h"
+#ifdef FS_TRACE
+#include "fs_trace.h"
+#endif//FS_TRACE
 
 #include "loglevels.h"
 #define __MODUUL__ "fs"
@@ -45,33 +51,191 @@
 #define FS_MAX_DESCRIPTORS 6
 #endif//FS_MAX_DESCRIPTORS
 
-#define FS_SPIFFS_LOG_PAGE_SZ  (128UL)
-#define FS_SPIFFS_LOG_BLOCK_SZ (32UL * 1024UL)
+#ifdef FS_SPIFFS_MAX_PARTITION_SZ
+// The SPIFFS type widths must be able to index the largest partition,
+// see the comments on the types in spiffs_config.h.
+_Static_assert(FS_SPIFFS_MAX_PARTITION_SZ / FS_SPIFFS_LOG_BLOCK_SZ <= (spiffs_block_ix)-1,
+               "spiffs_block_ix too small for FS_SPIFFS_MAX_PARTITION_SZ");
+_Static_assert(FS_SPIFFS_MAX_PARTITION_SZ / FS_SPIFFS_LOG_PAGE_SZ <= (spiffs_page_ix)-1,
+               "spiffs_page_ix too small for FS_SPIFFS_MAX_PARTITION_SZ");
+_Static_assert(2 + (FS_SPIFFS_MAX_PARTITION_SZ / (2 * FS_SPIFFS_LOG_PAGE_SZ)) * 2 <= SPIFFS_OBJ_ID_IX_FLAG - 1,
+               "spiffs_obj_id too small for FS_SPIFFS_MAX_PARTITION_SZ");
+_Static_assert(FS_SPIFFS_MAX_PARTITION_SZ / FS_SPIFFS_LOG_PAGE_SZ - 1 <= (spiffs_span_ix)-1,
+               "spiffs_span_ix too small for FS_SPIFFS_MAX_PARTITION_SZ");
+#endif//FS_SPIFFS_MAX_PARTITION_SZ
+
+// Number of queued write and read record requests
+#ifndef FS_RECORD_WR_QUEUE_COUNT
+#define FS_RECORD_WR_QUEUE_COUNT 10
+#endif//FS_RECORD_WR_QUEUE_COUNT
+
+#ifndef FS_RECORD_RD_QUEUE_COUNT
+#define FS_RECORD_RD_QUEUE_COUNT 10
+#endif//FS_RECORD_RD_QUEUE_COUNT
+
+// Number of record requests that can hold a file name at the same time,
+// by default every queued request has one
+#ifndef FS_RECORD_NAME_COUNT
+#define FS_RECORD_NAME_COUNT (FS_RECORD_WR_QUEUE_COUNT + FS_RECORD_RD_QUEUE_COUNT)
+#endif//FS_RECORD_NAME_COUNT
+
+#if FS_RECORD_WR_QUEUE_COUNT + FS_RECORD_RD_QUEUE_COUNT > 255
+	#error FS_RECORD_WR_QUEUE_COUNT + FS_RECORD_RD_QUEUE_COUNT > 255
+#endif
+#if FS_RECORD_NAME_COUNT > 255
+	#error FS_RECORD_NAME_COUNT > 255
+#endif
+
+// Number of records kept in RAM per filesystem, 0 disables the cache
+#ifndef FS_RECORD_CACHE_ENTRIES
+#define FS_RECORD_CACHE_ENTRIES 0
+#endif//FS_RECORD_CACHE_ENTRIES
+
+// Largest cached record
+#ifndef FS_RECORD_CACHE_SIZE
+#define FS_RECORD_CACHE_SIZE 16
+#endif//FS_RECORD_CACHE_SIZE
+
+#ifndef FS_HAL_RETRIES
+#define FS_HAL_RETRIES 2
+#endif//FS_HAL_RETRIES
+
+#ifndef FS_HAL_RETRY_DELAY
+#define FS_HAL_RETRY_DELAY 0
+#endif//FS_HAL_RETRY_DELAY
+
+#ifndef FS_WRITE_VERIFY_CHUNK
+#define FS_WRITE_VERIFY_CHUNK 32
+#endif//FS_WRITE_VERIFY_CHUNK
+
+#if FS_WRITE_VERIFY_CHUNK % 4 != 0
+	#error FS_WRITE_VERIFY_CHUNK % 4 != 0
+#endif
 
-#define MAX_Q_WR_COUNT 10
-#define MAX_Q_RD_COUNT 10
+// Free space in bytes the fs thread keeps ready, by running gc after record
+// writes, so that an emergency flush of that much data does not need gc
+#ifndef FS_EMERGENCY_RESERVE
+#define FS_EMERGENCY_RESERVE 0
+#endif//FS_EMERGENCY_RESERVE
+
+#ifdef FS_WEAR_LEVELING
+// Largest number of SPIFFS blocks tracked per filesystem
+#ifndef FS_WEAR_MAX_BLOCKS
+#define FS_WEAR_MAX_BLOCKS 64
+#endif//FS_WEAR_MAX_BLOCKS
+
+// A block is relocated once the filesystem has erased this many times its
+// block count since the block itself was last erased
+#ifndef FS_WEAR_SPREAD
+#define FS_WEAR_SPREAD 4
+#endif//FS_WEAR_SPREAD
+
+// Kernel ticks a relocation pass may keep the filesystem busy
+#ifndef FS_WEAR_BUDGET
+#define FS_WEAR_BUDGET 100
+#endif//FS_WEAR_BUDGET
+
+// Relocation needs room for a full block of data besides the GC reserve
+#define FS_WEAR_MIN_FREE_BLOCKS 4
+#endif//FS_WEAR_LEVELING
+
+// Largest piece of a raw read or write done in one go under the locks
+#ifndef FS_RAW_CHUNK
+#define FS_RAW_CHUNK 1024
+#endif//FS_RAW_CHUNK
+
+#ifndef FS_THREAD_STACK_SIZE
+#define FS_THREAD_STACK_SIZE 2048
+#endif//FS_THREAD_STACK_SIZE
+
+#ifndef FS_THREAD_PRIORITY
+#define FS_THREAD_PRIORITY osPriorityNormal
+#endif//FS_THREAD_PRIORITY
+
+#ifdef FS_STATIC_ALLOCATION
+// Control block sizes default to the CMSIS-FreeRTOS ones,
+// define all FS_RTOS_*_CB_SIZE values for a different kernel.
+#ifndef FS_RTOS_THREAD_CB_SIZE
+#include "FreeRTOS.h"
+#define FS_RTOS_THREAD_CB_SIZE sizeof(StaticTask_t)
+#define FS_RTOS_QUEUE_CB_SIZE  sizeof(StaticQueue_t)
+#define FS_RTOS_TIMER_CB_SIZE  sizeof(StaticTimer_t)
+#define FS_RTOS_MUTEX_CB_SIZE  sizeof(StaticSemaphore_t)
+#endif//FS_RTOS_THREAD_CB_SIZE
+// Memory is declared as uint64_t arrays to guarantee alignment
+#define FS_RTOS_MEM_WORDS(size) (((size) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+#endif//FS_STATIC_ALLOCATION
 
 #define FS_WRITE_DATA 1
 #define FS_READ_DATA 2
 
+#if FS_RECORD_CACHE_ENTRIES > 0
+// Start of a file read or written as a record, the file is found by name for
+// records and unlink, and by object id for writes through a descriptor
+typedef struct fs_record_cache
+{
+	char          name[SPIFFS_OBJ_NAME_LEN]; // Empty when not in use
+	spiffs_obj_id obj_id;
+	uint32_t      used;
+	uint16_t      len;
+	bool          complete; // len is the size of the file
+	uint8_t       data[FS_RECORD_CACHE_SIZE];
+} fs_record_cache_t;
+#endif//FS_RECORD_CACHE_ENTRIES
+
 struct fs_struct
 {
 	fs_driver_t *driver;
 	volatile int ready;
 	int partition;
 	uint8_t mount_count;
+	bool write_verify;
+	uint32_t raw_addr; // Raw range after the SPIFFS part
+	uint32_t raw_size;
+#ifdef FS_BAD_BLOCKS
+	uint32_t spare_addr;
+	uint16_t bad_blocks[FS_BAD_BLOCK_SPARES]; // Block replaced by each used spare
+	uint8_t bad_block_count;
+#endif//FS_BAD_BLOCKS
+#ifdef FS_WEAR_LEVELING
+	bool wear_valid;
+	uint16_t wear_erases; // Block erases since the last relocation pass
+	fs_wear_stats_t wear_stats;
+	spiffs_obj_id erase_stamps[FS_WEAR_MAX_BLOCKS]; // SPIFFS erase count of each block
+#endif//FS_WEAR_LEVELING
+#if FS_RECORD_CACHE_ENTRIES > 0
+	fs_record_cache_t cache[FS_RECORD_CACHE_ENTRIES];
+	uint32_t cache_used;
+	uint32_t cache_hits;
+#endif//FS_RECORD_CACHE_ENTRIES
 	platform_mutex_t mutex;
 	spiffs_config cfg;
 	spiffs fs;
+#ifndef FS_SHARED_WORK_BUF
 	uint8_t work_buf[FS_SPIFFS_LOG_PAGE_SZ * 2];
-	uint8_t fds[32 * FS_MAX_DESCRIPTORS];
+#endif//FS_SHARED_WORK_BUF
+	spiffs_fd fds[FS_MAX_DESCRIPTORS];
 };
 
 static struct fs_struct fs[FS_MAX_COUNT];
 
+#ifdef FS_SHARED_WORK_BUF
+// A single work buffer is used by all filesystems, so all filesystems also
+// share a single mutex to serialize access to it.
+static uint8_t m_work_buf[FS_SPIFFS_LOG_PAGE_SZ * 2];
+static platform_mutex_t m_work_mutex;
+static bool m_work_mutex_created;
+#define FS_WORK_BUF(f) (m_work_buf)
+#else
+#define FS_WORK_BUF(f) (fs[f].work_buf)
+#endif//FS_SHARED_WORK_BUF
+
 #ifdef FS_MANAGE_FLASH_SLEEP
 static osTimerId_t  m_sleep_timers[FS_MAX_COUNT];
 static void fs_suspend_timer_cb(void * arg);
+#ifdef FS_STATIC_ALLOCATION
+static uint64_t m_sleep_timer_cbs[FS_MAX_COUNT][FS_RTOS_MEM_WORDS(FS_RTOS_TIMER_CB_SIZE)];
+#endif//FS_STATIC_ALLOCATION
 #endif//FS_MANAGE_FLASH_SLEEP
 
 #define FS_THREAD_FLAGS_ALL 0x7FFFFFFFU
@@ -80,21 +244,69 @@ static void fs_suspend_timer_cb(void * arg);
 // define read/write flags after filesystem suspend timer flags
 #define FS_WRITE_FLAG       (0x01 << FS_MAX_COUNT)
 #define FS_READ_FLAG        (0x01 << (FS_MAX_COUNT + 1))
+#define FS_WEAR_FLAG        (0x01 << (FS_MAX_COUNT + 2))
 
 static osThreadId_t m_thread_id;
 static osMessageQueueId_t m_wr_queue_id;
 static osMessageQueueId_t m_rd_queue_id;
 
+#ifdef FS_TRACE
+// Thread running fs_emergency_flush, which processes records on its own
+static volatile osThreadId_t m_flush_thread_id;
+
+// Direct calls on the fs thread come from record processing and callbacks,
+// only the record requests themselves are traced. Records flushed by
+// fs_emergency_flush were traced when they were queued.
+#define FS_TRACE_CALL(nr, op, arg, id, value) do { osThreadId_t tid = osThreadGetId(); \
+	if ((tid != m_thread_id) && ((NULL == m_flush_thread_id) || (tid != m_flush_thread_id))) { \
+	fs_trace_add(nr, op, arg, id, value); } } while (0)
+#else
+#define FS_TRACE_CALL(nr, op, arg, id, value)
+#endif//FS_TRACE
+
+// Queued record request, the file name is stored in the name table and
+// referenced by its index to keep the request small.
 typedef struct fs_rw_params
 {
-	int           file_sys_nr;
-	char *        p_file_name;
+	uint8_t       file_sys_nr;
+	uint8_t       name_id;
+	uint16_t      len;
 	void *        p_value;
-	int32_t       len;
 	fs_rw_done_f  f_callback;
 	void *        p_user;
 } fs_rw_params_t;
 
+// File names of queued record requests, the indexes of the free entries are
+// kept in a message queue, so a name can be taken and released in an ISR
+static const char * m_record_names[FS_RECORD_NAME_COUNT];
+static osMessageQueueId_t m_name_queue_id;
+
+// Set while an emergency flush runs, the fs thread does no background work
+static volatile bool m_emergency;
+
+// Held by the fs thread from taking a record write from the queue until it
+// has been written, and by an emergency flush, so queued writes reach the
+// flash in order
+static osMutexId_t m_record_mutex_id;
+
+#ifdef FS_STATIC_ALLOCATION
+static uint64_t m_thread_cb[FS_RTOS_MEM_WORDS(FS_RTOS_THREAD_CB_SIZE)];
+static uint64_t m_thread_stack[FS_RTOS_MEM_WORDS(FS_THREAD_STACK_SIZE)];
+static uint64_t m_wr_queue_cb[FS_RTOS_MEM_WORDS(FS_RTOS_QUEUE_CB_SIZE)];
+static uint64_t m_wr_queue_mem[FS_RTOS_MEM_WORDS(FS_RECORD_WR_QUEUE_COUNT * sizeof(fs_rw_params_t))];
+static uint64_t m_rd_queue_cb[FS_RTOS_MEM_WORDS(FS_RTOS_QUEUE_CB_SIZE)];
+static uint64_t m_rd_queue_mem[FS_RTOS_MEM_WORDS(FS_RECORD_RD_QUEUE_COUNT * sizeof(fs_rw_params_t))];
+static uint64_t m_name_queue_cb[FS_RTOS_MEM_WORDS(FS_RTOS_QUEUE_CB_SIZE)];
+static uint64_t m_record_mutex_cb[FS_RTOS_MEM_WORDS(FS_RTOS_MUTEX_CB_SIZE)];
+static uint64_t m_name_queue_mem[FS_RTOS_MEM_WORDS(FS_RECORD_NAME_COUNT * sizeof(uint8_t))];
+#ifdef FS_SHARED_WORK_BUF
+// All filesystems share one mutex, created with file_sys_nr 0
+static uint64_t m_mutex_cbs[1][FS_RTOS_MEM_WORDS(FS_RTOS_MUTEX_CB_SIZE)];
+#else
+static uint64_t m_mutex_cbs[FS_MAX_COUNT][FS_RTOS_MEM_WORDS(FS_RTOS_MUTEX_CB_SIZE)];
+#endif//FS_SHARED_WORK_BUF
+#endif//FS_STATIC_ALLOCATION
+
 static void fs_thread(void *p);
 
 static void fs_plan_suspend(int f);
@@ -102,6 +314,20 @@ static void fs_abort_suspend(int f);
 
 static void fs_mount();
 
+static platform_mutex_t fs_mutex_new(int file_sys_nr);
+
+static int fs_record_name_get(const char * p_name);
+static void fs_record_name_put(uint8_t name_id);
+static int32_t fs_record_write(const fs_rw_params_t * p_params);
+static int32_t fs_record_read(const fs_rw_params_t * p_params);
+#if FS_RECORD_CACHE_ENTRIES > 0
+static void fs_cache_drop_name(int f, const char * p_name);
+static void fs_cache_drop_file(int f, spiffs_file sfd);
+#endif//FS_RECORD_CACHE_ENTRIES
+#if FS_EMERGENCY_RESERVE > 0
+static void fs_emergency_reserve(int f);
+#endif//FS_EMERGENCY_RESERVE
+
 static int32_t fs_read0(uint32_t addr, uint32_t size, uint8_t * dst);
 static int32_t fs_write0(uint32_t addr, uint32_t size, uint8_t * src);
 static int32_t fs_erase0(uint32_t addr, uint32_t size);
@@ -116,17 +342,58 @@ static int32_t fs_write2(uint32_t addr, uint32_t size, uint8_t * src);
 static int32_t fs_erase2(uint32_t addr, uint32_t size);
 #endif// FS_MAX_COUNT > 2
 
+#ifdef FS_BAD_BLOCKS
+static void fs_bb_load(int f);
+#endif//FS_BAD_BLOCKS
+
+#ifdef FS_WEAR_LEVELING
+static void fs_wear_load(int f);
+static void fs_wear_level(int f);
+#endif//FS_WEAR_LEVELING
+
 void fs_init (int file_sys_nr, int partition, fs_driver_t *driver)
 {
 	fs[file_sys_nr].ready = 0;
 	fs[file_sys_nr].partition = partition;
 	fs[file_sys_nr].driver = driver;
 	fs[file_sys_nr].mount_count = 0;
-	fs[file_sys_nr].mutex = platform_mutex_new("fs");
+	fs[file_sys_nr].write_verify = false;
+	fs[file_sys_nr].raw_addr = 0;
+	fs[file_sys_nr].raw_size = 0;
+#if FS_RECORD_CACHE_ENTRIES > 0
+	memset(fs[file_sys_nr].cache, 0, sizeof(fs[file_sys_nr].cache));
+	fs[file_sys_nr].cache_used = 0;
+	fs[file_sys_nr].cache_hits = 0;
+#endif//FS_RECORD_CACHE_ENTRIES
+#ifdef FS_WEAR_LEVELING
+	fs[file_sys_nr].wear_valid = false;
+	fs[file_sys_nr].wear_erases = 0;
+	memset(&fs[file_sys_nr].wear_stats, 0, sizeof(fs[file_sys_nr].wear_stats));
+#endif//FS_WEAR_LEVELING
+#ifdef FS_SHARED_WORK_BUF
+	if (!m_work_mutex_created)
+	{
+		m_work_mutex = fs_mutex_new(0);
+		m_work_mutex_created = true;
+	}
+	fs[file_sys_nr].mutex = m_work_mutex;
+#else
+	fs[file_sys_nr].mutex = fs_mutex_new(file_sys_nr);
+#endif//FS_SHARED_WORK_BUF
 
-	fs[file_sys_nr].cfg.phys_size = driver->size(partition);
+	fs[file_sys_nr].cfg.phys_size = FS_SPIFFS_SIZE(driver->size(partition), driver->erase_size(partition));
 	fs[file_sys_nr].cfg.phys_addr = 0;
 	fs[file_sys_nr].cfg.phys_erase_block = driver->erase_size(partition);
+#ifdef FS_BAD_BLOCKS
+	// Spares and the table follow the SPIFFS part of the partition
+	if ((driver->size(partition) <= (FS_BAD_BLOCK_SPARES + 1) * driver->erase_size(partition))
+	 || (driver->size(partition) / driver->erase_size(partition) >= 0xFFFF))
+	{
+		sys_panic("fs size");
+	}
+	fs[file_sys_nr].spare_addr = fs[file_sys_nr].cfg.phys_size;
+	fs[file_sys_nr].bad_block_count = 0;
+#endif//FS_BAD_BLOCKS
 	fs[file_sys_nr].cfg.log_block_size = FS_SPIFFS_LOG_BLOCK_SZ;
 	fs[file_sys_nr].cfg.log_page_size = FS_SPIFFS_LOG_PAGE_SZ;
 	if(0 == file_sys_nr)
@@ -160,7 +427,13 @@ void fs_init (int file_sys_nr, int partition, fs_driver_t *driver)
 			fs[file_sys_nr].cfg.log_page_size);
 
 
-	#ifndef FS_NO_CONFIG_VALIDATION
+	#if defined(FS_SPIFFS_MAX_PARTITION_SZ)
+		// Type widths have been validated at compile time for partitions up to this size
+		if (fs[file_sys_nr].cfg.phys_size > FS_SPIFFS_MAX_PARTITION_SZ)
+		{
+			sys_panic("fs size");
+		}
+	#elif !defined(FS_NO_CONFIG_VALIDATION)
 		uint32_t spiffs_file_system_size = fs[file_sys_nr].cfg.phys_size;
 		uint32_t log_block_size = fs[file_sys_nr].cfg.log_block_size;
 		uint32_t log_page_size = fs[file_sys_nr].cfg.log_page_size;
@@ -169,7 +442,7 @@ void fs_init (int file_sys_nr, int partition, fs_driver_t *driver)
 		// DEFAULT: typedef u16_t spiffs_block_ix;
 		uint32_t highest_number_of_blocks = spiffs_file_system_size / log_block_size;
 		debug1("spiffs_block_ix %u", highest_number_of_blocks);
-		if (highest_number_of_blocks > ((1 << 8*sizeof(spiffs_block_ix))-1))
+		if (highest_number_of_blocks > (spiffs_block_ix)-1)
 		{
 			sys_panic("spiffs_block_ix");
 		}
@@ -179,7 +452,7 @@ void fs_init (int file_sys_nr, int partition, fs_driver_t *driver)
 		// DEFAULT: typedef u16_t spiffs_page_ix;
 		uint32_t highest_page_number = spiffs_file_system_size / log_page_size;
 		debug1("spiffs_page_ix %"PRIu32, highest_page_number);
-		if (highest_page_number > ((1 << 8*sizeof(spiffs_page_ix))-1))
+		if (highest_page_number > (spiffs_page_ix)-1)
 		{
 			sys_panic("spiffs_page_ix");
 		}
@@ -190,7 +463,7 @@ void fs_init (int file_sys_nr, int partition, fs_driver_t *driver)
 		// DEFAULT: typedef u16_t spiffs_obj_id;
 		uint32_t highest_object_id = (2 + (spiffs_file_system_size / (2*log_page_size))*2);
 		debug1("spiffs_obj_id %"PRIu32, highest_object_id);
-		if (highest_object_id > ((1 << 8*sizeof(spiffs_obj_id))-1))
+		if (highest_object_id > SPIFFS_OBJ_ID_IX_FLAG - 1)
 		{
 			sys_panic("spiffs_obj_id");
 		}
@@ -201,23 +474,53 @@ void fs_init (int file_sys_nr, int partition, fs_driver_t *driver)
 		// DEFAULT: typedef u16_t spiffs_span_ix;
 		uint32_t largest_span_index = spiffs_file_system_size / log_page_size - 1;
 		debug1("spiffs_span_ix %"PRIu32, largest_span_index);
-		if (largest_span_index > ((1 << 8*sizeof(spiffs_span_ix))-1))
+		if (largest_span_index > (spiffs_span_ix)-1)
 		{
 			sys_panic("spiffs_span_ix");
 		}
-	#endif//FS_NO_CONFIG_VALIDATION
+	#endif//FS_SPIFFS_MAX_PARTITION_SZ / FS_NO_CONFIG_VALIDATION
 
 #ifdef FS_MANAGE_FLASH_SLEEP
 	if(file_sys_nr < FS_MAX_COUNT)
 	{
+#ifdef FS_STATIC_ALLOCATION
+		const osTimerAttr_t timer_attr = { .name = "fs_sleep",
+		                                   .cb_mem = m_sleep_timer_cbs[file_sys_nr],
+		                                   .cb_size = sizeof(m_sleep_timer_cbs[file_sys_nr]) };
+		m_sleep_timers[file_sys_nr] = osTimerNew(&fs_suspend_timer_cb, osTimerOnce, (void*)(intptr_t)file_sys_nr, &timer_attr);
+#else
 		m_sleep_timers[file_sys_nr] = osTimerNew(&fs_suspend_timer_cb, osTimerOnce, (void*)(intptr_t)file_sys_nr, NULL);
+#endif//FS_STATIC_ALLOCATION
 	}
 #endif
 }
 
 void fs_start ()
 {
-	const osThreadAttr_t thread_attr = { .name = "fs", .stack_size = 2048 };
+#ifdef FS_STATIC_ALLOCATION
+	const osMutexAttr_t mutex_attr = { .name = "fs_rec",
+	                                   .attr_bits = osMutexRecursive | osMutexPrioInherit,
+	                                   .cb_mem = m_record_mutex_cb, .cb_size = sizeof(m_record_mutex_cb) };
+#else
+	const osMutexAttr_t mutex_attr = { .name = "fs_rec",
+	                                   .attr_bits = osMutexRecursive | osMutexPrioInherit };
+#endif//FS_STATIC_ALLOCATION
+	m_record_mutex_id = osMutexNew(&mutex_attr);
+	if (NULL == m_record_mutex_id)
+	{
+		err1("!Mutex");
+		while(1);
+	}
+
+#ifdef FS_STATIC_ALLOCATION
+	const osThreadAttr_t thread_attr = { .name = "fs",
+	                                     .cb_mem = m_thread_cb, .cb_size = sizeof(m_thread_cb),
+	                                     .stack_mem = m_thread_stack, .stack_size = sizeof(m_thread_stack),
+	                                     .priority = FS_THREAD_PRIORITY };
+#else
+	const osThreadAttr_t thread_attr = { .name = "fs", .stack_size = FS_THREAD_STACK_SIZE,
+	                                     .priority = FS_THREAD_PRIORITY };
+#endif//FS_STATIC_ALLOCATION
 	m_thread_id = osThreadNew(fs_thread, NULL, &thread_attr);
 	if (NULL == m_thread_id)
 	{
@@ -225,25 +528,100 @@ void fs_start ()
 		while(1);
 	}
 
+#ifdef FS_STATIC_ALLOCATION
+	const osMessageQueueAttr_t wr_q_attr = { .name = "fs_wr_q",
+	                                         .cb_mem = m_wr_queue_cb, .cb_size = sizeof(m_wr_queue_cb),
+	                                         .mq_mem = m_wr_queue_mem, .mq_size = sizeof(m_wr_queue_mem) };
+#else
 	const osMessageQueueAttr_t wr_q_attr = { .name = "fs_wr_q" };
-	m_wr_queue_id = osMessageQueueNew(MAX_Q_WR_COUNT, sizeof(fs_rw_params_t), &wr_q_attr);
+#endif//FS_STATIC_ALLOCATION
+	m_wr_queue_id = osMessageQueueNew(FS_RECORD_WR_QUEUE_COUNT, sizeof(fs_rw_params_t), &wr_q_attr);
 	if (NULL == m_wr_queue_id)
 	{
 		err1("!Queue");
 		while(1);
 	}
 
+#ifdef FS_STATIC_ALLOCATION
+	const osMessageQueueAttr_t rd_q_attr = { .name = "fs_rd_q",
+	                                         .cb_mem = m_rd_queue_cb, .cb_size = sizeof(m_rd_queue_cb),
+	                                         .mq_mem = m_rd_queue_mem, .mq_size = sizeof(m_rd_queue_mem) };
+#else
 	const osMessageQueueAttr_t rd_q_attr = { .name = "fs_rd_q" };
-	m_rd_queue_id = osMessageQueueNew(MAX_Q_RD_COUNT, sizeof(fs_rw_params_t), &rd_q_attr);
+#endif//FS_STATIC_ALLOCATION
+	m_rd_queue_id = osMessageQueueNew(FS_RECORD_RD_QUEUE_COUNT, sizeof(fs_rw_params_t), &rd_q_attr);
 	if (NULL == m_rd_queue_id)
 	{
 		err1("!Queue");
 		while(1);
 	}
+
+#ifdef FS_STATIC_ALLOCATION
+	const osMessageQueueAttr_t name_q_attr = { .name = "fs_name_q",
+	                                           .cb_mem = m_name_queue_cb, .cb_size = sizeof(m_name_queue_cb),
+	                                           .mq_mem = m_name_queue_mem, .mq_size = sizeof(m_name_queue_mem) };
+#else
+	const osMessageQueueAttr_t name_q_attr = { .name = "fs_name_q" };
+#endif//FS_STATIC_ALLOCATION
+	m_name_queue_id = osMessageQueueNew(FS_RECORD_NAME_COUNT, sizeof(uint8_t), &name_q_attr);
+	if (NULL == m_name_queue_id)
+	{
+		err1("!Queue");
+		while(1);
+	}
+	for (uint8_t i = 0; i < FS_RECORD_NAME_COUNT; i++)
+	{
+		osMessageQueuePut(m_name_queue_id, &i, 0U, 0);
+	}
 	// For now we just mount it in the current thread
 	fs_mount();
 }
 
+void fs_write_verify (int file_sys_nr, bool enable)
+{
+	platform_mutex_acquire(fs[file_sys_nr].mutex);
+	fs[file_sys_nr].write_verify = enable;
+	platform_mutex_release(fs[file_sys_nr].mutex);
+}
+
+#ifdef FS_BAD_BLOCKS
+uint32_t fs_bad_block_count (int file_sys_nr)
+{
+	platform_mutex_acquire(fs[file_sys_nr].mutex);
+	uint32_t count = fs[file_sys_nr].bad_block_count;
+	platform_mutex_release(fs[file_sys_nr].mutex);
+	return count;
+}
+#endif//FS_BAD_BLOCKS
+
+#if FS_RECORD_CACHE_ENTRIES > 0
+uint32_t fs_record_cache_hits (int file_sys_nr)
+{
+	platform_mutex_acquire(fs[file_sys_nr].mutex);
+	uint32_t hits = fs[file_sys_nr].cache_hits;
+	platform_mutex_release(fs[file_sys_nr].mutex);
+	return hits;
+}
+#endif//FS_RECORD_CACHE_ENTRIES
+
+#ifdef FS_WEAR_LEVELING
+void fs_wear_stats (int file_sys_nr, fs_wear_stats_t * p_stats)
+{
+	platform_mutex_acquire(fs[file_sys_nr].mutex);
+	*p_stats = fs[file_sys_nr].wear_stats;
+	platform_mutex_release(fs[file_sys_nr].mutex);
+}
+#endif//FS_WEAR_LEVELING
+
+uint32_t fs_thread_stack_free ()
+{
+	if (NULL == m_thread_id)
+	{
+		return 0;
+	}
+	return osThreadGetStackSpace(m_thread_id);
+}
+
 int32_t fs_info (int file_sys_nr, uint32_t * p_total, uint32_t * p_used)
 {
 	fs_abort_suspend(file_sys_nr);
@@ -278,9 +656,16 @@ fs_fd fs_open (int file_sys_nr, char *path, uint32_t flags)
 	while(!fs[file_sys_nr].ready);
 	fs[file_sys_nr].driver->lock();
 	debug1("open %d: %s", file_sys_nr, path);
+#if FS_RECORD_CACHE_ENTRIES > 0
+	if (flags & FS_TRUNC)
+	{
+		fs_cache_drop_name(file_sys_nr, path);
+	}
+#endif//FS_RECORD_CACHE_ENTRIES
 	sfd = SPIFFS_open(&fs[file_sys_nr].fs, path, flags, 0);
 	debug1("sfd:%d", sfd);
 	fs[file_sys_nr].driver->unlock();
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_OPEN, (uint8_t)flags, fs_trace_name_id(path), sfd);
 	fd = (fs[file_sys_nr].mount_count << 16) | sfd;
 	fs_plan_suspend(file_sys_nr);
 	platform_mutex_release(fs[file_sys_nr].mutex);
@@ -295,6 +680,7 @@ int32_t fs_read (int file_sys_nr, fs_fd fd, void *buf, int32_t len)
 {
 	int32_t ret;
 
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_READ, 0, (uint16_t)fd, len);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
@@ -317,6 +703,7 @@ int32_t fs_write (int file_sys_nr, fs_fd fd, const void *buf, int32_t len)
 {
 	int32_t ret;
 
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_WRITE, 0, (uint16_t)fd, len);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
@@ -327,6 +714,9 @@ int32_t fs_write (int file_sys_nr, fs_fd fd, const void *buf, int32_t len)
 	else
 	{
 		fs[file_sys_nr].driver->lock();
+#if FS_RECORD_CACHE_ENTRIES > 0
+		fs_cache_drop_file(file_sys_nr, (fd & 0xFFFF));
+#endif//FS_RECORD_CACHE_ENTRIES
 		ret = SPIFFS_write(&fs[file_sys_nr].fs, (fd & 0xFFFF), (void *)buf, len);
 		fs[file_sys_nr].driver->unlock();
 	}
@@ -339,6 +729,7 @@ int32_t fs_lseek (int file_sys_nr, fs_fd fd, int32_t offs, int whence)
 {
 	int32_t ret;
 
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_LSEEK, (uint8_t)whence, (uint16_t)fd, offs);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
@@ -362,6 +753,7 @@ int32_t fs_fstat (int file_sys_nr, fs_fd fd, fs_stat *s)
 	int32_t ret;
 	spiffs_stat stat;
 
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_FSTAT, 0, (uint16_t)fd, 0);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
@@ -383,6 +775,7 @@ int32_t fs_fstat (int file_sys_nr, fs_fd fd, fs_stat *s)
 
 void fs_flush (int file_sys_nr, fs_fd fd)
 {
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_FLUSH, 0, (uint16_t)fd, 0);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
@@ -402,6 +795,7 @@ void fs_flush (int file_sys_nr, fs_fd fd)
 
 void fs_close (int file_sys_nr, fs_fd fd)
 {
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_CLOSE, 0, (uint16_t)fd, 0);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
@@ -421,17 +815,43 @@ void fs_close (int file_sys_nr, fs_fd fd)
 
 void fs_unlink (int file_sys_nr, char *path)
 {
+	FS_TRACE_CALL(file_sys_nr, FS_TRACE_UNLINK, 0, fs_trace_name_id(path), 0);
 	fs_abort_suspend(file_sys_nr);
 	platform_mutex_acquire(fs[file_sys_nr].mutex);
 	while(!fs[file_sys_nr].ready);
 	fs[file_sys_nr].driver->lock();
 	debug1("unlink: %s", path);
+#if FS_RECORD_CACHE_ENTRIES > 0
+	fs_cache_drop_name(file_sys_nr, path);
+#endif//FS_RECORD_CACHE_ENTRIES
 	SPIFFS_remove(&fs[file_sys_nr].fs, path);
 	fs[file_sys_nr].driver->unlock();
 	fs_plan_suspend(file_sys_nr);
 	platform_mutex_release(fs[file_sys_nr].mutex);
 }
 
+static platform_mutex_t fs_mutex_new (int file_sys_nr)
+{
+#ifdef FS_STATIC_ALLOCATION
+	// platform_mutex is a CMSIS mutex, create it with a static control block,
+	// using the same attributes as platform_mutex_new.
+	const osMutexAttr_t attr = { .name = "fs",
+	                             .attr_bits = osMutexRecursive | osMutexPrioInherit,
+	                             .cb_mem = m_mutex_cbs[file_sys_nr],
+	                             .cb_size = sizeof(m_mutex_cbs[file_sys_nr]) };
+	platform_mutex_t mutex = (platform_mutex_t)osMutexNew(&attr);
+	if (NULL == mutex)
+	{
+		err1("!Mutex");
+		while(1);
+	}
+	return mutex;
+#else
+	(void)file_sys_nr;
+	return platform_mutex_new("fs");
+#endif//FS_STATIC_ALLOCATION
+}
+
 static void fs_mount ()
 {
 	for (int f = 0; f < FS_MAX_COUNT; f++)
@@ -444,14 +864,20 @@ static void fs_mount ()
 		debug1("mounting fs #%d", f);
 		fs[f].driver->lock();
 
+#ifdef FS_BAD_BLOCKS
+		fs_bb_load(f);
+#endif//FS_BAD_BLOCKS
 
-		int ret = SPIFFS_mount(&fs[f].fs, &fs[f].cfg, fs[f].work_buf, fs[f].fds, sizeof(fs[f].fds), NULL, 0, NULL);
+		int ret = SPIFFS_mount(&fs[f].fs, &fs[f].cfg, FS_WORK_BUF(f), (u8_t *)fs[f].fds, sizeof(fs[f].fds), NULL, 0, NULL);
 		if(SPIFFS_OK != ret)
 		{
 			debug1("formatting #%d", f);
+#if FS_RECORD_CACHE_ENTRIES > 0
+			memset(fs[f].cache, 0, sizeof(fs[f].cache));
+#endif//FS_RECORD_CACHE_ENTRIES
 			s32_t r = SPIFFS_format(&fs[f].fs);
 			logger(0 == r ? LOG_DEBUG1: LOG_ERR1, "fmt %d", (int)r);
-			r = SPIFFS_mount(&fs[f].fs, &fs[f].cfg, fs[f].work_buf, fs[f].fds, sizeof(fs[f].fds), NULL, 0, NULL);
+			r = SPIFFS_mount(&fs[f].fs, &fs[f].cfg, FS_WORK_BUF(f), (u8_t *)fs[f].fds, sizeof(fs[f].fds), NULL, 0, NULL);
 			logger(0 == r ? LOG_DEBUG1: LOG_ERR1, "mnt %d", (int)r);
 			ret = r;
 		}
@@ -463,6 +889,9 @@ static void fs_mount ()
 			{
 				debug1("fs #%d ready, total: %u, used: %u", f, (unsigned int)total, (unsigned int)used);
 				fs[f].ready = 1;
+#ifdef FS_WEAR_LEVELING
+				fs_wear_load(f);
+#endif//FS_WEAR_LEVELING
 			}
 			else
 			{
@@ -491,13 +920,15 @@ static void fs_thread (void * p)
 {
 	osStatus_t res;
 	fs_rw_params_t params;
-	fs_fd file_desc;
 	int32_t fs_res;
 	uint32_t flags;
+#ifdef FS_THREAD_STACK_WARN
+	bool stack_warned = false;
+#endif//FS_THREAD_STACK_WARN
 
+	// Flags are not cleared here, a new thread has none, and any set before
+	// it first runs are requests queued from fs_start or other threads
 	debug1("Thread starts");
-	flags = osThreadFlagsClear(FS_THREAD_FLAGS_ALL);
-	debug1("ThrFlgs:0x%X", flags);
 
 	for (;;)
 	{
@@ -513,58 +944,49 @@ static void fs_thread (void * p)
 		{
 			debug1("Wr Thread");
 			// wait parameter is set to 0 to avoid thread blocking because there should be data in the queue
+			osMutexAcquire(m_record_mutex_id, osWaitForever);
 			res = osMessageQueueGet(m_wr_queue_id, (void*)&params, NULL, 0);
+			if (osOK == res)
+			{
+				fs_res = fs_record_write(&params);
+			}
+			osMutexRelease(m_record_mutex_id);
 			switch (res)
 			{
 				case osOK:
-					// open file for writing
-					debug2("p:%d f:%s pv:%p l:%d fnc:%p",
-						   params.file_sys_nr, \
-						   params.p_file_name, \
-						   params.p_value, \
-						   params.len, \
-						   params.f_callback);
-
-					file_desc = fs_open(params.file_sys_nr, (void*)params.p_file_name, FS_WRONLY);
-					if (file_desc < 0)
-					{
-						// file does not exists or some other error
-						debug1("File not exists:%s", params.p_file_name);
-						// try to create new file
-						file_desc = fs_open(params.file_sys_nr, (void*)params.p_file_name, FS_TRUNC | FS_CREAT | FS_WRONLY);
-						if (file_desc < 0)
-						{
-							err1("Cannot create file:%s", params.p_file_name);
-							params.f_callback(0, params.p_user);
-						}
-					}
-					if (file_desc >= 0)
-					{
-						fs_res = fs_write(params.file_sys_nr, file_desc, params.p_value, params.len);
-						fs_close(params.file_sys_nr, file_desc);
-						params.f_callback(fs_res, params.p_user);
-					}
+					params.f_callback(fs_res, params.p_user);
 				break;
 
+				// No request was taken, there is no callback to call
 				case osErrorResource:
-					err1("Queue empty!");
-					params.f_callback(0, params.p_user);
+					// An emergency flush has written out the queue
+					debug1("Queue empty");
 				break;
 
 				case osErrorParameter:
 					err1("Parameter!");
-					params.f_callback(0, params.p_user);
 				break;
 
 				default:
 					err1("Unknown error!");
-					params.f_callback(0, params.p_user);
 			}
 			if (osMessageQueueGetCount(m_wr_queue_id) > 0)
 			{
 				debug1("Wr pending");
 				osThreadFlagsSet(m_thread_id, FS_WRITE_FLAG);
 			}
+#if FS_EMERGENCY_RESERVE > 0
+			else if (!m_emergency)
+			{
+				for (int f = 0; f < FS_MAX_COUNT; f++)
+				{
+					if ((NULL != fs[f].driver) && fs[f].ready)
+					{
+						fs_emergency_reserve(f);
+					}
+				}
+			}
+#endif//FS_EMERGENCY_RESERVE
 		}
 
 		if (flags & FS_READ_FLAG)
@@ -576,35 +998,21 @@ static void fs_thread (void * p)
 			switch (res)
 			{
 				case osOK:
-					file_desc = fs_open(params.file_sys_nr, (void*)params.p_file_name, FS_RDONLY);
-					debug1("fd:%d", file_desc);
-					if (file_desc < 0)
-					{
-						// file does not exists or some other error
-						debug1("File not exists:%s", params.p_file_name);
-						params.f_callback(0, params.p_user);
-					}
-					else
-					{
-						fs_res = fs_read(params.file_sys_nr, file_desc, params.p_value, params.len);
-						fs_close(params.file_sys_nr, file_desc);
-						params.f_callback(fs_res, params.p_user);
-					}
+					fs_res = fs_record_read(&params);
+					params.f_callback(fs_res, params.p_user);
 				break;
 
+				// No request was taken, there is no callback to call
 				case osErrorResource:
 					err1("Queue empty!");
-					params.f_callback(0, params.p_user);
 				break;
 
 				case osErrorParameter:
 					err1("Parameter!");
-					params.f_callback(0, params.p_user);
 				break;
 
 				default:
 					err1("Unknown error!");
-					params.f_callback(0, params.p_user);
 			}
 			if (osMessageQueueGetCount(m_rd_queue_id) > 0)
 			{
@@ -613,6 +1021,40 @@ static void fs_thread (void * p)
 			}
 		}
 
+#ifdef FS_WEAR_LEVELING
+		if ((flags & FS_WEAR_FLAG) && !m_emergency)
+		{
+			if (osMessageQueueGetCount(m_wr_queue_id) + osMessageQueueGetCount(m_rd_queue_id) > 0)
+			{
+				// Records go first, come back when the queues are empty
+				osThreadFlagsSet(m_thread_id, FS_WEAR_FLAG);
+			}
+			else
+			{
+				for (int f = 0; f < FS_MAX_COUNT; f++)
+				{
+					if (NULL != fs[f].driver)
+					{
+						fs_wear_level(f);
+					}
+				}
+			}
+		}
+#endif//FS_WEAR_LEVELING
+
+#ifdef FS_THREAD_STACK_WARN
+		// Report once when stack usage has come close to the limit
+		if (!stack_warned)
+		{
+			uint32_t stack_free = osThreadGetStackSpace(m_thread_id);
+			if (stack_free < FS_THREAD_STACK_WARN)
+			{
+				warn1("stack free %u", (unsigned int)stack_free);
+				stack_warned = true;
+			}
+		}
+#endif//FS_THREAD_STACK_WARN
+
 		if (flags & FS_SUSPENDFLAGS)
 		{
 			for (int f=0; f<FS_MAX_COUNT; f++)
@@ -696,89 +1138,671 @@ static int fs_error_increase (int32_t error)
 }
 #endif
 
-static int32_t fs_read0 (uint32_t addr, uint32_t size, uint8_t * dst)
+// Driver errors are passed to SPIFFS as they are, SPIFFS returns them from
+// the API call that failed.
+static int32_t fs_hal_error (int32_t ret)
 {
-	if (fs[0].driver->read(fs[0].partition, addr, size, dst) < 0)
+	switch (ret)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		case FS_ERR_TRANSIENT:
+		case FS_ERR_TIMEOUT:
+		case FS_ERR_VERIFY:
+		case FS_ERR_HARD:
+			return ret;
+		default:
+			return FS_ERR_HARD;
 	}
-	return SPIFFS_OK;
 }
 
-static int32_t fs_write0 (uint32_t addr, uint32_t size, uint8_t * src)
+// Check if a failed driver operation should be tried again
+static bool fs_hal_retry (int f, int attempt, int32_t err)
 {
-	if (fs[0].driver->write(fs[0].partition, addr, size, src) < 0)
+	if ((attempt >= FS_HAL_RETRIES) || ((FS_ERR_TRANSIENT != err) && (FS_ERR_TIMEOUT != err)))
 	{
-		return SPIFFS_ERR_INTERNAL;
+		err1("hal #%d %d", f, (int)err);
+		return false;
 	}
-	return SPIFFS_OK;
+	warn1("hal #%d %d retry", f, (int)err);
+	#if FS_HAL_RETRY_DELAY > 0
+		osDelay(FS_HAL_RETRY_DELAY);
+	#endif//FS_HAL_RETRY_DELAY
+	return true;
 }
 
-static int32_t fs_erase0 (uint32_t addr, uint32_t size)
+static int32_t fs_flash_read (int f, uint32_t addr, uint32_t size, uint8_t * dst)
 {
-	if (fs[0].driver->erase(fs[0].partition, addr, size) < 0)
+	for (int attempt = 0;; attempt++)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		int32_t ret = fs[f].driver->read(fs[f].partition, addr, size, dst);
+		if (ret >= 0)
+		{
+			return SPIFFS_OK;
+		}
+		ret = fs_hal_error(ret);
+		if (!fs_hal_retry(f, attempt, ret))
+		{
+			return ret;
+		}
 	}
-	return SPIFFS_OK;
 }
 
-#if FS_MAX_COUNT > 1
-static int32_t fs_read1 (uint32_t addr, uint32_t size, uint8_t * dst)
+// Compare a chunk read from flash with the data written, word by word when
+// the data is aligned. SPIFFS updates page flags with blind writes over
+// bytes that already have other bits cleared, so only the bits that the
+// data clears are checked. Without data the chunk must be erased.
+static bool fs_hal_verify_equal (const uint32_t * flash, const uint8_t * src, uint32_t size)
 {
-	if (fs[1].driver->read(fs[1].partition, addr, size, dst) < 0)
+	uint32_t words = 0;
+	if (NULL == src)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		const uint8_t * tail = (const uint8_t *)flash + (size / sizeof(uint32_t)) * sizeof(uint32_t);
+		for (uint32_t i = 0; i < size / sizeof(uint32_t); i++)
+		{
+			if (0xFFFFFFFFUL != flash[i])
+			{
+				return false;
+			}
+		}
+		for (uint32_t i = 0; i < size % sizeof(uint32_t); i++)
+		{
+			if (0xFF != tail[i])
+			{
+				return false;
+			}
+		}
+		return true;
 	}
-	return SPIFFS_OK;
+	if (0 == ((uintptr_t)src % sizeof(uint32_t)))
+	{
+		const uint32_t * s = (const uint32_t *)src;
+		words = size / sizeof(uint32_t);
+		for (uint32_t i = 0; i < words; i++)
+		{
+			if (0 != (flash[i] & ~s[i]))
+			{
+				return false;
+			}
+		}
+	}
+	const uint8_t * f8 = (const uint8_t *)flash;
+	for (uint32_t i = words * sizeof(uint32_t); i < size; i++)
+	{
+		if (0 != (f8[i] & (uint8_t)~src[i]))
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
-static int32_t fs_write1 (uint32_t addr, uint32_t size, uint8_t * src)
+// Read back the written or erased range only, in chunks
+static int32_t fs_hal_verify (int f, uint32_t addr, uint32_t size, const uint8_t * src)
 {
-	if (fs[1].driver->write(fs[1].partition, addr, size, src) < 0)
+	uint32_t chunk[FS_WRITE_VERIFY_CHUNK / sizeof(uint32_t)];
+	for (uint32_t done = 0; done < size; done += sizeof(chunk))
 	{
-		return SPIFFS_ERR_INTERNAL;
+		uint32_t len = (size - done < sizeof(chunk)) ? size - done : sizeof(chunk);
+		int32_t ret = fs[f].driver->read(fs[f].partition, addr + done, len, (uint8_t *)chunk);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		if (!fs_hal_verify_equal(chunk, (NULL != src) ? &src[done] : NULL, len))
+		{
+			warn1("vrf #%d %"PRIu32, f, addr + done);
+			return FS_ERR_VERIFY;
+		}
 	}
 	return SPIFFS_OK;
 }
 
-static int32_t fs_erase1 (uint32_t addr, uint32_t size)
+// Programming only clears bits, so repeating a partly done write is safe
+static int32_t fs_flash_write (int f, uint32_t addr, uint32_t size, uint8_t * src)
+{
+	for (int attempt = 0;; attempt++)
+	{
+		int32_t ret = fs[f].driver->write(fs[f].partition, addr, size, src);
+		if ((ret >= 0) && fs[f].write_verify)
+		{
+			ret = fs_hal_verify(f, addr, size, src);
+		}
+		if (ret >= 0)
+		{
+			return SPIFFS_OK;
+		}
+		ret = fs_hal_error(ret);
+		if (!fs_hal_retry(f, attempt, ret))
+		{
+			return ret;
+		}
+	}
+}
+
+static int32_t fs_flash_erase (int f, uint32_t addr, uint32_t size)
+{
+	for (int attempt = 0;; attempt++)
+	{
+		int32_t ret = fs[f].driver->erase(fs[f].partition, addr, size);
+		if ((ret >= 0) && fs[f].write_verify)
+		{
+			ret = fs_hal_verify(f, addr, size, NULL);
+		}
+		if (ret >= 0)
+		{
+			return SPIFFS_OK;
+		}
+		ret = fs_hal_error(ret);
+		if (!fs_hal_retry(f, attempt, ret))
+		{
+			return ret;
+		}
+	}
+}
+
+#ifdef FS_BAD_BLOCKS
+// Erase blocks that fail are replaced by spare blocks at the end of the
+// partition, after the part given to SPIFFS. The last erase block holds the
+// table of replacements, an append-only list of 8 byte entries, one for every
+// used spare in order. An entry holds the replaced block number with a magic
+// in the first word and its inverse in the second, a torn or damaged entry
+// only uses up its spare.
+#define FS_BB_MAGIC      0xBAD0UL
+#define FS_BB_NONE       0xFFFF // Spare is used up, but does not replace a block
+#define FS_BB_ENTRY_SIZE 8
+
+static uint32_t fs_bb_table_addr (int f)
+{
+	return fs[f].spare_addr + FS_BAD_BLOCK_SPARES * fs[f].cfg.phys_erase_block;
+}
+
+// Physical address of a SPIFFS address, the latest replacement of a block wins
+static uint32_t fs_bb_map (int f, uint32_t addr)
+{
+	uint32_t erase_size = fs[f].cfg.phys_erase_block;
+	uint32_t block = addr / erase_size;
+	for (int i = fs[f].bad_block_count - 1; i >= 0; i--)
+	{
+		if (fs[f].bad_blocks[i] == block)
+		{
+			return fs[f].spare_addr + i * erase_size + addr % erase_size;
+		}
+	}
+	return addr;
+}
+
+static void fs_bb_load (int f)
 {
-	if (fs[1].driver->erase(fs[1].partition, addr, size) < 0)
+	uint32_t entry[2];
+	fs[f].bad_block_count = 0;
+	for (int i = 0; i < FS_BAD_BLOCK_SPARES; i++)
+	{
+		if (SPIFFS_OK != fs_flash_read(f, fs_bb_table_addr(f) + i * FS_BB_ENTRY_SIZE, sizeof(entry), (uint8_t *)entry))
+		{
+			// Keep the entries that were read, the rest of the spares are not used
+			err1("bbt #%d", f);
+			for (int j = i; j < FS_BAD_BLOCK_SPARES; j++)
+			{
+				fs[f].bad_blocks[j] = FS_BB_NONE;
+			}
+			fs[f].bad_block_count = FS_BAD_BLOCK_SPARES;
+			break;
+		}
+		if ((0xFFFFFFFFUL == entry[0]) && (0xFFFFFFFFUL == entry[1]))
+		{
+			break;
+		}
+		if ((entry[1] == ~entry[0]) && ((entry[0] >> 16) == FS_BB_MAGIC))
+		{
+			fs[f].bad_blocks[i] = (uint16_t)entry[0];
+		}
+		else
+		{
+			fs[f].bad_blocks[i] = FS_BB_NONE;
+		}
+		fs[f].bad_block_count = i + 1;
+	}
+	if (fs[f].bad_block_count > 0)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		warn1("#%d %d bad blocks", f, (int)fs[f].bad_block_count);
+	}
+}
+
+// Copy a block to a spare, except the range that is being programmed.
+// p_read_failed tells if the error came from the block being replaced.
+static int32_t fs_bb_copy (int f, uint32_t from, uint32_t to, uint32_t skip_offset, uint32_t skip_size, bool * p_read_failed)
+{
+	uint32_t chunk[FS_WRITE_VERIFY_CHUNK / sizeof(uint32_t)];
+	uint8_t * bytes = (uint8_t *)chunk;
+	*p_read_failed = false;
+	for (uint32_t offset = 0; offset < fs[f].cfg.phys_erase_block; offset += sizeof(chunk))
+	{
+		int32_t ret = fs_flash_read(f, from + offset, sizeof(chunk), bytes);
+		if (SPIFFS_OK != ret)
+		{
+			*p_read_failed = true;
+			return ret;
+		}
+		bool erased = true;
+		for (uint32_t i = 0; i < sizeof(chunk); i++)
+		{
+			if ((offset + i >= skip_offset) && (offset + i < skip_offset + skip_size))
+			{
+				bytes[i] = 0xFF;
+			}
+			erased = erased && (0xFF == bytes[i]);
+		}
+		if (!erased)
+		{
+			ret = fs_flash_write(f, to + offset, sizeof(chunk), bytes);
+			if (SPIFFS_OK != ret)
+			{
+				return ret;
+			}
+		}
 	}
 	return SPIFFS_OK;
 }
-#endif
 
-#if FS_MAX_COUNT > 2
-static int32_t fs_read2 (uint32_t addr, uint32_t size, uint8_t * dst)
+// Replace a failing block with the next spare. The contents are copied and
+// the spare is ready before the table entry is written, so a reset during
+// the replacement leaves the old block in use.
+static int32_t fs_bb_replace (int f, uint32_t block, uint32_t skip_offset, uint32_t skip_size)
+{
+	uint32_t erase_size = fs[f].cfg.phys_erase_block;
+	uint32_t from = fs_bb_map(f, block * erase_size);
+	while (fs[f].bad_block_count < FS_BAD_BLOCK_SPARES)
+	{
+		int slot = fs[f].bad_block_count;
+		uint32_t spare = fs[f].spare_addr + slot * erase_size;
+		uint32_t entry[2];
+
+		warn1("bad #%d %"PRIu32"->%d", f, block, slot);
+		int32_t ret = fs_flash_erase(f, spare, erase_size);
+		if ((SPIFFS_OK == ret) && (skip_size < erase_size))
+		{
+			bool read_failed;
+			ret = fs_bb_copy(f, from, spare, skip_offset, skip_size, &read_failed);
+			if (read_failed)
+			{
+				// Another spare would not help, the spare stays unused
+				err1("bad #%d %"PRIu32" rd %d", f, block, (int)ret);
+				return ret;
+			}
+		}
+		entry[0] = (FS_BB_MAGIC << 16) | ((SPIFFS_OK == ret) ? block : FS_BB_NONE);
+		entry[1] = ~entry[0];
+		if (SPIFFS_OK != fs_flash_write(f, fs_bb_table_addr(f) + slot * FS_BB_ENTRY_SIZE, sizeof(entry), (uint8_t *)entry))
+		{
+			err1("bbt #%d", f);
+			return FS_ERR_HARD;
+		}
+		fs[f].bad_blocks[slot] = (uint16_t)(entry[0] & 0xFFFF);
+		fs[f].bad_block_count = slot + 1;
+		if (SPIFFS_OK == ret)
+		{
+			return SPIFFS_OK;
+		}
+		// The spare failed too, try the next one
+	}
+	err1("no spare #%d", f);
+	return FS_ERR_HARD;
+}
+
+// Blocks that fail to program or erase after the retries are replaced
+static bool fs_bb_failed (int32_t err)
+{
+	return (FS_ERR_VERIFY == err) || (FS_ERR_HARD == err);
+}
+
+// Operations are split at erase block boundaries, every block is mapped on its own
+static int32_t fs_hal_read (int f, uint32_t addr, uint32_t size, uint8_t * dst)
 {
-	if (fs[2].driver->read(fs[2].partition, addr, size, dst) < 0)
+	uint32_t erase_size = fs[f].cfg.phys_erase_block;
+	while (size > 0)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		uint32_t len = erase_size - addr % erase_size;
+		len = (len < size) ? len : size;
+		int32_t ret = fs_flash_read(f, fs_bb_map(f, addr), len, dst);
+		if (SPIFFS_OK != ret)
+		{
+			return ret;
+		}
+		addr += len;
+		dst += len;
+		size -= len;
 	}
 	return SPIFFS_OK;
 }
 
-static int32_t fs_write2 (uint32_t addr, uint32_t size, uint8_t * src)
+static int32_t fs_hal_write (int f, uint32_t addr, uint32_t size, uint8_t * src)
 {
-	if (fs[2].driver->write(fs[2].partition, addr, size, src) < 0)
+	uint32_t erase_size = fs[f].cfg.phys_erase_block;
+	while (size > 0)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		uint32_t len = erase_size - addr % erase_size;
+		len = (len < size) ? len : size;
+		int32_t ret = fs_flash_write(f, fs_bb_map(f, addr), len, src);
+		if (fs_bb_failed(ret))
+		{
+			ret = fs_bb_replace(f, addr / erase_size, addr % erase_size, len);
+			if (SPIFFS_OK == ret)
+			{
+				ret = fs_flash_write(f, fs_bb_map(f, addr), len, src);
+			}
+		}
+		if (SPIFFS_OK != ret)
+		{
+			return ret;
+		}
+		addr += len;
+		src += len;
+		size -= len;
 	}
 	return SPIFFS_OK;
 }
 
-static int32_t fs_erase2 (uint32_t addr, uint32_t size)
+static int32_t fs_hal_erase (int f, uint32_t addr, uint32_t size)
 {
-	if (fs[2].driver->erase(fs[2].partition, addr, size) < 0)
+	uint32_t erase_size = fs[f].cfg.phys_erase_block;
+	for (; size >= erase_size; addr += erase_size, size -= erase_size)
 	{
-		return SPIFFS_ERR_INTERNAL;
+		int32_t ret = fs_flash_erase(f, fs_bb_map(f, addr), erase_size);
+		if (fs_bb_failed(ret))
+		{
+			// Contents are being discarded, nothing to copy
+			ret = fs_bb_replace(f, addr / erase_size, 0, erase_size);
+		}
+		if (SPIFFS_OK != ret)
+		{
+			return ret;
+		}
 	}
 	return SPIFFS_OK;
 }
+#else
+#define fs_hal_read  fs_flash_read
+#define fs_hal_write fs_flash_write
+#define fs_hal_erase fs_flash_erase
+#endif//FS_BAD_BLOCKS
+
+int32_t fs_raw_reserve (int file_sys_nr, uint32_t size)
+{
+	struct fs_struct * p_fs = &fs[file_sys_nr];
+	uint32_t total = p_fs->cfg.phys_size + p_fs->raw_size;
+	// SPIFFS needs at least two blocks
+	if ((0 != p_fs->mount_count) || (0 != size % p_fs->cfg.phys_erase_block)
+	 || (size + 2 * p_fs->cfg.log_block_size > total))
+	{
+		err1("raw %u", (unsigned int)size);
+		return FS_ERR_RANGE;
+	}
+	p_fs->cfg.phys_size = total - size;
+	p_fs->raw_addr = p_fs->cfg.phys_addr + p_fs->cfg.phys_size;
+	p_fs->raw_size = size;
+	debug1("raw #%d %u@%u", file_sys_nr, (unsigned int)size, (unsigned int)p_fs->raw_addr);
+	return 0;
+}
+
+static bool fs_raw_range (int f, uint32_t offset, uint32_t len)
+{
+	return (offset <= fs[f].raw_size) && (len <= fs[f].raw_size - offset);
+}
+
+int32_t fs_raw_write (int file_sys_nr, uint32_t offset, const void * p_data, uint32_t len)
+{
+	const uint8_t * p = (const uint8_t *)p_data;
+	uint32_t erase_size = fs[file_sys_nr].cfg.phys_erase_block;
+	uint32_t done = 0;
+	if (!fs_raw_range(file_sys_nr, offset, len))
+	{
+		return FS_ERR_RANGE;
+	}
+	while (done < len)
+	{
+		// Stop each piece at the next block, it may have to be erased first
+		uint32_t pos = offset + done;
+		uint32_t chunk = erase_size - pos % erase_size;
+		if (chunk > FS_RAW_CHUNK)
+		{
+			chunk = FS_RAW_CHUNK;
+		}
+		if (chunk > len - done)
+		{
+			chunk = len - done;
+		}
+
+		fs_abort_suspend(file_sys_nr);
+		platform_mutex_acquire(fs[file_sys_nr].mutex);
+		fs[file_sys_nr].driver->lock();
+		int32_t ret = SPIFFS_OK;
+		if (0 == pos % erase_size)
+		{
+			ret = fs_flash_erase(file_sys_nr, fs[file_sys_nr].raw_addr + pos, erase_size);
+		}
+		if (SPIFFS_OK == ret)
+		{
+			ret = fs_flash_write(file_sys_nr, fs[file_sys_nr].raw_addr + pos, chunk, (uint8_t *)&p[done]);
+		}
+		fs[file_sys_nr].driver->unlock();
+		fs_plan_suspend(file_sys_nr);
+		platform_mutex_release(fs[file_sys_nr].mutex);
+
+		if (SPIFFS_OK != ret)
+		{
+			err1("raw wr %u %d", (unsigned int)pos, (int)ret);
+			return ret;
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+int32_t fs_raw_read (int file_sys_nr, uint32_t offset, void * p_data, uint32_t len)
+{
+	uint8_t * p = (uint8_t *)p_data;
+	uint32_t done = 0;
+	if (!fs_raw_range(file_sys_nr, offset, len))
+	{
+		return FS_ERR_RANGE;
+	}
+	while (done < len)
+	{
+		uint32_t chunk = (len - done > FS_RAW_CHUNK) ? FS_RAW_CHUNK : len - done;
+
+		fs_abort_suspend(file_sys_nr);
+		platform_mutex_acquire(fs[file_sys_nr].mutex);
+		fs[file_sys_nr].driver->lock();
+		int32_t ret = fs_flash_read(file_sys_nr, fs[file_sys_nr].raw_addr + offset + done, chunk, &p[done]);
+		fs[file_sys_nr].driver->unlock();
+		fs_plan_suspend(file_sys_nr);
+		platform_mutex_release(fs[file_sys_nr].mutex);
+
+		if (SPIFFS_OK != ret)
+		{
+			err1("raw rd %u %d", (unsigned int)(offset + done), (int)ret);
+			return ret;
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+#ifdef FS_WEAR_LEVELING
+// Age of a block in filesystem erases, the same way SPIFFS gc computes it
+static spiffs_obj_id fs_wear_age (int f, spiffs_block_ix bix)
+{
+	spiffs_obj_id stamp = fs[f].erase_stamps[bix];
+	if (fs[f].fs.max_erase_count > stamp)
+	{
+		return fs[f].fs.max_erase_count - stamp;
+	}
+	return SPIFFS_OBJ_ID_FREE - (stamp - fs[f].fs.max_erase_count);
+}
+
+static void fs_wear_load (int f)
+{
+	spiffs * sfs = &fs[f].fs;
+	fs[f].wear_valid = false;
+	fs[f].wear_erases = 0;
+	if (sfs->block_count > FS_WEAR_MAX_BLOCKS)
+	{
+		warn1("fs #%d wear %u blocks", f, (unsigned int)sfs->block_count);
+		return;
+	}
+	for (spiffs_block_ix bix = 0; bix < sfs->block_count; bix++)
+	{
+		if (SPIFFS_OK != fs_hal_read(f, SPIFFS_ERASE_COUNT_PADDR(sfs, bix),
+		                             sizeof(spiffs_obj_id), (uint8_t *)&fs[f].erase_stamps[bix]))
+		{
+			err1("fs #%d wear load", f);
+			return;
+		}
+	}
+	fs[f].wear_valid = true;
+}
+
+// Relocate the data of blocks that have sat out too many erase cycles, one
+// block at a time until none is left or the time budget runs out. The data
+// is moved by SPIFFS gc, which leaves the block fully deleted to be erased
+// and reused for new data.
+static void fs_wear_level (int f)
+{
+	spiffs * sfs = &fs[f].fs;
+	uint32_t start = osKernelGetTickCount();
+	uint8_t relocated[(FS_WEAR_MAX_BLOCKS + 7) / 8];
+	memset(relocated, 0, sizeof(relocated));
+
+	fs_abort_suspend(f);
+	platform_mutex_acquire(fs[f].mutex);
+	fs[f].driver->lock();
+
+	while (fs[f].ready && fs[f].wear_valid && !m_emergency
+	    && (sfs->free_blocks >= FS_WEAR_MIN_FREE_BLOCKS)
+	    && (osKernelGetTickCount() - start < FS_WEAR_BUDGET))
+	{
+		spiffs_block_ix cold = 0;
+		for (spiffs_block_ix bix = 1; bix < sfs->block_count; bix++)
+		{
+			if (fs_wear_age(f, bix) > fs_wear_age(f, cold))
+			{
+				cold = bix;
+			}
+		}
+		spiffs_obj_id age = fs_wear_age(f, cold);
+		if (age < FS_WEAR_SPREAD * sfs->block_count)
+		{
+			break;
+		}
+
+		if (relocated[cold / 8] & (1 << (cold % 8)))
+		{
+			// The block should count as just erased now
+			warn1("fs #%d wear blk %u again", f, (unsigned int)cold);
+			fs[f].wear_stats.repeats++;
+			break;
+		}
+		relocated[cold / 8] |= (uint8_t)(1 << (cold % 8));
+		fs[f].wear_stats.relocations++;
+
+		debug1("fs #%d wear blk %u age %u", f, (unsigned int)cold, (unsigned int)age);
+		sfs->cleaning = 1;
+		s32_t ret = spiffs_gc_clean(sfs, cold);
+		sfs->cleaning = 0;
+		if (SPIFFS_OK == ret)
+		{
+			ret = SPIFFS_gc_quick(sfs, 0);
+			if (SPIFFS_ERR_NO_DELETED_BLOCKS == ret)
+			{
+				ret = SPIFFS_OK;
+			}
+		}
+		if (SPIFFS_OK != ret)
+		{
+			warn1("fs #%d wear blk %u %d", f, (unsigned int)cold, (int)ret);
+		}
+		// A block that was not erased, empty or failing, is not retried
+		// until it has aged again. SPIFFS stamps an erased block with the
+		// count before incrementing it, so the previous count is age 1.
+		fs[f].erase_stamps[cold] = (0 == sfs->max_erase_count) ? SPIFFS_OBJ_ID_IX_FLAG - 1 : sfs->max_erase_count - 1;
+	}
+	fs[f].wear_erases = 0;
+	fs[f].wear_stats.passes++;
+
+	fs[f].driver->unlock();
+	fs_plan_suspend(f);
+	platform_mutex_release(fs[f].mutex);
+}
+
+// Keep track of the erase count SPIFFS is writing to each block and wake
+// the fs thread for a relocation pass once a block count of erases is done
+static int32_t fs_wear_erase (int f, uint32_t addr, uint32_t size)
+{
+	uint32_t offset = addr - fs[f].cfg.phys_addr;
+	if (0 == offset % fs[f].cfg.log_block_size)
+	{
+		uint32_t bix = offset / fs[f].cfg.log_block_size;
+		if (bix < FS_WEAR_MAX_BLOCKS)
+		{
+			fs[f].erase_stamps[bix] = fs[f].fs.max_erase_count;
+		}
+		if ((++fs[f].wear_erases >= fs[f].fs.block_count) && fs[f].wear_valid && (NULL != m_thread_id))
+		{
+			osThreadFlagsSet(m_thread_id, FS_WEAR_FLAG);
+		}
+	}
+	return fs_hal_erase(f, addr, size);
+}
+#else
+#define fs_wear_erase fs_hal_erase
+#endif//FS_WEAR_LEVELING
+
+static int32_t fs_read0 (uint32_t addr, uint32_t size, uint8_t * dst)
+{
+	return fs_hal_read(0, addr, size, dst);
+}
+
+static int32_t fs_write0 (uint32_t addr, uint32_t size, uint8_t * src)
+{
+	return fs_hal_write(0, addr, size, src);
+}
+
+static int32_t fs_erase0 (uint32_t addr, uint32_t size)
+{
+	return fs_wear_erase(0, addr, size);
+}
+
+#if FS_MAX_COUNT > 1
+static int32_t fs_read1 (uint32_t addr, uint32_t size, uint8_t * dst)
+{
+	return fs_hal_read(1, addr, size, dst);
+}
+
+static int32_t fs_write1 (uint32_t addr, uint32_t size, uint8_t * src)
+{
+	return fs_hal_write(1, addr, size, src);
+}
+
+static int32_t fs_erase1 (uint32_t addr, uint32_t size)
+{
+	return fs_wear_erase(1, addr, size);
+}
+#endif
+
+#if FS_MAX_COUNT > 2
+static int32_t fs_read2 (uint32_t addr, uint32_t size, uint8_t * dst)
+{
+	return fs_hal_read(2, addr, size, dst);
+}
+
+static int32_t fs_write2 (uint32_t addr, uint32_t size, uint8_t * src)
+{
+	return fs_hal_write(2, addr, size, src);
+}
+
+static int32_t fs_erase2 (uint32_t addr, uint32_t size)
+{
+	return fs_wear_erase(2, addr, size);
+}
 #endif
 
 #if FS_MAX_COUNT > 3
@@ -811,8 +1835,21 @@ static int32_t fs_rw_record (uint8_t command_type,
 	osMessageQueueId_t q_id;
 	uint32_t flags;
 
+	if ((len < 0) || (len > UINT16_MAX))
+	{
+		err1("len:%d", (int)len);
+		return 0;
+	}
+
+	int name_id = fs_record_name_get(p_file_name);
+	if (name_id < 0)
+	{
+		warn1("Names full!");
+		return 0;
+	}
+
 	params.file_sys_nr = file_sys_nr;
-	params.p_file_name = (void*)p_file_name;
+	params.name_id = name_id;
 	params.p_value = (void*)p_value;
 	params.len = len;
 	params.f_callback = f_callback;
@@ -820,7 +1857,7 @@ static int32_t fs_rw_record (uint8_t command_type,
 
 	debug2("p:%d f:%s pv:%p l:%d fnc:%p",
 		   params.file_sys_nr, \
-		   params.p_file_name, \
+		   p_file_name, \
 		   params.p_value, \
 		   params.len, \
 		   params.f_callback);
@@ -841,6 +1878,7 @@ static int32_t fs_rw_record (uint8_t command_type,
 
 		default:
 			err1("!Cmd");
+			fs_record_name_put(name_id);
 			return 0;
 	}
 
@@ -852,6 +1890,10 @@ static int32_t fs_rw_record (uint8_t command_type,
 	switch (res)
 	{
 		case osOK:
+#ifdef FS_TRACE
+			fs_trace_add(file_sys_nr, (FS_WRITE_DATA == command_type) ? FS_TRACE_WRITE_RECORD : FS_TRACE_READ_RECORD,
+			             0, fs_trace_name_id(p_file_name), len);
+#endif//FS_TRACE
 			res = osThreadFlagsSet(m_thread_id, flags);
 			return len;
 		break;
@@ -872,9 +1914,247 @@ static int32_t fs_rw_record (uint8_t command_type,
 			err1("Error:%d", res);
 
 	}
+	fs_record_name_put(name_id);
 	return 0;
 }
 
+/*****************************************************************************
+ * Take a free record name table entry for the file name of a request.
+ * Does not block, so it can be called from an ISR.
+ * @params p_name - Pointer to the file name, must remain valid until the
+ *                  request has been completed
+ *
+ * @return Returns the name id, -1 if the table is full
+ ****************************************************************************/
+static int fs_record_name_get (const char * p_name)
+{
+	uint8_t name_id;
+	if (osOK != osMessageQueueGet(m_name_queue_id, &name_id, NULL, 0))
+	{
+		return -1;
+	}
+	m_record_names[name_id] = p_name;
+	return name_id;
+}
+
+/*****************************************************************************
+ * Return a record name table entry to the free entries.
+ * @params name_id - Name id returned by fs_record_name_get
+ ****************************************************************************/
+static void fs_record_name_put (uint8_t name_id)
+{
+	osMessageQueuePut(m_name_queue_id, &name_id, 0U, 0);
+}
+
+#if FS_RECORD_CACHE_ENTRIES > 0
+// Descriptor of an open SPIFFS file
+static spiffs_fd * fs_cache_fd (int f, spiffs_file sfd)
+{
+	for (int i = 0; i < FS_MAX_DESCRIPTORS; i++)
+	{
+		spiffs_file fh = fs[f].fds[i].file_nbr;
+#if SPIFFS_FILEHDL_OFFSET
+		fh += SPIFFS_CFG_FILEHDL_OFFSET(&fs[f].fs);
+#endif//SPIFFS_FILEHDL_OFFSET
+		if ((0 != fs[f].fds[i].file_nbr) && (fh == sfd))
+		{
+			return &fs[f].fds[i];
+		}
+	}
+	return NULL;
+}
+
+static fs_record_cache_t * fs_cache_find (int f, const char * p_name)
+{
+	for (int i = 0; i < FS_RECORD_CACHE_ENTRIES; i++)
+	{
+		if (('\0' != fs[f].cache[i].name[0]) && (0 == strncmp(fs[f].cache[i].name, p_name, SPIFFS_OBJ_NAME_LEN)))
+		{
+			return &fs[f].cache[i];
+		}
+	}
+	return NULL;
+}
+
+// Called with the filesystem mutex held
+static void fs_cache_drop_name (int f, const char * p_name)
+{
+	fs_record_cache_t * p_entry = fs_cache_find(f, p_name);
+	if (NULL != p_entry)
+	{
+		p_entry->name[0] = '\0';
+	}
+}
+
+// Called with the filesystem mutex held
+static void fs_cache_drop_file (int f, spiffs_file sfd)
+{
+	spiffs_fd * p_fd = fs_cache_fd(f, sfd);
+	if (NULL == p_fd)
+	{
+		return;
+	}
+	for (int i = 0; i < FS_RECORD_CACHE_ENTRIES; i++)
+	{
+		if (fs[f].cache[i].obj_id == p_fd->obj_id)
+		{
+			fs[f].cache[i].name[0] = '\0';
+		}
+	}
+}
+
+// Keep the start of an open file, replacing the least recently used entry
+static void fs_cache_store (int f, const char * p_name, fs_fd fd, const void * p_data, int32_t len, bool complete)
+{
+	if ((len < 0) || (len > FS_RECORD_CACHE_SIZE) || (strlen(p_name) >= SPIFFS_OBJ_NAME_LEN))
+	{
+		return;
+	}
+	platform_mutex_acquire(fs[f].mutex);
+	spiffs_fd * p_fd = fs_cache_fd(f, (fd & 0xFFFF));
+	if (NULL != p_fd)
+	{
+		fs_record_cache_t * p_entry = fs_cache_find(f, p_name);
+		if (NULL == p_entry)
+		{
+			p_entry = &fs[f].cache[0];
+			for (int i = 1; (i < FS_RECORD_CACHE_ENTRIES) && ('\0' != p_entry->name[0]); i++)
+			{
+				if (('\0' == fs[f].cache[i].name[0]) || (fs[f].cache[i].used < p_entry->used))
+				{
+					p_entry = &fs[f].cache[i];
+				}
+			}
+		}
+		strcpy(p_entry->name, p_name);
+		p_entry->obj_id = p_fd->obj_id;
+		p_entry->used = ++fs[f].cache_used;
+		p_entry->len = len;
+		p_entry->complete = complete;
+		memcpy(p_entry->data, p_data, len);
+	}
+	platform_mutex_release(fs[f].mutex);
+}
+
+// Serve a record read from RAM if the cached part of the file covers it
+static bool fs_cache_read (int f, const char * p_name, void * p_value, uint16_t len, int32_t * p_res)
+{
+	bool hit = false;
+	platform_mutex_acquire(fs[f].mutex);
+	fs_record_cache_t * p_entry = fs_cache_find(f, p_name);
+	if ((NULL != p_entry) && (p_entry->complete || (len <= p_entry->len)))
+	{
+		*p_res = (len < p_entry->len) ? len : p_entry->len;
+		memcpy(p_value, p_entry->data, *p_res);
+		p_entry->used = ++fs[f].cache_used;
+		fs[f].cache_hits++;
+		hit = true;
+	}
+	platform_mutex_release(fs[f].mutex);
+	return hit;
+}
+#endif//FS_RECORD_CACHE_ENTRIES
+
+/*****************************************************************************
+ * Write a record request to its file, creating the file if needed, and
+ * release its name.
+ * @params p_params - Dequeued write request
+ *
+ * @return Returns number of bytes written, 0 or negative on failure
+ ****************************************************************************/
+static int32_t fs_record_write (const fs_rw_params_t * p_params)
+{
+	int32_t fs_res = 0;
+	// open file for writing
+	const char * p_file_name = m_record_names[p_params->name_id];
+	debug2("p:%d f:%s pv:%p l:%d fnc:%p",
+		   p_params->file_sys_nr, \
+		   p_file_name, \
+		   p_params->p_value, \
+		   p_params->len, \
+		   p_params->f_callback);
+
+	fs_fd file_desc = fs_open(p_params->file_sys_nr, (void*)p_file_name, FS_WRONLY);
+	if (file_desc < 0)
+	{
+		// file does not exists or some other error
+		debug1("File not exists:%s", p_file_name);
+		// try to create new file
+		file_desc = fs_open(p_params->file_sys_nr, (void*)p_file_name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (file_desc < 0)
+		{
+			err1("Cannot create file:%s", p_file_name);
+		}
+	}
+	if (file_desc >= 0)
+	{
+#if FS_RECORD_CACHE_ENTRIES > 0
+		// Held across the write and the store, so that a write through
+		// another descriptor can not come between them
+		platform_mutex_acquire(fs[p_params->file_sys_nr].mutex);
+#endif//FS_RECORD_CACHE_ENTRIES
+		fs_res = fs_write(p_params->file_sys_nr, file_desc, p_params->p_value, p_params->len);
+#if FS_RECORD_CACHE_ENTRIES > 0
+		// The file may be longer than the record
+		if (fs_res == p_params->len)
+		{
+			fs_cache_store(p_params->file_sys_nr, p_file_name, file_desc, p_params->p_value, fs_res, false);
+		}
+		platform_mutex_release(fs[p_params->file_sys_nr].mutex);
+#endif//FS_RECORD_CACHE_ENTRIES
+		fs_close(p_params->file_sys_nr, file_desc);
+	}
+	fs_record_name_put(p_params->name_id);
+	return fs_res;
+}
+
+/*****************************************************************************
+ * Read a record request from its file, or from the cache, and release its
+ * name.
+ * @params p_params - Dequeued read request
+ *
+ * @return Returns number of bytes read, 0 or negative on failure
+ ****************************************************************************/
+static int32_t fs_record_read (const fs_rw_params_t * p_params)
+{
+	int32_t fs_res = 0;
+	const char * p_file_name = m_record_names[p_params->name_id];
+
+#if FS_RECORD_CACHE_ENTRIES > 0
+	if (fs_cache_read(p_params->file_sys_nr, p_file_name, p_params->p_value, p_params->len, &fs_res))
+	{
+		debug1("cached:%s", p_file_name);
+		fs_record_name_put(p_params->name_id);
+		return fs_res;
+	}
+#endif//FS_RECORD_CACHE_ENTRIES
+
+	fs_fd file_desc = fs_open(p_params->file_sys_nr, (void*)p_file_name, FS_RDONLY);
+	debug1("fd:%d", file_desc);
+	if (file_desc < 0)
+	{
+		// file does not exists or some other error
+		debug1("File not exists:%s", p_file_name);
+	}
+	else
+	{
+#if FS_RECORD_CACHE_ENTRIES > 0
+		// Held across the read and the store, so that a write through
+		// another descriptor can not come between them
+		platform_mutex_acquire(fs[p_params->file_sys_nr].mutex);
+#endif//FS_RECORD_CACHE_ENTRIES
+		fs_res = fs_read(p_params->file_sys_nr, file_desc, p_params->p_value, p_params->len);
+#if FS_RECORD_CACHE_ENTRIES > 0
+		// A short read got the whole file
+		fs_cache_store(p_params->file_sys_nr, p_file_name, file_desc, p_params->p_value, fs_res, fs_res < p_params->len);
+		platform_mutex_release(fs[p_params->file_sys_nr].mutex);
+#endif//FS_RECORD_CACHE_ENTRIES
+		fs_close(p_params->file_sys_nr, file_desc);
+	}
+	fs_record_name_put(p_params->name_id);
+	return fs_res;
+}
+
 /*****************************************************************************
  * Put one data read request to the read queue
  * @params file_sys_nr - file_sys_nr number 0..2
@@ -943,3 +2223,130 @@ int32_t fs_write_record (int file_sys_nr,
 	}
 	return fs_rw_record(FS_WRITE_DATA, file_sys_nr, p_file_name, p_value, len, wait, f_callback, p_user);
 }
+
+#if FS_EMERGENCY_RESERVE > 0
+/*****************************************************************************
+ * Run gc until FS_EMERGENCY_RESERVE bytes can be written without it.
+ * @params f - File system number
+ ****************************************************************************/
+static void fs_emergency_reserve (int f)
+{
+	fs_abort_suspend(f);
+	platform_mutex_acquire(fs[f].mutex);
+	fs[f].driver->lock();
+	// Returns without touching flash when there is enough free space
+	s32_t ret = SPIFFS_gc(&fs[f].fs, FS_EMERGENCY_RESERVE);
+	if (SPIFFS_OK != ret)
+	{
+		debug1("fs #%d reserve %d", f, (int)ret);
+	}
+	fs[f].driver->unlock();
+	fs_plan_suspend(f);
+	platform_mutex_release(fs[f].mutex);
+}
+#endif//FS_EMERGENCY_RESERVE
+
+/*****************************************************************************
+ * Find a later request in the list that overwrites all of request i.
+ * @params p_list - Requests in queue order
+ * @params count - Number of requests
+ * @params i - Request to check
+ *
+ * @return Returns the index of the last such request, i if there is none
+ ****************************************************************************/
+static uint32_t fs_record_superseded (const fs_rw_params_t * p_list, uint32_t count, uint32_t i)
+{
+	uint32_t last = i;
+	for (uint32_t j = i + 1; j < count; j++)
+	{
+		if ((p_list[j].file_sys_nr == p_list[i].file_sys_nr)
+		 && (0 == strcmp(m_record_names[p_list[j].name_id], m_record_names[p_list[i].name_id]))
+		 && (p_list[j].len >= p_list[i].len))
+		{
+			last = j;
+		}
+	}
+	return last;
+}
+
+int32_t fs_emergency_flush ()
+{
+	fs_rw_params_t pending[FS_RECORD_WR_QUEUE_COUNT];
+	int32_t results[FS_RECORD_WR_QUEUE_COUNT];
+	uint32_t count = 0;
+
+	m_emergency = true;
+#ifdef FS_TRACE
+	m_flush_thread_id = osThreadGetId();
+#endif//FS_TRACE
+
+	// A write the fs thread has already taken from the queue is older than
+	// the queued ones, let it finish first. The fs thread may still have
+	// FS_WRITE_FLAG set, only the thread itself can clear it, it then finds
+	// the queue empty and calls no callback.
+	osMutexAcquire(m_record_mutex_id, osWaitForever);
+	while ((count < FS_RECORD_WR_QUEUE_COUNT)
+	    && (osOK == osMessageQueueGet(m_wr_queue_id, &pending[count], NULL, 0)))
+	{
+		count++;
+	}
+	debug1("emergency %u", (unsigned int)count);
+
+	// Records start at offset 0 of their file, so only the last write of a
+	// record that covers the earlier ones needs to be programmed
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (fs_record_superseded(pending, count, i) == i)
+		{
+			results[i] = fs_record_write(&pending[i]);
+		}
+		else
+		{
+			fs_record_name_put(pending[i].name_id);
+		}
+	}
+	osMutexRelease(m_record_mutex_id);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t last = fs_record_superseded(pending, count, i);
+		int32_t res = results[last];
+		if ((last != i) && (res > 0))
+		{
+			res = pending[i].len;
+		}
+		pending[i].f_callback(res, pending[i].p_user);
+	}
+#ifdef FS_TRACE
+	m_flush_thread_id = NULL;
+#endif//FS_TRACE
+
+#if SPIFFS_CACHE && SPIFFS_CACHE_WR
+	for (int f = 0; f < FS_MAX_COUNT; f++)
+	{
+		if ((NULL == fs[f].driver) || (!fs[f].ready))
+		{
+			continue;
+		}
+		fs_abort_suspend(f);
+		platform_mutex_acquire(fs[f].mutex);
+		fs[f].driver->lock();
+		for (int i = 0; i < FS_MAX_DESCRIPTORS; i++)
+		{
+			if (0 != fs[f].fds[i].file_nbr)
+			{
+				spiffs_file fh = fs[f].fds[i].file_nbr;
+#if SPIFFS_FILEHDL_OFFSET
+				fh += SPIFFS_CFG_FILEHDL_OFFSET(&fs[f].fs);
+#endif//SPIFFS_FILEHDL_OFFSET
+				SPIFFS_fflush(&fs[f].fs, fh);
+			}
+		}
+		fs[f].driver->unlock();
+		fs_plan_suspend(f);
+		platform_mutex_release(fs[f].mutex);
+	}
+#endif//SPIFFS_CACHE_WR
+
+	m_emergency = false;
+	return count;
+}
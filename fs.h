@@ -7,6 +7,7 @@
 #ifndef _FS_H_
 #define _FS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "spiffs.h"
 
@@ -23,6 +24,27 @@
 
 #define FS_ERR_REFORMATTED (-70000)
 
+// Flash driver errors. A driver operation returns one of these to tell the
+// filesystem how it failed, any other negative value is treated as
+// FS_ERR_HARD. Transient errors and timeouts are retried, see FS_HAL_RETRIES,
+// the rest are passed on through SPIFFS to the result of the API call.
+#define FS_ERR_TRANSIENT   (-70001) // Bus error, the operation can be retried
+#define FS_ERR_TIMEOUT     (-70002) // Device did not respond in time, can be retried
+#define FS_ERR_VERIFY      (-70003) // Data read back differs from the data written
+#define FS_ERR_HARD        (-70004) // Device failure, retrying does not help
+
+#define FS_ERR_RANGE       (-70005) // Raw access outside the reserved range
+
+#ifdef FS_BAD_BLOCKS
+#ifndef FS_BAD_BLOCK_SPARES
+#define FS_BAD_BLOCK_SPARES 4
+#endif//FS_BAD_BLOCK_SPARES
+// Spare blocks and the bad block table are reserved at the end of the partition
+#define FS_SPIFFS_SIZE(size, erase_size) ((size) - (FS_BAD_BLOCK_SPARES + 1) * (erase_size))
+#else
+#define FS_SPIFFS_SIZE(size, erase_size) (size)
+#endif//FS_BAD_BLOCKS
+
 typedef struct fs_driver_struct
 {
 	int32_t(*read)(int partition, uint32_t addr, uint32_t size, uint8_t * dst);
@@ -59,11 +81,124 @@ typedef void (*fs_rw_done_f) (int32_t len,  void * p_user);
  */
 void fs_init(int file_sys_nr, int partition, fs_driver_t *driver);
 
+/**
+ * Read back and compare every flash program operation of a filesystem, and
+ * check that erased blocks read back erased. A program or erase that does not
+ * read back fails with FS_ERR_VERIFY. Costs one read of the written range per
+ * program and of the block per erase, disabled by fs_init.
+ *
+ * @param file_sys_nr - File system number 0..2
+ * @param enable - true to verify programs.
+ */
+void fs_write_verify(int file_sys_nr, bool enable);
+
+#ifdef FS_BAD_BLOCKS
+/**
+ * Return the number of spare blocks used up by replacing failed blocks.
+ *
+ * @param file_sys_nr - File system number 0..2
+ *
+ * @return Used spares, up to FS_BAD_BLOCK_SPARES.
+ */
+uint32_t fs_bad_block_count(int file_sys_nr);
+#endif//FS_BAD_BLOCKS
+
+#if FS_RECORD_CACHE_ENTRIES > 0
+/**
+ * Return the number of record reads completed from the record cache.
+ *
+ * @param file_sys_nr - File system number 0..2
+ *
+ * @return Cache hits since fs_init.
+ */
+uint32_t fs_record_cache_hits(int file_sys_nr);
+#endif//FS_RECORD_CACHE_ENTRIES
+
+#ifdef FS_WEAR_LEVELING
+typedef struct fs_wear_stats
+{
+	uint32_t passes;      // Relocation passes run by the fs thread
+	uint32_t relocations; // Blocks whose data was relocated
+	uint32_t repeats;     // Passes that picked a block they had already relocated
+} fs_wear_stats_t;
+
+/**
+ * Get the wear leveling counters of a filesystem, since fs_init.
+ *
+ * @param file_sys_nr - File system number 0..2
+ * @param p_stats - Counters.
+ */
+void fs_wear_stats(int file_sys_nr, fs_wear_stats_t * p_stats);
+#endif//FS_WEAR_LEVELING
+
+/**
+ * Reserve the end of the SPIFFS part of a partition for raw streaming
+ * access, the filesystem is made smaller by the same amount. Call after
+ * fs_init and before fs_start, the same size must be used on every boot.
+ *
+ * @param file_sys_nr - File system number 0..2
+ * @param size - Bytes to reserve, a multiple of the erase block size.
+ *
+ * @return 0 on success, FS_ERR_RANGE if the size is not valid.
+ */
+int32_t fs_raw_reserve(int file_sys_nr, uint32_t size);
+
+/**
+ * Write to the reserved raw range. An erase block that the write starts at
+ * the beginning of is erased first, so a range written sequentially from a
+ * block boundary needs no separate erase. Runs in FS_RAW_CHUNK byte steps,
+ * between which other filesystem operations can run.
+ *
+ * @param file_sys_nr - File system number 0..2
+ * @param offset - Offset in the raw range.
+ * @param p_data - Data to write.
+ * @param len - Length of the data.
+ *
+ * @return Number of bytes written, FS_ERR_RANGE or a flash error otherwise.
+ */
+int32_t fs_raw_write(int file_sys_nr, uint32_t offset, const void * p_data, uint32_t len);
+
+/**
+ * Read from the reserved raw range, in FS_RAW_CHUNK byte steps.
+ *
+ * @param file_sys_nr - File system number 0..2
+ * @param offset - Offset in the raw range.
+ * @param p_data - Buffer for the data.
+ * @param len - Length to read.
+ *
+ * @return Number of bytes read, FS_ERR_RANGE or a flash error otherwise.
+ */
+int32_t fs_raw_read(int file_sys_nr, uint32_t offset, void * p_data, uint32_t len);
+
 /**
  * Starts filesystem thread.
  */
 void fs_start();
 
+/**
+ * Return the smallest amount of unused stack observed on the filesystem
+ * thread since it was started. The fs thread runs queued record operations,
+ * including any garbage collection they trigger, and their callbacks, so the
+ * value can be used to tune FS_THREAD_STACK_SIZE.
+ *
+ * @return Unused stack in bytes, 0 if the thread has not been started.
+ */
+uint32_t fs_thread_stack_free ();
+
+/**
+ * Write out all queued record writes immediately in the calling thread, for
+ * a power-fail warning handler. Queued writes to the same record that are
+ * overwritten by a later one in the queue are not programmed at all, their
+ * callbacks get the result of the write that replaced them. Data buffered
+ * in open descriptors is flushed when the SPIFFS write cache is enabled.
+ * Queued reads are left for the fs thread. A record write the fs thread has
+ * already started is completed first, background work of the fs thread is
+ * held off while the flush runs. Must not be called from an interrupt.
+ *
+ * @return Number of queued record writes completed.
+ */
+int32_t fs_emergency_flush ();
+
 /**
  * Return filesystem total and used space.
  * 
@@ -159,10 +294,12 @@ int32_t fs_fstat(int file_sys_nr, fs_fd fd, fs_stat *s);
 
 /*****************************************************************************
  * Put one data read request to the read queue
+ * The file name is not copied, it must remain valid until the callback.
+ * Does not block with wait = 0 and can then be called from an ISR.
  * @param file_sys_nr - File system number 0..2
  * @param p_file_name - Pointer to the file name
  * @param p_value - Pointer to the data record
- * @param len - Data record length in bytes
+ * @param len - Data record length in bytes, 0..65535
  * @param wait - When wait = 0 function returns immediately, even when putting fails,
  *                otherwise waits until put succeeds (and blocks calling thread)
  * @param f_callback - Callback when operation has been completed.
@@ -180,10 +317,12 @@ int32_t fs_read_record (int file_sys_nr,
 
 /*****************************************************************************
  * Put one data write request to the write queue
+ * The file name and data are not copied, they must remain valid until the callback.
+ * Does not block with wait = 0 and can then be called from an ISR.
  * @param file_sys_nr - File system number 0..2
  * @param p_file_name - Pointer to the file name
  * @param p_value - Pointer to the data record
- * @param len - Data record length in bytes
+ * @param len - Data record length in bytes, 0..65535
  * @param wait - When wait = 0 function returns immediately, even when putting fails,
  *                otherwise waits until put succeeds (and blocks calling thread)
  * @param f_callback - Callback when operation has been completed.
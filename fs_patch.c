@@ -0,0 +1,256 @@
+/**
+ * Incremental filesystem content update, see fs_patch.h for the format.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+
+#include "fs_patch.h"
+#include <inttypes.h>
+#include <string.h>
+
+#include "loglevels.h"
+#define __MODUUL__ "fsp"
+#define __LOG_LEVEL__ (LOG_LEVEL_fs & BASE_LOG_LEVEL)
+#include "log.h"
+
+enum fs_patch_states
+{
+	FS_PATCH_STATE_MAGIC,
+	FS_PATCH_STATE_OP,
+	FS_PATCH_STATE_NAME_LEN,
+	FS_PATCH_STATE_NAME,
+	FS_PATCH_STATE_ARGS,
+	FS_PATCH_STATE_DATA,
+	FS_PATCH_STATE_CRC,
+	FS_PATCH_STATE_DONE
+};
+
+static uint32_t fs_patch_u32 (const uint8_t * p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t fs_patch_crc32 (uint32_t crc, const void * p_data, uint32_t len)
+{
+	const uint8_t * p = (const uint8_t *)p_data;
+	crc = ~crc;
+	while (len-- > 0)
+	{
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+static void fs_patch_expect (fs_patch_t * p_patch, uint8_t state, uint8_t need)
+{
+	p_patch->state = state;
+	p_patch->have = 0;
+	p_patch->need = need;
+}
+
+static void fs_patch_fail (fs_patch_t * p_patch, int32_t err)
+{
+	err1("%s %"PRIi32, p_patch->name, err);
+	if (p_patch->fd >= 0)
+	{
+		fs_close(p_patch->file_sys_nr, p_patch->fd);
+		p_patch->fd = -1;
+	}
+	p_patch->status = err;
+}
+
+static void fs_patch_file_done (fs_patch_t * p_patch)
+{
+	fs_close(p_patch->file_sys_nr, p_patch->fd);
+	p_patch->fd = -1;
+	fs_patch_expect(p_patch, FS_PATCH_STATE_OP, 1);
+}
+
+// Open the file of an add or write operation and position it for the data
+static void fs_patch_open (fs_patch_t * p_patch)
+{
+	uint32_t offset = 0;
+
+	if (FS_PATCH_OP_ADD == p_patch->op)
+	{
+		p_patch->remaining = fs_patch_u32(&p_patch->field[0]);
+		p_patch->fd = fs_open(p_patch->file_sys_nr, p_patch->name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+	}
+	else
+	{
+		offset = fs_patch_u32(&p_patch->field[0]);
+		p_patch->remaining = fs_patch_u32(&p_patch->field[4]);
+		p_patch->fd = fs_open(p_patch->file_sys_nr, p_patch->name, FS_WRONLY);
+	}
+	debug1("%u %s %"PRIu32" %"PRIu32, p_patch->op, p_patch->name, offset, p_patch->remaining);
+
+	if (p_patch->fd < 0)
+	{
+		int32_t err = p_patch->fd;
+		p_patch->fd = -1;
+		fs_patch_fail(p_patch, err);
+		return;
+	}
+	if (offset > 0)
+	{
+		int32_t ret = fs_lseek(p_patch->file_sys_nr, p_patch->fd, (int32_t)offset, FS_SEEK_SET);
+		if (ret != (int32_t)offset)
+		{
+			fs_patch_fail(p_patch, (ret < 0) ? ret : FS_PATCH_ERR_FORMAT);
+			return;
+		}
+	}
+
+	if (0 == p_patch->remaining)
+	{
+		fs_patch_file_done(p_patch);
+	}
+	else
+	{
+		fs_patch_expect(p_patch, FS_PATCH_STATE_DATA, 0);
+	}
+}
+
+// Act on a completely received header field
+static void fs_patch_field (fs_patch_t * p_patch)
+{
+	switch (p_patch->state)
+	{
+		case FS_PATCH_STATE_MAGIC:
+			if (0 != memcmp(p_patch->field, FS_PATCH_MAGIC, 4))
+			{
+				fs_patch_fail(p_patch, FS_PATCH_ERR_FORMAT);
+				return;
+			}
+			fs_patch_expect(p_patch, FS_PATCH_STATE_OP, 1);
+		break;
+
+		case FS_PATCH_STATE_OP:
+			p_patch->op = p_patch->field[0];
+			if (FS_PATCH_OP_END == p_patch->op)
+			{
+				fs_patch_expect(p_patch, FS_PATCH_STATE_CRC, 4);
+			}
+			else if (p_patch->op > FS_PATCH_OP_DELETE)
+			{
+				fs_patch_fail(p_patch, FS_PATCH_ERR_FORMAT);
+			}
+			else
+			{
+				fs_patch_expect(p_patch, FS_PATCH_STATE_NAME_LEN, 1);
+			}
+		break;
+
+		case FS_PATCH_STATE_NAME_LEN:
+			if ((0 == p_patch->field[0]) || (p_patch->field[0] >= sizeof(p_patch->name)))
+			{
+				fs_patch_fail(p_patch, FS_PATCH_ERR_FORMAT);
+				return;
+			}
+			memset(p_patch->name, 0, sizeof(p_patch->name));
+			fs_patch_expect(p_patch, FS_PATCH_STATE_NAME, p_patch->field[0]);
+		break;
+
+		case FS_PATCH_STATE_NAME:
+			if (FS_PATCH_OP_DELETE == p_patch->op)
+			{
+				debug1("del %s", p_patch->name);
+				fs_unlink(p_patch->file_sys_nr, p_patch->name);
+				fs_patch_expect(p_patch, FS_PATCH_STATE_OP, 1);
+			}
+			else
+			{
+				fs_patch_expect(p_patch, FS_PATCH_STATE_ARGS, (FS_PATCH_OP_ADD == p_patch->op) ? 4 : 8);
+			}
+		break;
+
+		case FS_PATCH_STATE_ARGS:
+			fs_patch_open(p_patch);
+		break;
+
+		case FS_PATCH_STATE_CRC:
+			if (fs_patch_u32(p_patch->field) != p_patch->crc)
+			{
+				fs_patch_fail(p_patch, FS_PATCH_ERR_CHECKSUM);
+				return;
+			}
+			p_patch->state = FS_PATCH_STATE_DONE;
+		break;
+	}
+}
+
+void fs_patch_init (fs_patch_t * p_patch, int file_sys_nr)
+{
+	memset(p_patch, 0, sizeof(fs_patch_t));
+	p_patch->file_sys_nr = file_sys_nr;
+	p_patch->fd = -1;
+	fs_patch_expect(p_patch, FS_PATCH_STATE_MAGIC, 4);
+}
+
+int32_t fs_patch_feed (fs_patch_t * p_patch, const void * p_data, uint32_t len)
+{
+	const uint8_t * p = (const uint8_t *)p_data;
+
+	while ((len > 0) && (0 == p_patch->status))
+	{
+		uint32_t n;
+		if (FS_PATCH_STATE_DONE == p_patch->state)
+		{
+			fs_patch_fail(p_patch, FS_PATCH_ERR_FORMAT);
+			break;
+		}
+
+		if (FS_PATCH_STATE_DATA == p_patch->state)
+		{
+			n = (len < p_patch->remaining) ? len : p_patch->remaining;
+			p_patch->crc = fs_patch_crc32(p_patch->crc, p, n);
+			int32_t ret = fs_write(p_patch->file_sys_nr, p_patch->fd, p, (int32_t)n);
+			if (ret != (int32_t)n)
+			{
+				fs_patch_fail(p_patch, (ret < 0) ? ret : SPIFFS_ERR_FULL);
+				break;
+			}
+			p_patch->remaining -= n;
+			if (0 == p_patch->remaining)
+			{
+				fs_patch_file_done(p_patch);
+			}
+		}
+		else
+		{
+			uint8_t * dst = (FS_PATCH_STATE_NAME == p_patch->state) ? (uint8_t *)p_patch->name : p_patch->field;
+			n = p_patch->need - p_patch->have;
+			if (len < n)
+			{
+				n = len;
+			}
+			memcpy(&dst[p_patch->have], p, n);
+			if (FS_PATCH_STATE_CRC != p_patch->state)
+			{
+				p_patch->crc = fs_patch_crc32(p_patch->crc, p, n);
+			}
+			p_patch->have += n;
+			if (p_patch->have == p_patch->need)
+			{
+				fs_patch_field(p_patch);
+			}
+		}
+		p += n;
+		len -= n;
+	}
+	return p_patch->status;
+}
+
+int32_t fs_patch_finish (fs_patch_t * p_patch)
+{
+	if ((0 == p_patch->status) && (FS_PATCH_STATE_DONE != p_patch->state))
+	{
+		fs_patch_fail(p_patch, FS_PATCH_ERR_INCOMPLETE);
+	}
+	return p_patch->status;
+}
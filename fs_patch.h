@@ -0,0 +1,101 @@
+/**
+ * Incremental filesystem content update.
+ *
+ * Applies a patch generated with tools/fs_delta to a filesystem through the
+ * fs.h API. The patch is fed in arbitrary chunks as it arrives, data is
+ * written to the files directly, so no buffer for the whole patch or file is
+ * needed.
+ *
+ * Patch format, integers are little-endian:
+ *   "FSP1"
+ *   operations:
+ *     u8 op, u8 name_len, name[name_len]
+ *     FS_PATCH_OP_ADD:    u32 size, data[size]             - create or replace a file
+ *     FS_PATCH_OP_WRITE:  u32 offset, u32 len, data[len]   - overwrite a range of
+ *                                                            an existing file, offset
+ *                                                            is at most the file size
+ *     FS_PATCH_OP_DELETE:                                  - delete a file
+ *   u8 FS_PATCH_OP_END, u32 crc32 of all the preceding bytes
+ *
+ * Operations are applied as they are received, the checksum only tells if
+ * the complete patch was applied, so the application must be able to retry
+ * the update when fs_patch_finish reports an error.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef _FS_PATCH_H_
+#define _FS_PATCH_H_
+
+#include <stdint.h>
+#include "fs.h"
+
+#define FS_PATCH_MAGIC "FSP1"
+
+#define FS_PATCH_OP_END    0
+#define FS_PATCH_OP_ADD    1
+#define FS_PATCH_OP_WRITE  2
+#define FS_PATCH_OP_DELETE 3
+
+#define FS_PATCH_ERR_FORMAT     (-70100)
+#define FS_PATCH_ERR_CHECKSUM   (-70101)
+#define FS_PATCH_ERR_INCOMPLETE (-70102)
+
+typedef struct fs_patch_struct
+{
+	int      file_sys_nr;
+	fs_fd    fd;
+	int32_t  status;
+	uint32_t crc;
+	uint32_t remaining;
+	uint8_t  state;
+	uint8_t  op;
+	uint8_t  have;
+	uint8_t  need;
+	uint8_t  field[8];
+	char     name[SPIFFS_OBJ_NAME_LEN];
+} fs_patch_t;
+
+/**
+ * Prepare to apply a patch.
+ *
+ * @param p_patch - Patch state.
+ * @param file_sys_nr - File system number 0..2
+ */
+void fs_patch_init (fs_patch_t * p_patch, int file_sys_nr);
+
+/**
+ * Apply the next chunk of a patch.
+ *
+ * @param p_patch - Patch state.
+ * @param p_data - Patch data.
+ * @param len - Length of the patch data.
+ *
+ * @return 0 on success, error otherwise. Once an error has been returned,
+ *         further data is ignored and the same error returned.
+ */
+int32_t fs_patch_feed (fs_patch_t * p_patch, const void * p_data, uint32_t len);
+
+/**
+ * Finish applying a patch, closes the file that is being written if the
+ * patch was not complete.
+ *
+ * @param p_patch - Patch state.
+ *
+ * @return 0 if the complete patch was applied and the checksum matched,
+ *         error otherwise.
+ */
+int32_t fs_patch_finish (fs_patch_t * p_patch);
+
+/**
+ * Update a CRC-32 (IEEE 802.3) over a block of data, start with 0.
+ *
+ * @param crc - CRC of the preceding data.
+ * @param p_data - Data.
+ * @param len - Length of the data.
+ *
+ * @return Updated CRC.
+ */
+uint32_t fs_patch_crc32 (uint32_t crc, const void * p_data, uint32_t len);
+
+#endif//_FS_PATCH_H_
@@ -0,0 +1,277 @@
+/**
+ * Raw A/B slot store, see fs_slots.h for the layout.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+
+#include "fs_slots.h"
+#include <inttypes.h>
+#include <string.h>
+#include "cmsis_os2.h"
+
+#include "loglevels.h"
+#define __MODUUL__ "fss"
+#define __LOG_LEVEL__ (LOG_LEVEL_fs & BASE_LOG_LEVEL)
+#include "log.h"
+
+#define FS_SLOTS_HEADER_SIZE 8
+#define FS_SLOTS_ENTRY_SIZE  (4 + FS_SLOTS_VALUE_SIZE)
+#define FS_SLOTS_NONE        0xFF
+
+// CRC-16/CCITT-FALSE
+static uint16_t fs_slots_crc16 (const uint8_t * p, uint32_t len)
+{
+	uint16_t crc = 0xFFFF;
+	while (len-- > 0)
+	{
+		crc ^= (uint16_t)(*p++) << 8;
+		for (int i = 0; i < 8; i++)
+		{
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+static uint32_t fs_slots_block_addr (fs_slots_t * p_slots, uint8_t block)
+{
+	return p_slots->addr + block * p_slots->block_size;
+}
+
+static int32_t fs_slots_read (fs_slots_t * p_slots, uint32_t addr, uint32_t size, uint8_t * dst)
+{
+	int32_t ret = p_slots->driver->read(p_slots->partition, addr, size, dst);
+	return (ret < 0) ? ret : 0;
+}
+
+static int32_t fs_slots_write (fs_slots_t * p_slots, uint32_t addr, uint32_t size, uint8_t * src)
+{
+	int32_t ret = p_slots->driver->write(p_slots->partition, addr, size, src);
+	return (ret < 0) ? ret : 0;
+}
+
+// Check the header of a block, a read error is returned as it is
+static int32_t fs_slots_header (fs_slots_t * p_slots, uint8_t block, bool * p_valid, uint32_t * p_sequence)
+{
+	uint8_t header[FS_SLOTS_HEADER_SIZE];
+	int32_t ret = fs_slots_read(p_slots, fs_slots_block_addr(p_slots, block), sizeof(header), header);
+	if (0 != ret)
+	{
+		return ret;
+	}
+	*p_sequence = (uint32_t)header[4] | ((uint32_t)header[5] << 8)
+	            | ((uint32_t)header[6] << 16) | ((uint32_t)header[7] << 24);
+	*p_valid = (0 == memcmp(header, FS_SLOTS_MAGIC, 4)) && (UINT32_MAX != *p_sequence);
+	return 0;
+}
+
+// Build the entry of a slot, unused data bytes are left erased
+static void fs_slots_entry (uint8_t * entry, uint8_t slot, const uint8_t * p_value, uint8_t len)
+{
+	memset(entry, 0xFF, FS_SLOTS_ENTRY_SIZE);
+	entry[0] = slot;
+	entry[1] = len;
+	memcpy(&entry[4], p_value, len);
+	uint8_t check[2 + FS_SLOTS_VALUE_SIZE];
+	check[0] = slot;
+	check[1] = len;
+	memcpy(&check[2], p_value, len);
+	uint16_t crc = fs_slots_crc16(check, 2 + len);
+	entry[2] = (uint8_t)crc;
+	entry[3] = (uint8_t)(crc >> 8);
+}
+
+// Apply the entries of the active block to the RAM mirror
+static int32_t fs_slots_load (fs_slots_t * p_slots)
+{
+	uint8_t entry[FS_SLOTS_ENTRY_SIZE];
+	uint8_t erased[FS_SLOTS_ENTRY_SIZE];
+	memset(erased, 0xFF, sizeof(erased));
+
+	p_slots->offset = FS_SLOTS_HEADER_SIZE;
+	while (p_slots->offset + FS_SLOTS_ENTRY_SIZE <= p_slots->block_size)
+	{
+		int32_t ret = fs_slots_read(p_slots, fs_slots_block_addr(p_slots, p_slots->active) + p_slots->offset,
+		                            sizeof(entry), entry);
+		if (0 != ret)
+		{
+			return ret;
+		}
+		if (0 == memcmp(entry, erased, sizeof(entry)))
+		{
+			break;
+		}
+		uint8_t slot = entry[0];
+		uint8_t len = entry[1];
+		if ((slot < FS_SLOTS_COUNT) && (len <= FS_SLOTS_VALUE_SIZE))
+		{
+			uint8_t check[FS_SLOTS_ENTRY_SIZE];
+			fs_slots_entry(check, slot, &entry[4], len);
+			if (0 == memcmp(check, entry, 4 + len))
+			{
+				p_slots->lens[slot] = len;
+				memcpy(p_slots->values[slot], &entry[4], len);
+			}
+			else
+			{
+				warn1("entry %"PRIu32, p_slots->offset);
+			}
+		}
+		p_slots->offset += FS_SLOTS_ENTRY_SIZE;
+	}
+	return 0;
+}
+
+// Write the current values to a block and make it active
+static int32_t fs_slots_activate (fs_slots_t * p_slots, uint8_t block, uint32_t sequence)
+{
+	uint32_t addr = fs_slots_block_addr(p_slots, block);
+	uint32_t offset = FS_SLOTS_HEADER_SIZE;
+	uint8_t entry[FS_SLOTS_ENTRY_SIZE];
+
+	debug1("activate %u seq %"PRIu32, (unsigned int)block, sequence);
+	int32_t ret = p_slots->driver->erase(p_slots->partition, addr, p_slots->block_size);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	for (uint8_t slot = 0; slot < FS_SLOTS_COUNT; slot++)
+	{
+		if (FS_SLOTS_NONE != p_slots->lens[slot])
+		{
+			fs_slots_entry(entry, slot, p_slots->values[slot], p_slots->lens[slot]);
+			ret = fs_slots_write(p_slots, addr + offset, sizeof(entry), entry);
+			if (0 != ret)
+			{
+				return ret;
+			}
+			offset += FS_SLOTS_ENTRY_SIZE;
+		}
+	}
+	// The header goes last, a block is not used before it is complete
+	uint8_t header[FS_SLOTS_HEADER_SIZE];
+	memcpy(header, FS_SLOTS_MAGIC, 4);
+	header[4] = (uint8_t)sequence;
+	header[5] = (uint8_t)(sequence >> 8);
+	header[6] = (uint8_t)(sequence >> 16);
+	header[7] = (uint8_t)(sequence >> 24);
+	ret = fs_slots_write(p_slots, addr, sizeof(header), header);
+	if (0 != ret)
+	{
+		return ret;
+	}
+	p_slots->active = block;
+	p_slots->sequence = sequence;
+	p_slots->offset = offset;
+	return 0;
+}
+
+int32_t fs_slots_init (fs_slots_t * p_slots, fs_driver_t * driver, int partition, uint32_t addr)
+{
+	p_slots->driver = driver;
+	p_slots->partition = partition;
+	p_slots->addr = addr;
+	p_slots->block_size = driver->erase_size(partition);
+	memset(p_slots->lens, FS_SLOTS_NONE, sizeof(p_slots->lens));
+
+	// All slots and one more entry must fit, so a full block can be compacted
+	if ((FS_SLOTS_HEADER_SIZE + (FS_SLOTS_COUNT + 1) * FS_SLOTS_ENTRY_SIZE > p_slots->block_size)
+	 || (0 != addr % p_slots->block_size)
+	 || ((uint32_t)driver->size(partition) < addr + 2 * p_slots->block_size))
+	{
+		err1("size");
+		return FS_SLOTS_ERR_SIZE;
+	}
+
+	driver->lock();
+	uint32_t seq0, seq1;
+	bool valid0, valid1;
+	int32_t ret = fs_slots_header(p_slots, 0, &valid0, &seq0);
+	if (0 == ret)
+	{
+		ret = fs_slots_header(p_slots, 1, &valid1, &seq1);
+	}
+	if (0 != ret)
+	{
+		// Never start over because of a read error, the values would be lost
+		err1("hdr %"PRIi32, ret);
+	}
+	else if (valid0 || valid1)
+	{
+		if (valid0 && valid1)
+		{
+			p_slots->active = ((int32_t)(seq1 - seq0) > 0) ? 1 : 0;
+		}
+		else
+		{
+			p_slots->active = valid1 ? 1 : 0;
+		}
+		p_slots->sequence = p_slots->active ? seq1 : seq0;
+		ret = fs_slots_load(p_slots);
+	}
+	else
+	{
+		debug1("new");
+		ret = fs_slots_activate(p_slots, 0, 1);
+	}
+	driver->unlock();
+	return ret;
+}
+
+int32_t fs_slots_get (fs_slots_t * p_slots, uint8_t slot, void * p_value, uint32_t len)
+{
+	if (slot >= FS_SLOTS_COUNT)
+	{
+		return FS_SLOTS_ERR_PARAM;
+	}
+	// Only the RAM copy is accessed, do not wait for the flash
+	int32_t lock = osKernelLock();
+	int32_t ret = FS_SLOTS_ERR_EMPTY;
+	if (FS_SLOTS_NONE != p_slots->lens[slot])
+	{
+		ret = p_slots->lens[slot];
+		memcpy(p_value, p_slots->values[slot], (len < (uint32_t)ret) ? len : (uint32_t)ret);
+	}
+	osKernelRestoreLock(lock);
+	return ret;
+}
+
+int32_t fs_slots_set (fs_slots_t * p_slots, uint8_t slot, const void * p_value, uint32_t len)
+{
+	if ((slot >= FS_SLOTS_COUNT) || (len > FS_SLOTS_VALUE_SIZE))
+	{
+		return FS_SLOTS_ERR_PARAM;
+	}
+	p_slots->driver->lock();
+	int32_t ret = 0;
+	if ((len != p_slots->lens[slot]) || (0 != memcmp(p_slots->values[slot], p_value, len)))
+	{
+		if (p_slots->offset + FS_SLOTS_ENTRY_SIZE > p_slots->block_size)
+		{
+			ret = fs_slots_activate(p_slots, 1 - p_slots->active, p_slots->sequence + 1);
+		}
+		if (0 == ret)
+		{
+			uint8_t entry[FS_SLOTS_ENTRY_SIZE];
+			fs_slots_entry(entry, slot, p_value, (uint8_t)len);
+			ret = fs_slots_write(p_slots, fs_slots_block_addr(p_slots, p_slots->active) + p_slots->offset,
+			                     sizeof(entry), entry);
+			// The entry space is used up even if the program failed
+			p_slots->offset += FS_SLOTS_ENTRY_SIZE;
+		}
+		if (0 == ret)
+		{
+			int32_t lock = osKernelLock();
+			p_slots->lens[slot] = (uint8_t)len;
+			memcpy(p_slots->values[slot], p_value, len);
+			osKernelRestoreLock(lock);
+		}
+		else
+		{
+			err1("set %u %"PRIi32, (unsigned int)slot, ret);
+		}
+	}
+	p_slots->driver->unlock();
+	return ret;
+}
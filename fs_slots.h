@@ -0,0 +1,108 @@
+/**
+ * Raw A/B slot store for a few small critical values, outside SPIFFS.
+ *
+ * Uses two erase blocks of a driver partition directly, one of them active.
+ * Values are appended to the active block as fixed size entries, so setting
+ * a value is a single program into erased flash, and the latest entry of a
+ * slot is its value. When the active block is full, the current values are
+ * written to the other block, which then becomes active. Every value is
+ * kept in a RAM mirror, reads do not touch the flash and are available as
+ * soon as fs_slots_init returns, without waiting for the filesystems.
+ *
+ * Block layout, integers are little-endian:
+ *   entries from offset 8:
+ *     u8 slot, u8 len, u16 crc16 of slot, len and data, data[FS_SLOTS_VALUE_SIZE]
+ *   u32 "FSS1", u32 sequence at offset 0, written after the entries when a
+ *   block is made active, the valid block with the larger sequence is active
+ *
+ * An entry that was cut short by a reset fails the check and is skipped,
+ * the slot keeps its previous value.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef _FS_SLOTS_H_
+#define _FS_SLOTS_H_
+
+#include <stdint.h>
+#include "fs.h"
+
+// Number of slots
+#ifndef FS_SLOTS_COUNT
+#define FS_SLOTS_COUNT 8
+#endif//FS_SLOTS_COUNT
+
+// Largest value in bytes, a multiple of 4
+#ifndef FS_SLOTS_VALUE_SIZE
+#define FS_SLOTS_VALUE_SIZE 8
+#endif//FS_SLOTS_VALUE_SIZE
+
+#if FS_SLOTS_VALUE_SIZE % 4 != 0
+	#error FS_SLOTS_VALUE_SIZE % 4 != 0
+#endif
+#if FS_SLOTS_COUNT > 255
+	#error FS_SLOTS_COUNT > 255
+#endif
+
+#define FS_SLOTS_MAGIC "FSS1"
+
+#define FS_SLOTS_ERR_PARAM (-70200)
+#define FS_SLOTS_ERR_EMPTY (-70201)
+#define FS_SLOTS_ERR_SIZE  (-70202)
+
+typedef struct fs_slots_struct
+{
+	fs_driver_t * driver;
+	int      partition;
+	uint32_t addr;        // Start of the first of the two blocks
+	uint32_t block_size;
+	uint32_t sequence;    // Sequence of the active block
+	uint32_t offset;      // Next free entry in the active block
+	uint8_t  active;      // 0 or 1
+	uint8_t  lens[FS_SLOTS_COUNT]; // 0xFF for a slot that has no value
+	uint8_t  values[FS_SLOTS_COUNT][FS_SLOTS_VALUE_SIZE];
+} fs_slots_t;
+
+/**
+ * Load the slots from flash into RAM. Prepares the first block if neither
+ * block holds slots yet. Does not need the fs thread or fs_init, but the
+ * blocks must not be part of a filesystem.
+ *
+ * @param p_slots - Slot store state.
+ * @param driver - Flash driver.
+ * @param partition - Driver partition.
+ * @param addr - Start of the two blocks in the partition, erase block aligned.
+ *
+ * @return 0 on success, error otherwise. A flash read error is returned as
+ *         it is and the blocks are left untouched, call again to retry.
+ */
+int32_t fs_slots_init (fs_slots_t * p_slots, fs_driver_t * driver, int partition, uint32_t addr);
+
+/**
+ * Read the value of a slot from RAM. Does not wait for the flash or the
+ * driver lock, the copy is made in a short osKernelLock section.
+ *
+ * @param p_slots - Slot store state.
+ * @param slot - Slot number 0..FS_SLOTS_COUNT-1.
+ * @param p_value - Buffer for the value.
+ * @param len - Size of the buffer, a longer value is truncated.
+ *
+ * @return Length of the value, FS_SLOTS_ERR_EMPTY if the slot has never been set.
+ */
+int32_t fs_slots_get (fs_slots_t * p_slots, uint8_t slot, void * p_value, uint32_t len);
+
+/**
+ * Set the value of a slot, programs one entry unless the value is unchanged.
+ * Once a block is full, the current values are first copied to the other
+ * block, which takes an erase.
+ *
+ * @param p_slots - Slot store state.
+ * @param slot - Slot number 0..FS_SLOTS_COUNT-1.
+ * @param p_value - New value.
+ * @param len - Length of the value, 0..FS_SLOTS_VALUE_SIZE.
+ *
+ * @return 0 on success, error otherwise, the slot keeps its previous value.
+ */
+int32_t fs_slots_set (fs_slots_t * p_slots, uint8_t slot, const void * p_value, uint32_t len);
+
+#endif//_FS_SLOTS_H_
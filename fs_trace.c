@@ -0,0 +1,74 @@
+/**
+ * Capture of filesystem API calls, see fs_trace.h.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+
+#include "fs_trace.h"
+#include "cmsis_os2.h"
+
+#ifndef FS_TRACE_ENTRIES
+#define FS_TRACE_ENTRIES 256
+#endif//FS_TRACE_ENTRIES
+
+static fs_trace_entry_t m_trace[FS_TRACE_ENTRIES];
+static uint32_t m_trace_head; // Next entry to write
+static uint32_t m_trace_count;
+static uint32_t m_trace_dropped;
+
+void fs_trace_add (int file_sys_nr, uint8_t op, uint8_t arg, uint16_t id, int32_t value)
+{
+	int32_t lock = osKernelLock();
+	if (lock < 0)
+	{
+		return; // osErrorISR, record requests queued from an interrupt
+	}
+	fs_trace_entry_t * e = &m_trace[m_trace_head];
+	e->time = osKernelGetTickCount();
+	e->value = value;
+	e->id = id;
+	e->op = (uint8_t)((file_sys_nr << FS_TRACE_FS_SHIFT) | (op & FS_TRACE_OP_MASK));
+	e->arg = arg;
+	m_trace_head = (m_trace_head + 1) % FS_TRACE_ENTRIES;
+	if (m_trace_count < FS_TRACE_ENTRIES)
+	{
+		m_trace_count++;
+	}
+	else
+	{
+		m_trace_dropped++;
+	}
+	osKernelRestoreLock(lock);
+}
+
+uint16_t fs_trace_name_id (const char * p_name)
+{
+	// FNV-1a folded to 16 bits
+	uint32_t hash = 2166136261UL;
+	while ('\0' != *p_name)
+	{
+		hash ^= (uint8_t)*p_name++;
+		hash *= 16777619UL;
+	}
+	return (uint16_t)((hash >> 16) ^ hash);
+}
+
+uint32_t fs_trace_read (fs_trace_entry_t * p_entries, uint32_t count)
+{
+	uint32_t n = 0;
+	int32_t lock = osKernelLock();
+	while ((n < count) && (m_trace_count > 0))
+	{
+		uint32_t tail = (m_trace_head + FS_TRACE_ENTRIES - m_trace_count) % FS_TRACE_ENTRIES;
+		p_entries[n++] = m_trace[tail];
+		m_trace_count--;
+	}
+	osKernelRestoreLock(lock);
+	return n;
+}
+
+uint32_t fs_trace_dropped ()
+{
+	return m_trace_dropped;
+}
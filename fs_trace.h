@@ -0,0 +1,90 @@
+/**
+ * Capture of filesystem API calls for replaying production workloads.
+ *
+ * When fs.c is built with FS_TRACE defined, every API call made by the
+ * application is stored in a RAM ring buffer of FS_TRACE_ENTRIES entries,
+ * the oldest entries are overwritten when the buffer is full. The
+ * application drains the buffer with fs_trace_read and stores or sends the
+ * entries, tools/fs_replay replays a file of them on the host.
+ *
+ * File names are stored as a 16-bit hash, data is not stored at all, only
+ * the lengths, offsets and flags of the calls. Calls made by the fs thread
+ * itself for queued record operations and by fs_emergency_flush for the
+ * records it writes out are not captured, the record operations are
+ * captured when they are queued.
+ *
+ * The buffer is protected with osKernelLock, which is not available in
+ * interrupts. Record requests queued from an interrupt are not captured,
+ * fs_trace_read must be called from a thread.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef _FS_TRACE_H_
+#define _FS_TRACE_H_
+
+#include <stdint.h>
+
+// Operations, file system number in the upper 2 bits of the op field
+#define FS_TRACE_OPEN          1  // id: name, arg: flags, value: resulting descriptor or error
+#define FS_TRACE_READ          2  // id: descriptor, value: length
+#define FS_TRACE_WRITE         3  // id: descriptor, value: length
+#define FS_TRACE_LSEEK         4  // id: descriptor, arg: whence, value: offset
+#define FS_TRACE_FSTAT         5  // id: descriptor
+#define FS_TRACE_FLUSH         6  // id: descriptor
+#define FS_TRACE_CLOSE         7  // id: descriptor
+#define FS_TRACE_UNLINK        8  // id: name
+#define FS_TRACE_READ_RECORD   9  // id: name, value: length
+#define FS_TRACE_WRITE_RECORD 10  // id: name, value: length
+
+#define FS_TRACE_OP_MASK   0x3F
+#define FS_TRACE_FS_SHIFT  6
+
+// A captured call, 12 bytes, stored and exported in little-endian order
+typedef struct fs_trace_entry
+{
+	uint32_t time;  // Kernel tick count at the call
+	int32_t  value;
+	uint16_t id;    // Name hash or SPIFFS file handle
+	uint8_t  op;
+	uint8_t  arg;
+} fs_trace_entry_t;
+
+/**
+ * Store a call, used by fs.c.
+ *
+ * @param file_sys_nr - File system number 0..2
+ * @param op - FS_TRACE_ operation.
+ * @param arg - Flags or whence.
+ * @param id - Name hash or file handle.
+ * @param value - Length, offset or result.
+ */
+void fs_trace_add (int file_sys_nr, uint8_t op, uint8_t arg, uint16_t id, int32_t value);
+
+/**
+ * Get the 16-bit hash used for a file name in the trace.
+ *
+ * @param p_name - File name.
+ *
+ * @return Hash of the name.
+ */
+uint16_t fs_trace_name_id (const char * p_name);
+
+/**
+ * Move the oldest captured calls out of the trace buffer.
+ *
+ * @param p_entries - Memory to store the entries.
+ * @param count - Maximum number of entries to store.
+ *
+ * @return Number of entries stored.
+ */
+uint32_t fs_trace_read (fs_trace_entry_t * p_entries, uint32_t count);
+
+/**
+ * Return the number of calls that were overwritten before they were read.
+ *
+ * @return Number of lost entries since boot.
+ */
+uint32_t fs_trace_dropped ();
+
+#endif//_FS_TRACE_H_
@@ -0,0 +1,144 @@
+/**
+ * Fault-injecting wrapper for an fs_driver_t.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include "faultflash.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static fs_driver_t * m_inner;
+static faultflash_config_t m_config;
+static faultflash_stats_t m_stats;
+static uint32_t m_rand = 1;
+
+static uint32_t faultflash_rand (void)
+{
+	m_rand ^= m_rand << 13;
+	m_rand ^= m_rand >> 17;
+	m_rand ^= m_rand << 5;
+	return m_rand;
+}
+
+static int32_t faultflash_error (void)
+{
+	return (0 != m_config.fail_error) ? m_config.fail_error : FS_ERR_TRANSIENT;
+}
+
+static bool faultflash_hit (uint32_t ppm)
+{
+	return (0 != ppm) && (faultflash_rand() % 1000000UL < ppm);
+}
+
+static void faultflash_flip (uint8_t * data, uint32_t size)
+{
+	uint32_t bit = faultflash_rand() % (size * 8);
+	data[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+}
+
+static int32_t faultflash_read (int partition, uint32_t addr, uint32_t size, uint8_t * dst)
+{
+	if (faultflash_hit(m_config.read_fail_ppm))
+	{
+		m_stats.read_fails++;
+		return faultflash_error();
+	}
+	int32_t ret = m_inner->read(partition, addr, size, dst);
+	if ((ret >= 0) && (0 != size) && faultflash_hit(m_config.read_flip_ppm))
+	{
+		m_stats.read_flips++;
+		faultflash_flip(dst, size);
+	}
+	return ret;
+}
+
+static int32_t faultflash_write (int partition, uint32_t addr, uint32_t size, uint8_t * src)
+{
+	if (faultflash_hit(m_config.write_fail_ppm))
+	{
+		m_stats.write_fails++;
+		return faultflash_error();
+	}
+	if ((0 != size) && faultflash_hit(m_config.write_flip_ppm))
+	{
+		// Program a corrupted copy, the caller's buffer is left as is
+		uint8_t * copy = malloc(size);
+		if (NULL != copy)
+		{
+			memcpy(copy, src, size);
+			faultflash_flip(copy, size);
+			m_stats.write_flips++;
+			int32_t ret = m_inner->write(partition, addr, size, copy);
+			free(copy);
+			return ret;
+		}
+	}
+	return m_inner->write(partition, addr, size, src);
+}
+
+static int32_t faultflash_erase (int partition, uint32_t addr, uint32_t size)
+{
+	if (faultflash_hit(m_config.erase_fail_ppm))
+	{
+		m_stats.erase_fails++;
+		return faultflash_error();
+	}
+	return m_inner->erase(partition, addr, size);
+}
+
+static int32_t faultflash_size (int partition)
+{
+	return m_inner->size(partition);
+}
+
+static int32_t faultflash_erase_size (int partition)
+{
+	return m_inner->erase_size(partition);
+}
+
+static void faultflash_suspend ()
+{
+	m_inner->suspend();
+}
+
+static void faultflash_lock ()
+{
+	m_inner->lock();
+}
+
+static void faultflash_unlock ()
+{
+	m_inner->unlock();
+}
+
+static fs_driver_t m_driver = {
+	.read = faultflash_read,
+	.write = faultflash_write,
+	.erase = faultflash_erase,
+	.size = faultflash_size,
+	.erase_size = faultflash_erase_size,
+	.suspend = faultflash_suspend,
+	.lock = faultflash_lock,
+	.unlock = faultflash_unlock,
+};
+
+fs_driver_t * faultflash_driver (fs_driver_t * p_driver)
+{
+	m_inner = p_driver;
+	return &m_driver;
+}
+
+void faultflash_configure (const faultflash_config_t * p_config)
+{
+	m_config = *p_config;
+	m_rand = (0 != p_config->seed) ? p_config->seed : 1;
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void faultflash_get_stats (faultflash_stats_t * p_stats)
+{
+	*p_stats = m_stats;
+}
@@ -0,0 +1,68 @@
+/**
+ * Fault-injecting wrapper for an fs_driver_t.
+ *
+ * Forwards every operation to the wrapped driver, but fails reads, programs
+ * and erases and flips bits at configurable rates, like a flaky SPI line or
+ * a worn flash would. A failed operation is not forwarded and returns
+ * fail_error, FS_ERR_TRANSIENT by default. A read bit flip
+ * corrupts one bit of the data returned to the caller, a program bit flip
+ * corrupts one bit of the data stored in the flash. Faults are picked with a
+ * seeded generator, so a run can be repeated.
+ *
+ * Only one driver can be wrapped at a time.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef FAULTFLASH_H_
+#define FAULTFLASH_H_
+
+#include <stdint.h>
+#include "fs.h"
+
+// Fault rates in parts per million of operations
+typedef struct faultflash_config
+{
+	uint32_t read_fail_ppm;
+	uint32_t write_fail_ppm;
+	uint32_t erase_fail_ppm;
+	uint32_t read_flip_ppm;
+	uint32_t write_flip_ppm;
+	int32_t  fail_error;  // FS_ERR_ code of failed operations, 0 for FS_ERR_TRANSIENT
+	uint32_t seed;
+} faultflash_config_t;
+
+typedef struct faultflash_stats
+{
+	uint32_t read_fails;
+	uint32_t write_fails;
+	uint32_t erase_fails;
+	uint32_t read_flips;
+	uint32_t write_flips;
+} faultflash_stats_t;
+
+/**
+ * Wrap a driver, faults are disabled until faultflash_configure is called.
+ *
+ * @param p_driver - Driver to forward the operations to.
+ *
+ * @return The fault-injecting driver.
+ */
+fs_driver_t * faultflash_driver (fs_driver_t * p_driver);
+
+/**
+ * Set the fault rates and restart the fault generator from the seed. A
+ * configuration of all zero rates disables faults.
+ *
+ * @param p_config - Fault rates.
+ */
+void faultflash_configure (const faultflash_config_t * p_config);
+
+/**
+ * Get the number of injected faults since the last faultflash_configure.
+ *
+ * @param p_stats - Memory to store the counters.
+ */
+void faultflash_get_stats (faultflash_stats_t * p_stats);
+
+#endif//FAULTFLASH_H_
@@ -0,0 +1,416 @@
+/**
+ * Filesystem aging benchmark.
+ *
+ * Fills the partition with static data, then churns a set of dynamic files
+ * with a configurable mix of overwrites, appends and deletes at a given
+ * number of bytes per simulated day. For every window of days it reports
+ * the fs_write and fs_write_record latency percentiles, the erases per
+ * written MiB and the share of writes that had to wait for garbage
+ * collection, showing how the latency evolves from a fresh filesystem to
+ * steady state and beyond.
+ *
+ * Latencies are the device time estimated from the flash operations of every
+ * call with the ramflash timing, or the host time with -H.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define AGE_PARTITION   0
+#define AGE_MAX_FILES   64
+#define AGE_CHUNK       256
+#define AGE_STATIC_SIZE 1024
+
+typedef struct age_latencies
+{
+	uint32_t * us;
+	uint32_t   count;
+	uint32_t   capacity;
+} age_latencies_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_live = 50;
+static uint32_t m_mix[3] = { 60, 30, 10 }; // overwrite, append, delete
+static uint32_t m_record_share = 50;
+static uint32_t m_day_bytes = 64UL * 1024UL;
+static uint32_t m_days = 180;
+static uint32_t m_window = 30;
+static uint32_t m_file_count = 16;
+static uint32_t m_max_file = 2048;
+static uint32_t m_seed = 1;
+static bool m_host_time;
+
+static uint32_t m_sizes[AGE_MAX_FILES];
+static uint8_t m_data[65536];
+static uint32_t m_rand;
+
+static age_latencies_t m_write_lat;
+static age_latencies_t m_record_lat;
+static uint64_t m_window_written;
+static uint32_t m_window_ops;
+static uint32_t m_window_gc_ops;
+static uint32_t m_failures;
+
+static osThreadId_t m_app_thread;
+static volatile int32_t m_record_len;
+
+static uint32_t age_rand (void)
+{
+	m_rand ^= m_rand << 13;
+	m_rand ^= m_rand >> 17;
+	m_rand ^= m_rand << 5;
+	return m_rand;
+}
+
+static uint64_t age_host_us (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void age_latency_add (age_latencies_t * l, uint64_t us)
+{
+	if (l->count == l->capacity)
+	{
+		l->capacity = (0 == l->capacity) ? 1024 : 2 * l->capacity;
+		l->us = realloc(l->us, l->capacity * sizeof(uint32_t));
+	}
+	l->us[l->count++] = (uint32_t)us;
+}
+
+static int age_compare (const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t age_percentile (age_latencies_t * l, double p)
+{
+	if (0 == l->count)
+	{
+		return 0;
+	}
+	return l->us[(uint32_t)(p * (l->count - 1) / 100.0 + 0.5)];
+}
+
+// Measurement of one call, in estimated device or host time
+typedef struct age_probe
+{
+	ramflash_stats_t stats;
+	uint64_t         host_us;
+} age_probe_t;
+
+static void age_probe_start (age_probe_t * p)
+{
+	ramflash_get_stats(AGE_PARTITION, &p->stats);
+	p->host_us = age_host_us();
+}
+
+static void age_probe_end (age_probe_t * p, age_latencies_t * l)
+{
+	ramflash_stats_t now;
+	uint64_t host_us = age_host_us() - p->host_us;
+	ramflash_get_stats(AGE_PARTITION, &now);
+	ramflash_stats_diff(&now, &p->stats, &now);
+	age_latency_add(l, m_host_time ? host_us : ramflash_stats_time_us(&now));
+	m_window_ops++;
+	if (now.erases > 0)
+	{
+		m_window_gc_ops++;
+	}
+}
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	m_record_len = len;
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static void age_name (char * name, size_t size, uint32_t file)
+{
+	snprintf(name, size, "d%02u", (unsigned int)file);
+}
+
+static void age_write_file (uint32_t file, uint32_t len, uint32_t flags)
+{
+	char name[8];
+	age_probe_t probe;
+	age_name(name, sizeof(name), file);
+	fs_fd fd = fs_open(0, name, flags | FS_CREAT | FS_WRONLY);
+	if (fd < 0)
+	{
+		m_failures++;
+		return;
+	}
+	for (uint32_t done = 0; done < len; done += AGE_CHUNK)
+	{
+		uint32_t n = (len - done < AGE_CHUNK) ? len - done : AGE_CHUNK;
+		age_probe_start(&probe);
+		int32_t ret = fs_write(0, fd, &m_data[done], (int32_t)n);
+		age_probe_end(&probe, &m_write_lat);
+		if (ret != (int32_t)n)
+		{
+			m_failures++;
+			break;
+		}
+	}
+	fs_close(0, fd);
+}
+
+static void age_write_record (uint32_t file, uint32_t len)
+{
+	static char names[AGE_MAX_FILES][8];
+	age_probe_t probe;
+	age_name(names[file], sizeof(names[file]), file);
+	age_probe_start(&probe);
+	if (0 == fs_write_record(0, names[file], m_data, (int32_t)len, 1, record_done_cb, m_app_thread))
+	{
+		m_failures++;
+		return;
+	}
+	osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+	age_probe_end(&probe, &m_record_lat);
+	if (m_record_len != (int32_t)len)
+	{
+		m_failures++;
+	}
+}
+
+// One churn operation, returns the number of bytes written
+static uint32_t age_churn (void)
+{
+	char name[8];
+	uint32_t file = age_rand() % m_file_count;
+	uint32_t pick = age_rand() % (m_mix[0] + m_mix[1] + m_mix[2]);
+	uint32_t len;
+
+	if ((pick >= m_mix[0] + m_mix[1]) && (0 != m_sizes[file]))
+	{
+		age_name(name, sizeof(name), file);
+		fs_unlink(0, name);
+		m_sizes[file] = 0;
+		return 0;
+	}
+	if ((pick >= m_mix[0]) && (pick < m_mix[0] + m_mix[1]))
+	{
+		len = 16 + age_rand() % (AGE_CHUNK - 16);
+		if (m_sizes[file] + len <= m_max_file)
+		{
+			age_write_file(file, len, FS_APPEND);
+			m_sizes[file] += len;
+			return len;
+		}
+	}
+
+	// Overwrite, records write over the start of the file without truncating
+	len = 64 + age_rand() % (m_max_file - 64 + 1);
+	if (age_rand() % 100 < m_record_share)
+	{
+		age_write_record(file, len);
+		if (len > m_sizes[file])
+		{
+			m_sizes[file] = len;
+		}
+	}
+	else
+	{
+		age_write_file(file, len, FS_TRUNC);
+		m_sizes[file] = len;
+	}
+	return len;
+}
+
+static void age_fill (void)
+{
+	char name[8];
+	uint32_t total = 0, used = 0;
+	for (uint32_t i = 0; (0 == fs_info(0, &total, &used)) && (used < (uint64_t)total * m_live / 100); i++)
+	{
+		snprintf(name, sizeof(name), "s%03u", (unsigned int)i);
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd < 0)
+		{
+			break;
+		}
+		fs_write(0, fd, m_data, AGE_STATIC_SIZE);
+		fs_close(0, fd);
+	}
+	printf("static data %"PRIu32" of %"PRIu32" bytes\n", used, total);
+}
+
+static void age_thread (void * arg)
+{
+	ramflash_stats_t window_start, now;
+	uint64_t total_erases = 0;
+	uint32_t steady_day = 0;
+	uint32_t blocks = m_size / m_erase_size;
+
+	for (uint32_t i = 0; i < sizeof(m_data); i++)
+	{
+		m_data[i] = (uint8_t)(i * 13);
+	}
+	fs_init(0, AGE_PARTITION, ramflash_driver());
+	fs_start();
+	age_fill();
+
+	printf("%5s %9s %7s %8s %6s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+	       "day", "written", "erases", "er/MiB", "gc%",
+	       "wr_p50", "wr_p99", "wr_p99.9", "wr_max", "rec_p50", "rec_p99", "rec_p99.9", "rec_max");
+	ramflash_get_stats(AGE_PARTITION, &window_start);
+	for (uint32_t day = 1; day <= m_days; day++)
+	{
+		uint64_t written = 0;
+		while (written < m_day_bytes)
+		{
+			written += age_churn();
+		}
+		m_window_written += written;
+
+		if ((0 == day % m_window) || (day == m_days))
+		{
+			ramflash_get_stats(AGE_PARTITION, &now);
+			ramflash_stats_diff(&now, &window_start, &window_start);
+			total_erases += window_start.erases;
+			if ((0 == steady_day) && (total_erases >= blocks))
+			{
+				steady_day = day;
+			}
+			qsort(m_write_lat.us, m_write_lat.count, sizeof(uint32_t), age_compare);
+			qsort(m_record_lat.us, m_record_lat.count, sizeof(uint32_t), age_compare);
+			printf("%5"PRIu32" %9"PRIu64" %7"PRIu32" %8.1f %6.2f %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32"\n",
+			       day, m_window_written, window_start.erases,
+			       (double)window_start.erases * 1048576.0 / m_window_written,
+			       (0 != m_window_ops) ? 100.0 * m_window_gc_ops / m_window_ops : 0.0,
+			       age_percentile(&m_write_lat, 50), age_percentile(&m_write_lat, 99),
+			       age_percentile(&m_write_lat, 99.9), age_percentile(&m_write_lat, 100),
+			       age_percentile(&m_record_lat, 50), age_percentile(&m_record_lat, 99),
+			       age_percentile(&m_record_lat, 99.9), age_percentile(&m_record_lat, 100));
+			fflush(stdout);
+
+			window_start = now;
+			m_write_lat.count = 0;
+			m_record_lat.count = 0;
+			m_window_written = 0;
+			m_window_ops = 0;
+			m_window_gc_ops = 0;
+		}
+	}
+	if (0 != steady_day)
+	{
+		printf("every block erased once on average by day %"PRIu32"\n", steady_day);
+	}
+	printf("%"PRIu32" failed writes\n", m_failures);
+#ifdef FS_WEAR_LEVELING
+	// Every pass must move distinct blocks, a relocated block counts as
+	// just erased
+	fs_wear_stats_t wear;
+	fs_wear_stats(0, &wear);
+	printf("wear leveling: %"PRIu32" passes, %"PRIu32" blocks relocated, %"PRIu32" repeated\n",
+	       wear.passes, wear.relocations, wear.repeats);
+	if (0 != wear.repeats)
+	{
+		m_failures++;
+	}
+#endif//FS_WEAR_LEVELING
+	fflush(stdout);
+	_exit((0 == m_failures) ? 0 : 1);
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-l live%%] [-m overwrite,append,delete]\n"
+	                "       [-r record%%] [-n files] [-z max_file_size] [-d bytes_per_day] [-D days]\n"
+	                "       [-w window_days] [-S seed] [-H]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:l:m:r:n:z:d:D:w:S:Hh")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'l':
+				m_live = strtoul(optarg, NULL, 0);
+			break;
+			case 'm':
+				if (3 != sscanf(optarg, "%"SCNu32",%"SCNu32",%"SCNu32, &m_mix[0], &m_mix[1], &m_mix[2]))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+			break;
+			case 'r':
+				m_record_share = strtoul(optarg, NULL, 0);
+			break;
+			case 'n':
+				m_file_count = strtoul(optarg, NULL, 0);
+			break;
+			case 'z':
+				m_max_file = strtoul(optarg, NULL, 0);
+			break;
+			case 'd':
+				m_day_bytes = strtoul(optarg, NULL, 0);
+			break;
+			case 'D':
+				m_days = strtoul(optarg, NULL, 0);
+			break;
+			case 'w':
+				m_window = strtoul(optarg, NULL, 0);
+			break;
+			case 'S':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			case 'H':
+				m_host_time = true;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((0 == m_file_count) || (m_file_count > AGE_MAX_FILES) || (m_max_file < 64) || (m_max_file > sizeof(m_data))
+	 || (0 == m_mix[0] + m_mix[1] + m_mix[2]) || (0 == m_window) || (0 == m_day_bytes))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	m_rand = (0 != m_seed) ? m_seed : 1;
+
+	if (0 != ramflash_create(AGE_PARTITION, m_size, m_erase_size))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return 1;
+	}
+	printf("partition %"PRIu32" erase %"PRIu32", %"PRIu32" files up to %"PRIu32" bytes, mix %"PRIu32",%"PRIu32",%"PRIu32", "
+	       "%"PRIu32"%% records, %"PRIu32" bytes per day, latencies in %s us\n",
+	       m_size, m_erase_size, m_file_count, m_max_file, m_mix[0], m_mix[1], m_mix[2],
+	       m_record_share, m_day_bytes, m_host_time ? "host" : "estimated device");
+	fflush(stdout);
+
+	osKernelInitialize();
+	const osThreadAttr_t attr = { .name = "age" };
+	m_app_thread = osThreadNew(age_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
@@ -0,0 +1,264 @@
+/**
+ * Bad block replacement check.
+ *
+ * Builds fs.c with FS_BAD_BLOCKS and writes files through the
+ * fault-injecting driver wrapper with hard program and erase failures, until
+ * the target number of spare blocks has been taken, then continues without
+ * faults. With spares left, a failing block is replaced without the write
+ * failing, so every write must succeed. The filesystem is then started again
+ * from the resulting flash without faults: the replacement table must have
+ * been kept, and every file must read back with its last written contents.
+ *
+ * Every run is a forked process, so the flash contents survive it, like the
+ * flash survives a reset.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "faultflash.h"
+#include "ramflash.h"
+
+#define BADBLOCKS_PARTITION   0
+#define BADBLOCKS_FILE_COUNT  8
+#define BADBLOCKS_RECORD_SIZE 512
+
+// State shared with the forked runs
+typedef struct badblocks_shared
+{
+	uint32_t version[BADBLOCKS_FILE_COUNT]; // Last successfully written version
+	uint32_t write_fails;
+	uint32_t faults;
+	uint32_t replaced;     // Spares taken in the workload
+	uint32_t replaced_mnt; // Spares known after the restart
+	uint32_t lost;
+} badblocks_shared_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_ops = 4000;
+static uint32_t m_ppm = 2000;
+static uint32_t m_target = 2;
+static uint32_t m_seed = 1;
+
+static badblocks_shared_t * m_shared;
+static uint8_t m_record[BADBLOCKS_RECORD_SIZE];
+static uint8_t m_record_rd[BADBLOCKS_RECORD_SIZE];
+
+static void badblocks_record_fill (uint8_t * record, uint32_t file, uint32_t version)
+{
+	for (uint32_t i = 0; i < BADBLOCKS_RECORD_SIZE; i++)
+	{
+		record[i] = (uint8_t)(version * 31 + file * 7 + i);
+	}
+}
+
+static void run_workload (void)
+{
+	char name[16];
+	faultflash_stats_t stats;
+	faultflash_config_t config = { .write_fail_ppm = m_ppm, .erase_fail_ppm = m_ppm,
+	                               .fail_error = FS_ERR_HARD, .seed = m_seed };
+	bool faults = true;
+
+	fs_init(0, BADBLOCKS_PARTITION, faultflash_driver(ramflash_driver()));
+	fs_start();
+	faultflash_configure(&config);
+	for (uint32_t i = 0; i < m_ops; i++)
+	{
+		uint32_t file = i % BADBLOCKS_FILE_COUNT;
+		uint32_t version = m_shared->version[file] + 1;
+		snprintf(name, sizeof(name), "bb%u", (unsigned int)file);
+		badblocks_record_fill(m_record, file, version);
+
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		bool ok = (fd >= 0) && (BADBLOCKS_RECORD_SIZE == fs_write(0, fd, m_record, sizeof(m_record)));
+		if (fd >= 0)
+		{
+			fs_close(0, fd);
+		}
+		if (ok)
+		{
+			m_shared->version[file] = version;
+		}
+		else
+		{
+			printf("write %s version %"PRIu32" failed\n", name, version);
+			m_shared->write_fails++;
+			m_shared->version[file] = 0; // Contents unknown
+		}
+
+		if (faults && (fs_bad_block_count(0) >= m_target))
+		{
+			faultflash_get_stats(&stats);
+			m_shared->faults = stats.write_fails + stats.erase_fails;
+			faultflash_configure(&(faultflash_config_t){ .seed = 1 });
+			faults = false;
+		}
+	}
+	if (faults)
+	{
+		faultflash_get_stats(&stats);
+		m_shared->faults = stats.write_fails + stats.erase_fails;
+	}
+	m_shared->replaced = fs_bad_block_count(0);
+}
+
+static void run_mount (void)
+{
+	char name[16];
+
+	fs_init(0, BADBLOCKS_PARTITION, ramflash_driver());
+	fs_start();
+	m_shared->replaced_mnt = fs_bad_block_count(0);
+	m_shared->lost = 0;
+	for (uint32_t file = 0; file < BADBLOCKS_FILE_COUNT; file++)
+	{
+		if (0 == m_shared->version[file])
+		{
+			continue;
+		}
+		snprintf(name, sizeof(name), "bb%u", (unsigned int)file);
+		badblocks_record_fill(m_record, file, m_shared->version[file]);
+		bool found = false;
+		fs_fd fd = fs_open(0, name, FS_RDONLY);
+		if (fd >= 0)
+		{
+			found = (BADBLOCKS_RECORD_SIZE == fs_read(0, fd, m_record_rd, sizeof(m_record_rd)))
+			     && (0 == memcmp(m_record, m_record_rd, sizeof(m_record)));
+			fs_close(0, fd);
+		}
+		if (!found)
+		{
+			printf("%s version %"PRIu32" lost\n", name, m_shared->version[file]);
+			m_shared->lost++;
+		}
+	}
+}
+
+static void app_thread (void * arg)
+{
+	((void (*)(void))arg)();
+	fflush(stdout);
+	_exit(0);
+}
+
+// Run in a forked process, returns the exit status
+static int badblocks_run (void (*run)(void))
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == pid)
+	{
+		osKernelInitialize();
+		const osThreadAttr_t attr = { .name = "app" };
+		osThreadNew(app_thread, (void *)run, &attr);
+		osKernelStart();
+		_exit(1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-n ops] [-R ppm] [-b spares_to_use] [-r seed]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:n:R:b:r:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'n':
+				m_ops = strtoul(optarg, NULL, 0);
+			break;
+			case 'R':
+				m_ppm = strtoul(optarg, NULL, 0);
+			break;
+			case 'b':
+				m_target = strtoul(optarg, NULL, 0);
+			break;
+			case 'r':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (0 != ramflash_create(BADBLOCKS_PARTITION, m_size, m_erase_size))
+	{
+		fprintf(stderr, "ramflash_create failed\n");
+		return 1;
+	}
+	m_shared = mmap(NULL, sizeof(badblocks_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == m_shared)
+	{
+		perror("mmap");
+		return 1;
+	}
+	memset(m_shared, 0, sizeof(badblocks_shared_t));
+
+	uint32_t failures = 0;
+	if (0 != badblocks_run(run_workload))
+	{
+		printf("workload crashed\n");
+		failures++;
+	}
+	printf("ops %"PRIu32" faults %"PRIu32" write failures %"PRIu32" spares taken %"PRIu32"\n",
+	       m_ops, m_shared->faults, m_shared->write_fails, m_shared->replaced);
+	if (0 != badblocks_run(run_mount))
+	{
+		printf("mount crashed\n");
+		failures++;
+	}
+	printf("after restart: spares taken %"PRIu32" files lost %"PRIu32"\n", m_shared->replaced_mnt, m_shared->lost);
+
+	if (m_shared->replaced < m_target)
+	{
+		printf("FAIL: fewer than %"PRIu32" spares taken\n", m_target);
+		failures++;
+	}
+	if (0 != m_shared->write_fails)
+	{
+		printf("FAIL: writes failed with spares left\n");
+		failures++;
+	}
+	if (m_shared->replaced_mnt != m_shared->replaced)
+	{
+		printf("FAIL: replacement table not kept\n");
+		failures++;
+	}
+	if (0 != m_shared->lost)
+	{
+		printf("FAIL: data lost\n");
+		failures++;
+	}
+	return (0 == failures) ? 0 : 1;
+}
@@ -0,0 +1,528 @@
+/**
+ * Filesystem benchmark regression gate.
+ *
+ * Runs a fixed set of workloads on the RAM-backed flash and compares the
+ * results with a baseline stored in-tree as JSON: sequential write and read
+ * throughput, p99 latency of fs_write and fs_write_record on a churned
+ * filesystem, flash operations per written byte, static RAM of the fs layer
+ * and stack usage. Fails when any metric is worse than its baseline by more
+ * than the tolerance of the metric, -u records the measured values as the new
+ * baseline.
+ *
+ * Throughput and latency are the device time estimated from the flash
+ * operations with the default ramflash timing, so the results depend only on
+ * fs.c, SPIFFS and the build configuration and not on the host.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define BENCH_PARTITION    0
+#define BENCH_CHUNK        256
+#define BENCH_SEQ_SIZE     (32UL * 1024UL)
+#define BENCH_STATIC_SIZE  1024
+#define BENCH_STATIC_FILL  50 // Percent of the partition
+#define BENCH_RECORD_SIZE  200
+#define BENCH_CHURN_FILES  8
+#define BENCH_CHURN        4  // Write this many times the partition size
+
+enum {
+	BENCH_SEQ_WRITE,
+	BENCH_SEQ_READ,
+	BENCH_WRITE_P99,
+	BENCH_RECORD_P99,
+	BENCH_PROGRAM_PER_BYTE,
+	BENCH_OPS_PER_KIB,
+	BENCH_ERASES_PER_MIB,
+	BENCH_RAM,
+	BENCH_APP_STACK,
+	BENCH_FS_STACK,
+	BENCH_METRIC_COUNT
+};
+
+typedef struct bench_metric
+{
+	const char * name;
+	bool         higher_is_better;
+	double       tolerance_pct;  // Default for a new baseline
+	bool         measured;
+	double       value;
+	bool         has_baseline;
+	double       baseline;
+} bench_metric_t;
+
+typedef struct bench_latencies
+{
+	uint32_t * us;
+	uint32_t   count;
+	uint32_t   capacity;
+} bench_latencies_t;
+
+static bench_metric_t m_metrics[BENCH_METRIC_COUNT] = {
+	[BENCH_SEQ_WRITE]        = { "seq_write_kib_s",     true,  5 },
+	[BENCH_SEQ_READ]         = { "seq_read_kib_s",      true,  5 },
+	[BENCH_WRITE_P99]        = { "write_p99_us",        false, 10 },
+	[BENCH_RECORD_P99]       = { "record_write_p99_us", false, 10 },
+	[BENCH_PROGRAM_PER_BYTE] = { "program_per_byte",    false, 5 },
+	[BENCH_OPS_PER_KIB]      = { "flash_ops_per_kib",   false, 5 },
+	[BENCH_ERASES_PER_MIB]   = { "erases_per_mib",      false, 5 },
+	[BENCH_RAM]              = { "fs_ram_bytes",        false, 0 },
+	[BENCH_APP_STACK]        = { "app_stack_bytes",     false, 10 },
+	[BENCH_FS_STACK]         = { "fs_stack_bytes",      false, 10 },
+};
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static const char * m_baseline_path;
+static bool m_update;
+static int64_t m_ram = -1;
+
+static uint32_t m_baseline_size;
+static uint32_t m_baseline_erase_size;
+
+static osThreadId_t m_app_thread;
+static uint8_t m_data[BENCH_SEQ_SIZE];
+static volatile int32_t m_record_len;
+static uint32_t m_failures;
+
+static void bench_latency_add (bench_latencies_t * l, uint64_t us)
+{
+	if (l->count == l->capacity)
+	{
+		l->capacity = (0 == l->capacity) ? 1024 : 2 * l->capacity;
+		l->us = realloc(l->us, l->capacity * sizeof(uint32_t));
+	}
+	l->us[l->count++] = (uint32_t)us;
+}
+
+static int bench_compare (const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double bench_p99 (bench_latencies_t * l)
+{
+	if (0 == l->count)
+	{
+		return 0;
+	}
+	qsort(l->us, l->count, sizeof(uint32_t), bench_compare);
+	return l->us[(uint32_t)(0.99 * (l->count - 1) + 0.5)];
+}
+
+static void bench_set (int metric, double value)
+{
+	m_metrics[metric].value = value;
+	m_metrics[metric].measured = true;
+}
+
+// Estimated device time of the flash operations since the snapshot
+static uint64_t bench_elapsed_us (const ramflash_stats_t * p_start)
+{
+	ramflash_stats_t now;
+	ramflash_get_stats(BENCH_PARTITION, &now);
+	ramflash_stats_diff(&now, p_start, &now);
+	return ramflash_stats_time_us(&now);
+}
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	m_record_len = len;
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static void bench_sequential (void)
+{
+	ramflash_stats_t start;
+	uint64_t us;
+	fs_fd fd;
+
+	ramflash_get_stats(BENCH_PARTITION, &start);
+	fd = fs_open(0, "seq", FS_TRUNC | FS_CREAT | FS_WRONLY);
+	for (uint32_t done = 0; (fd >= 0) && (done < BENCH_SEQ_SIZE); done += BENCH_CHUNK)
+	{
+		if (BENCH_CHUNK != fs_write(0, fd, &m_data[done], BENCH_CHUNK))
+		{
+			m_failures++;
+			break;
+		}
+	}
+	if (fd >= 0)
+	{
+		fs_close(0, fd);
+	}
+	us = bench_elapsed_us(&start);
+	bench_set(BENCH_SEQ_WRITE, (0 != us) ? BENCH_SEQ_SIZE * 1e6 / 1024 / us : 0);
+
+	ramflash_get_stats(BENCH_PARTITION, &start);
+	fd = fs_open(0, "seq", FS_RDONLY);
+	for (uint32_t done = 0; (fd >= 0) && (done < BENCH_SEQ_SIZE); done += BENCH_CHUNK)
+	{
+		if (BENCH_CHUNK != fs_read(0, fd, &m_data[done], BENCH_CHUNK))
+		{
+			m_failures++;
+			break;
+		}
+	}
+	if (fd >= 0)
+	{
+		fs_close(0, fd);
+	}
+	us = bench_elapsed_us(&start);
+	bench_set(BENCH_SEQ_READ, (0 != us) ? BENCH_SEQ_SIZE * 1e6 / 1024 / us : 0);
+
+	fs_unlink(0, "seq");
+}
+
+static void bench_fill (void)
+{
+	char name[8];
+	uint32_t total = 0, used = 0;
+	for (uint32_t i = 0; (0 == fs_info(0, &total, &used)) && (used < (uint64_t)total * BENCH_STATIC_FILL / 100); i++)
+	{
+		snprintf(name, sizeof(name), "s%03u", (unsigned int)i);
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd < 0)
+		{
+			break;
+		}
+		fs_write(0, fd, m_data, BENCH_STATIC_SIZE);
+		fs_close(0, fd);
+	}
+}
+
+static void bench_churn (void)
+{
+	static char names[BENCH_CHURN_FILES][8];
+	bench_latencies_t writes = { 0 }, records = { 0 };
+	ramflash_stats_t start, op, now;
+	uint64_t written = 0;
+	char name[8];
+
+	ramflash_get_stats(BENCH_PARTITION, &start);
+	for (uint32_t i = 0; written < (uint64_t)BENCH_CHURN * m_size; i++)
+	{
+		uint32_t file = (i / 2) % BENCH_CHURN_FILES;
+		m_data[0] = (uint8_t)i;
+		if (0 == i % 2)
+		{
+			// Record overwrite, latency from queuing to the callback
+			snprintf(names[file], sizeof(names[file]), "r%02u", (unsigned int)file);
+			ramflash_get_stats(BENCH_PARTITION, &op);
+			if (0 == fs_write_record(0, names[file], m_data, BENCH_RECORD_SIZE, 1, record_done_cb, m_app_thread))
+			{
+				m_failures++;
+				break;
+			}
+			osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+			bench_latency_add(&records, bench_elapsed_us(&op));
+			if (BENCH_RECORD_SIZE != m_record_len)
+			{
+				m_failures++;
+			}
+			written += BENCH_RECORD_SIZE;
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "w%02u", (unsigned int)file);
+			fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+			if (fd < 0)
+			{
+				m_failures++;
+				break;
+			}
+			for (int c = 0; c < 2; c++)
+			{
+				ramflash_get_stats(BENCH_PARTITION, &op);
+				if (BENCH_CHUNK != fs_write(0, fd, m_data, BENCH_CHUNK))
+				{
+					m_failures++;
+				}
+				bench_latency_add(&writes, bench_elapsed_us(&op));
+				written += BENCH_CHUNK;
+			}
+			fs_close(0, fd);
+		}
+	}
+	ramflash_get_stats(BENCH_PARTITION, &now);
+	ramflash_stats_diff(&now, &start, &now);
+
+	bench_set(BENCH_WRITE_P99, bench_p99(&writes));
+	bench_set(BENCH_RECORD_P99, bench_p99(&records));
+	bench_set(BENCH_PROGRAM_PER_BYTE, (double)now.program_bytes / written);
+	bench_set(BENCH_OPS_PER_KIB, (double)(now.reads + now.programs + now.erases) * 1024 / written);
+	bench_set(BENCH_ERASES_PER_MIB, (double)now.erases * 1048576 / written);
+	free(writes.us);
+	free(records.us);
+}
+
+// Find the number after "key": in the JSON text, returns false if missing or null
+static bool bench_json_number (const char * text, const char * end, const char * key, double * p_value)
+{
+	char quoted[64];
+	snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+	const char * p = strstr(text, quoted);
+	if ((NULL == p) || ((NULL != end) && (p > end)))
+	{
+		return false;
+	}
+	p = strchr(p + strlen(quoted), ':');
+	if (NULL == p)
+	{
+		return false;
+	}
+	char * num_end;
+	*p_value = strtod(p + 1, &num_end);
+	return num_end != p + 1;
+}
+
+static int bench_load_baseline (const char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (NULL == f)
+	{
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char * text = malloc(size + 1);
+	int ret = ((size >= 0) && (1 == fread(text, size, 1, f))) ? 0 : -1;
+	fclose(f);
+	if (0 != ret)
+	{
+		free(text);
+		return -1;
+	}
+	text[size] = '\0';
+
+	double value;
+	if (bench_json_number(text, NULL, "partition_size", &value))
+	{
+		m_baseline_size = (uint32_t)value;
+	}
+	if (bench_json_number(text, NULL, "erase_size", &value))
+	{
+		m_baseline_erase_size = (uint32_t)value;
+	}
+	for (int i = 0; i < BENCH_METRIC_COUNT; i++)
+	{
+		char quoted[64];
+		snprintf(quoted, sizeof(quoted), "\"%s\"", m_metrics[i].name);
+		const char * entry = strstr(text, quoted);
+		if (NULL == entry)
+		{
+			continue;
+		}
+		const char * end = strchr(entry, '}');
+		m_metrics[i].has_baseline = bench_json_number(entry, end, "baseline", &m_metrics[i].baseline);
+		bench_json_number(entry, end, "tolerance_pct", &m_metrics[i].tolerance_pct);
+	}
+	free(text);
+	return 0;
+}
+
+static int bench_store_baseline (const char * path)
+{
+	FILE * f = fopen(path, "w");
+	if (NULL == f)
+	{
+		return -1;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"partition_size\": %"PRIu32",\n", m_size);
+	fprintf(f, "\t\"erase_size\": %"PRIu32",\n", m_erase_size);
+	fprintf(f, "\t\"metrics\": {\n");
+	for (int i = 0; i < BENCH_METRIC_COUNT; i++)
+	{
+		const bench_metric_t * m = &m_metrics[i];
+		const char * sep = (i + 1 < BENCH_METRIC_COUNT) ? "," : "";
+		if (m->measured)
+		{
+			fprintf(f, "\t\t\"%s\": { \"baseline\": %.2f, \"tolerance_pct\": %g }%s\n", m->name, m->value, m->tolerance_pct, sep);
+		}
+		else
+		{
+			fprintf(f, "\t\t\"%s\": { \"baseline\": null, \"tolerance_pct\": %g }%s\n", m->name, m->tolerance_pct, sep);
+		}
+	}
+	fprintf(f, "\t}\n}\n");
+	return (0 == fclose(f)) ? 0 : -1;
+}
+
+// Print the comparison, returns the number of regressions and the number of
+// measured metrics that have no baseline to be checked against
+static uint32_t bench_report (uint32_t * p_missing)
+{
+	uint32_t regressions = 0;
+	*p_missing = 0;
+	printf("%-20s %12s %12s %8s %6s  %s\n", "metric", "value", "baseline", "change%", "tol%", "result");
+	for (int i = 0; i < BENCH_METRIC_COUNT; i++)
+	{
+		const bench_metric_t * m = &m_metrics[i];
+		if (!m->measured)
+		{
+			printf("%-20s %12s\n", m->name, "-");
+			continue;
+		}
+		if (!m->has_baseline)
+		{
+			printf("%-20s %12.2f %12s %8s %6s  %s\n", m->name, m->value, "-", "", "", "NO BASELINE");
+			(*p_missing)++;
+			continue;
+		}
+		// Positive change is a regression
+		double change = (0 != m->baseline) ? 100.0 * (m->value - m->baseline) / fabs(m->baseline)
+		                                   : ((m->value != 0) ? 100.0 : 0);
+		if (m->higher_is_better)
+		{
+			change = -change;
+		}
+		bool regressed = change > m->tolerance_pct;
+		printf("%-20s %12.2f %12.2f %+8.1f %6g  %s\n", m->name, m->value, m->baseline, change, m->tolerance_pct,
+		       regressed ? "REGRESSED" : ((change < -m->tolerance_pct) ? "improved" : "ok"));
+		if (regressed)
+		{
+			regressions++;
+		}
+	}
+	return regressions;
+}
+
+static void bench_thread (void * arg)
+{
+	for (uint32_t i = 0; i < sizeof(m_data); i++)
+	{
+		m_data[i] = (uint8_t)(i * 11);
+	}
+	fs_init(0, BENCH_PARTITION, ramflash_driver());
+	fs_start();
+
+	bench_sequential();
+	bench_fill();
+	bench_churn();
+
+	if (m_ram >= 0)
+	{
+		bench_set(BENCH_RAM, (double)m_ram);
+	}
+	bench_set(BENCH_APP_STACK, osThreadGetStackSize(m_app_thread) - osThreadGetStackSpace(m_app_thread));
+	uint32_t fs_free = fs_thread_stack_free();
+	if (0 != fs_free)
+	{
+		bench_set(BENCH_FS_STACK, OS_HOST_STACK_SIZE - fs_free);
+	}
+
+	uint32_t missing;
+	uint32_t regressions = bench_report(&missing);
+	if (0 != m_failures)
+	{
+		printf("%"PRIu32" filesystem operations failed\n", m_failures);
+	}
+	if (m_update)
+	{
+		if ((0 != m_failures) || (0 != bench_store_baseline(m_baseline_path)))
+		{
+			printf("baseline %s not updated\n", m_baseline_path);
+			fflush(stdout);
+			_exit(1);
+		}
+		printf("baseline %s updated\n", m_baseline_path);
+		fflush(stdout);
+		_exit(0);
+	}
+	// A gate without a baseline can not fail, record one with -u first
+	bool pass = (0 == regressions) && (0 == missing) && (0 == m_failures);
+	printf("%s: %"PRIu32" regressions, %"PRIu32" metrics without baseline\n", pass ? "PASS" : "FAIL", regressions, missing);
+	fflush(stdout);
+	_exit(pass ? 0 : 1);
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-m fs_ram_bytes] [-u] baseline.json\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	bool size_given = false;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:m:uh")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+				size_given = true;
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+				size_given = true;
+			break;
+			case 'm':
+				m_ram = strtoll(optarg, NULL, 0);
+			break;
+			case 'u':
+				m_update = true;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind + 1 != argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	m_baseline_path = argv[optind];
+	if (0 != bench_load_baseline(m_baseline_path))
+	{
+		if (!m_update)
+		{
+			perror(m_baseline_path);
+			return 1;
+		}
+	}
+	else if ((0 != m_baseline_size) && (0 != m_baseline_erase_size))
+	{
+		if (!size_given)
+		{
+			m_size = m_baseline_size;
+			m_erase_size = m_baseline_erase_size;
+		}
+		else if (((m_size != m_baseline_size) || (m_erase_size != m_baseline_erase_size)) && !m_update)
+		{
+			fprintf(stderr, "baseline was recorded with partition %"PRIu32" erase %"PRIu32"\n",
+			        m_baseline_size, m_baseline_erase_size);
+			return 1;
+		}
+	}
+
+	if (0 != ramflash_create(BENCH_PARTITION, m_size, m_erase_size))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return 1;
+	}
+	printf("partition %"PRIu32" erase %"PRIu32", baseline %s\n", m_size, m_erase_size, m_baseline_path);
+	fflush(stdout);
+
+	osKernelInitialize();
+	const osThreadAttr_t attr = { .name = "bench" };
+	m_app_thread = osThreadNew(bench_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
@@ -0,0 +1,226 @@
+/**
+ * Trace capture check.
+ *
+ * Builds fs.c with FS_TRACE and makes a known sequence of API calls on the
+ * RAM-backed flash: direct calls before the kernel is started, where there
+ * is no current thread, direct calls and record requests from a thread, and
+ * record writes that are written out by fs_emergency_flush. The entries read
+ * with fs_trace_read must be exactly the calls made, in order, each record
+ * request once and none of the calls that fs.c makes on its own.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "fs_trace.h"
+#include "ramflash.h"
+
+#define CAPTURE_MAX_ENTRIES 64
+#define CAPTURE_FLUSH_COUNT 6
+#define CAPTURE_WAIT_MS     5000
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+
+static fs_trace_entry_t m_expected[CAPTURE_MAX_ENTRIES];
+static uint32_t m_expected_count;
+static uint32_t m_failures;
+
+static volatile uint32_t m_callbacks;
+static uint8_t m_data[64];
+static uint8_t m_data_rd[64];
+
+static void capture_expect (uint8_t op, uint8_t arg, uint16_t id, int32_t value)
+{
+	if (m_expected_count < CAPTURE_MAX_ENTRIES)
+	{
+		fs_trace_entry_t * e = &m_expected[m_expected_count];
+		e->op = op; // File system 0
+		e->arg = arg;
+		e->id = id;
+		e->value = value;
+	}
+	m_expected_count++;
+}
+
+static void capture_check (const char * what, int32_t ret)
+{
+	if (ret < 0)
+	{
+		printf("%s: %"PRIi32"\n", what, ret);
+		m_failures++;
+	}
+}
+
+static void capture_queued (const char * what, int32_t ret)
+{
+	if (0 == ret)
+	{
+		printf("%s: not queued\n", what);
+		m_failures++;
+	}
+}
+
+static void capture_done (int32_t len, void * p_user)
+{
+	__atomic_add_fetch(&m_callbacks, 1, __ATOMIC_SEQ_CST);
+}
+
+static void capture_wait (uint32_t callbacks)
+{
+	for (uint32_t i = 0; (i < CAPTURE_WAIT_MS) && (m_callbacks < callbacks); i++)
+	{
+		osDelay(1);
+	}
+	if (m_callbacks != callbacks)
+	{
+		printf("callbacks %"PRIu32" expected %"PRIu32"\n", m_callbacks, callbacks);
+		m_failures++;
+	}
+}
+
+// Open, write and close a file, also used before the kernel is started
+static void capture_write_file (char * name)
+{
+	uint32_t flags = FS_TRUNC | FS_CREAT | FS_WRONLY;
+	fs_fd fd = fs_open(0, name, flags);
+	capture_check("open", fd);
+	capture_expect(FS_TRACE_OPEN, (uint8_t)flags, fs_trace_name_id(name), (int32_t)(fd & 0xFFFF));
+	capture_check("write", fs_write(0, fd, m_data, sizeof(m_data)));
+	capture_expect(FS_TRACE_WRITE, 0, (uint16_t)fd, sizeof(m_data));
+	fs_close(0, fd);
+	capture_expect(FS_TRACE_CLOSE, 0, (uint16_t)fd, 0);
+}
+
+static void capture_compare ()
+{
+	fs_trace_entry_t entries[CAPTURE_MAX_ENTRIES + 1];
+	uint32_t count = fs_trace_read(entries, CAPTURE_MAX_ENTRIES + 1);
+	if (count != m_expected_count)
+	{
+		printf("captured %"PRIu32" calls, made %"PRIu32"\n", count, m_expected_count);
+		m_failures++;
+	}
+	for (uint32_t i = 0; (i < count) && (i < m_expected_count); i++)
+	{
+		fs_trace_entry_t * e = &entries[i];
+		fs_trace_entry_t * x = &m_expected[i];
+		if ((e->op != x->op) || (e->arg != x->arg) || (e->id != x->id) || (e->value != x->value))
+		{
+			printf("entry %"PRIu32": op %u arg %u id %04X value %"PRIi32", expected op %u arg %u id %04X value %"PRIi32"\n",
+			       i, (unsigned int)e->op, (unsigned int)e->arg, (unsigned int)e->id, e->value,
+			       (unsigned int)x->op, (unsigned int)x->arg, (unsigned int)x->id, x->value);
+			m_failures++;
+		}
+	}
+	if (0 != fs_trace_dropped())
+	{
+		printf("dropped %"PRIu32"\n", fs_trace_dropped());
+		m_failures++;
+	}
+}
+
+static void app_thread (void * arg)
+{
+	char name[] = "direct";
+	char rec[] = "rec";
+	char flush_names[CAPTURE_FLUSH_COUNT][8];
+	uint32_t callbacks = 0;
+
+	// Direct calls on a descriptor
+	uint32_t flags = FS_CREAT | FS_RDWR;
+	fs_fd fd = fs_open(0, name, flags);
+	capture_check("open", fd);
+	capture_expect(FS_TRACE_OPEN, (uint8_t)flags, fs_trace_name_id(name), (int32_t)(fd & 0xFFFF));
+	capture_check("write", fs_write(0, fd, m_data, sizeof(m_data)));
+	capture_expect(FS_TRACE_WRITE, 0, (uint16_t)fd, sizeof(m_data));
+	capture_check("lseek", fs_lseek(0, fd, 8, FS_SEEK_SET));
+	capture_expect(FS_TRACE_LSEEK, FS_SEEK_SET, (uint16_t)fd, 8);
+	fs_stat st;
+	capture_check("fstat", fs_fstat(0, fd, &st));
+	capture_expect(FS_TRACE_FSTAT, 0, (uint16_t)fd, 0);
+	fs_flush(0, fd);
+	capture_expect(FS_TRACE_FLUSH, 0, (uint16_t)fd, 0);
+	capture_check("read", fs_read(0, fd, m_data_rd, 16));
+	capture_expect(FS_TRACE_READ, 0, (uint16_t)fd, 16);
+	fs_close(0, fd);
+	capture_expect(FS_TRACE_CLOSE, 0, (uint16_t)fd, 0);
+	fs_unlink(0, name);
+	capture_expect(FS_TRACE_UNLINK, 0, fs_trace_name_id(name), 0);
+
+	// Record requests, the fs thread calls are not captured
+	capture_queued("write_record", fs_write_record(0, rec, m_data, sizeof(m_data), 0, capture_done, NULL));
+	capture_expect(FS_TRACE_WRITE_RECORD, 0, fs_trace_name_id(rec), sizeof(m_data));
+	capture_wait(++callbacks);
+	capture_queued("read_record", fs_read_record(0, rec, m_data_rd, sizeof(m_data_rd), 0, capture_done, NULL));
+	capture_expect(FS_TRACE_READ_RECORD, 0, fs_trace_name_id(rec), sizeof(m_data_rd));
+	capture_wait(++callbacks);
+
+	// Records written out by an emergency flush in this thread, neither the
+	// flush nor the fs thread calls are captured
+	for (uint32_t i = 0; i < CAPTURE_FLUSH_COUNT; i++)
+	{
+		snprintf(flush_names[i], sizeof(flush_names[i]), "fl%u", (unsigned int)(i % 3));
+		capture_queued("write_record", fs_write_record(0, flush_names[i], m_data, 8 + i, 0, capture_done, NULL));
+		capture_expect(FS_TRACE_WRITE_RECORD, 0, fs_trace_name_id(flush_names[i]), 8 + i);
+	}
+	capture_check("flush", fs_emergency_flush());
+	callbacks += CAPTURE_FLUSH_COUNT;
+	capture_wait(callbacks);
+
+	capture_compare();
+	printf("calls %"PRIu32" failures %"PRIu32"\n", m_expected_count, m_failures);
+	fflush(stdout);
+	_exit((0 == m_failures) ? 0 : 1);
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (0 != ramflash_create(0, m_size, m_erase_size))
+	{
+		fprintf(stderr, "ramflash_create failed\n");
+		return 1;
+	}
+	memset(m_data, 0x5A, sizeof(m_data));
+
+	osKernelInitialize();
+	fs_init(0, 0, ramflash_driver());
+	fs_start();
+
+	// Before the kernel runs there is no current thread, calls are captured
+	capture_write_file("early");
+
+	const osThreadAttr_t attr = { .name = "app" };
+	osThreadNew(app_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
@@ -0,0 +1,444 @@
+/**
+ * Generate an incremental content update between two versions of the
+ * filesystem contents.
+ *
+ * Compares the old and new directory trees, like given to fs_mkfs, and writes
+ * a patch for fs_patch.c with the new files, the changed ranges of existing
+ * files and the deleted files. A changed file is rewritten completely when it
+ * shrinks, or when the changed ranges would not be smaller than the file.
+ *
+ * With -s the patch is also applied to a partition built from the old tree on
+ * the host, through fs.c and fs_patch.c, and the result compared to the new
+ * tree.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "fs_image.h"
+#include "fs_patch.h"
+#include "ramflash.h"
+
+#define DELTA_PARTITION   0
+#define DELTA_MAX_FILES   1024
+#define DELTA_FEED_CHUNK  61 // Odd sized chunks to exercise the parser when verifying
+
+typedef struct delta_file
+{
+	char      name[SPIFFS_OBJ_NAME_LEN];
+	uint8_t * data;
+	uint32_t  size;
+} delta_file_t;
+
+typedef struct delta_tree
+{
+	delta_file_t files[DELTA_MAX_FILES];
+	uint32_t     count;
+} delta_tree_t;
+
+typedef struct delta_patch
+{
+	uint8_t * data;
+	uint32_t  size;
+	uint32_t  capacity;
+	uint32_t  added;
+	uint32_t  changed;
+	uint32_t  deleted;
+} delta_patch_t;
+
+static delta_tree_t m_old;
+static delta_tree_t m_new;
+static delta_patch_t m_patch;
+
+static const char * m_old_dir;
+static uint32_t m_size;
+static uint32_t m_erase_size = 4096;
+
+static int delta_load_file (delta_tree_t * tree, const char * path, const char * name, uint32_t size)
+{
+	if (strlen(name) >= SPIFFS_OBJ_NAME_LEN)
+	{
+		fprintf(stderr, "%s: name too long, max %d characters\n", name, SPIFFS_OBJ_NAME_LEN - 1);
+		return -1;
+	}
+	if (tree->count >= DELTA_MAX_FILES)
+	{
+		fprintf(stderr, "too many files, max %d\n", DELTA_MAX_FILES);
+		return -1;
+	}
+
+	delta_file_t * file = &tree->files[tree->count];
+	FILE * f = fopen(path, "rb");
+	if (NULL == f)
+	{
+		perror(path);
+		return -1;
+	}
+	file->data = malloc(size + 1);
+	file->size = size;
+	strcpy(file->name, name);
+	int ret = ((0 == size) || (1 == fread(file->data, size, 1, f))) ? 0 : -1;
+	fclose(f);
+	if (0 != ret)
+	{
+		perror(path);
+		return -1;
+	}
+	tree->count++;
+	return 0;
+}
+
+static int delta_load_dir (delta_tree_t * tree, const char * dir, const char * prefix)
+{
+	char path[1024];
+	char name[SPIFFS_OBJ_NAME_LEN * 2];
+
+	DIR * d = opendir(dir);
+	if (NULL == d)
+	{
+		perror(dir);
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent * e;
+	while ((0 == ret) && (NULL != (e = readdir(d))))
+	{
+		struct stat st;
+		if ((0 == strcmp(e->d_name, ".")) || (0 == strcmp(e->d_name, "..")))
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		snprintf(name, sizeof(name), "%s%s", prefix, e->d_name);
+		if (0 != stat(path, &st))
+		{
+			perror(path);
+			ret = -1;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			char sub_prefix[sizeof(name) + 1];
+			snprintf(sub_prefix, sizeof(sub_prefix), "%s/", name);
+			ret = delta_load_dir(tree, path, sub_prefix);
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			ret = delta_load_file(tree, path, name, (uint32_t)st.st_size);
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+static const delta_file_t * delta_find (const delta_tree_t * tree, const char * name)
+{
+	for (uint32_t i = 0; i < tree->count; i++)
+	{
+		if (0 == strcmp(tree->files[i].name, name))
+		{
+			return &tree->files[i];
+		}
+	}
+	return NULL;
+}
+
+static void delta_put (const void * data, uint32_t len)
+{
+	if (m_patch.size + len > m_patch.capacity)
+	{
+		m_patch.capacity = 2 * (m_patch.size + len);
+		m_patch.data = realloc(m_patch.data, m_patch.capacity);
+	}
+	memcpy(&m_patch.data[m_patch.size], data, len);
+	m_patch.size += len;
+}
+
+static void delta_put_u8 (uint8_t v)
+{
+	delta_put(&v, 1);
+}
+
+static void delta_put_u32 (uint32_t v)
+{
+	uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+	delta_put(b, sizeof(b));
+}
+
+static void delta_put_op (uint8_t op, const char * name)
+{
+	delta_put_u8(op);
+	delta_put_u8((uint8_t)strlen(name));
+	delta_put(name, (uint32_t)strlen(name));
+}
+
+static void delta_put_add (const delta_file_t * file)
+{
+	delta_put_op(FS_PATCH_OP_ADD, file->name);
+	delta_put_u32(file->size);
+	delta_put(file->data, file->size);
+}
+
+static void delta_put_write (const char * name, const uint8_t * data, uint32_t offset, uint32_t len)
+{
+	delta_put_op(FS_PATCH_OP_WRITE, name);
+	delta_put_u32(offset);
+	delta_put_u32(len);
+	delta_put(&data[offset], len);
+}
+
+// Ranges of a file that differ, ranges closer than the cost of an operation
+// header are merged. Returns the size of the write operations.
+static uint32_t delta_ranges (const delta_file_t * old, const delta_file_t * new, bool emit)
+{
+	uint32_t overhead = 2 + (uint32_t)strlen(new->name) + 8;
+	uint32_t cost = 0;
+	uint32_t i = 0;
+
+	while (i < old->size)
+	{
+		if (old->data[i] == new->data[i])
+		{
+			i++;
+			continue;
+		}
+		uint32_t start = i;
+		uint32_t end = i + 1;
+		uint32_t same = 0;
+		for (i = end; (i < old->size) && (same <= overhead); i++)
+		{
+			if (old->data[i] == new->data[i])
+			{
+				same++;
+			}
+			else
+			{
+				same = 0;
+				end = i + 1;
+			}
+		}
+		i = end;
+		cost += overhead + (end - start);
+		if (emit)
+		{
+			delta_put_write(new->name, new->data, start, end - start);
+		}
+	}
+	// Appended data
+	if (new->size > old->size)
+	{
+		cost += overhead + (new->size - old->size);
+		if (emit)
+		{
+			delta_put_write(new->name, new->data, old->size, new->size - old->size);
+		}
+	}
+	return cost;
+}
+
+static void delta_generate (void)
+{
+	delta_put(FS_PATCH_MAGIC, 4);
+
+	// Deletes first to make room for the new data
+	for (uint32_t i = 0; i < m_old.count; i++)
+	{
+		if (NULL == delta_find(&m_new, m_old.files[i].name))
+		{
+			delta_put_op(FS_PATCH_OP_DELETE, m_old.files[i].name);
+			m_patch.deleted++;
+		}
+	}
+
+	for (uint32_t i = 0; i < m_new.count; i++)
+	{
+		const delta_file_t * new = &m_new.files[i];
+		const delta_file_t * old = delta_find(&m_old, new->name);
+		if (NULL == old)
+		{
+			delta_put_add(new);
+			m_patch.added++;
+		}
+		else if ((old->size == new->size) && (0 == memcmp(old->data, new->data, new->size)))
+		{
+			continue;
+		}
+		else if ((new->size < old->size) || (delta_ranges(old, new, false) >= 2 + strlen(new->name) + 4 + new->size))
+		{
+			delta_put_add(new);
+			m_patch.changed++;
+		}
+		else
+		{
+			delta_ranges(old, new, true);
+			m_patch.changed++;
+		}
+	}
+
+	delta_put_u8(FS_PATCH_OP_END);
+	delta_put_u32(fs_patch_crc32(0, m_patch.data, m_patch.size));
+}
+
+static int delta_verify_files (void)
+{
+	int ret = 0;
+	for (uint32_t i = 0; i < m_old.count; i++)
+	{
+		if (NULL == delta_find(&m_new, m_old.files[i].name))
+		{
+			fs_fd fd = fs_open(0, m_old.files[i].name, FS_RDONLY);
+			if (fd >= 0)
+			{
+				fprintf(stderr, "%s: not deleted\n", m_old.files[i].name);
+				fs_close(0, fd);
+				ret = -1;
+			}
+		}
+	}
+	for (uint32_t i = 0; i < m_new.count; i++)
+	{
+		const delta_file_t * file = &m_new.files[i];
+		uint8_t * buf = malloc(file->size + 1);
+		fs_fd fd = fs_open(0, (char *)file->name, FS_RDONLY);
+		int32_t len = (fd >= 0) ? fs_read(0, fd, buf, (int32_t)file->size + 1) : fd;
+		if (fd >= 0)
+		{
+			fs_close(0, fd);
+		}
+		if ((0 == file->size) && (len < 0) && (fd >= 0))
+		{
+			len = 0; // Reading an empty file ends with end of object
+		}
+		if ((len != (int32_t)file->size) || (0 != memcmp(buf, file->data, file->size)))
+		{
+			fprintf(stderr, "%s: content differs %"PRIi32"/%"PRIu32"\n", file->name, len, file->size);
+			ret = -1;
+		}
+		free(buf);
+	}
+	return ret;
+}
+
+static void delta_verify_thread (void * arg)
+{
+	fs_patch_t patch;
+
+	fs_init(0, DELTA_PARTITION, ramflash_driver());
+	fs_start();
+
+	fs_patch_init(&patch, 0);
+	for (uint32_t offset = 0; offset < m_patch.size; offset += DELTA_FEED_CHUNK)
+	{
+		uint32_t len = m_patch.size - offset;
+		fs_patch_feed(&patch, &m_patch.data[offset], (len < DELTA_FEED_CHUNK) ? len : DELTA_FEED_CHUNK);
+	}
+	int32_t ret = fs_patch_finish(&patch);
+	if (0 != ret)
+	{
+		fprintf(stderr, "patch failed %"PRIi32"\n", ret);
+	}
+	else if (0 == delta_verify_files())
+	{
+		printf("verified on a %"PRIu32" byte partition\n", m_size);
+	}
+	else
+	{
+		ret = -1;
+	}
+	fflush(stdout);
+	_exit((0 == ret) ? 0 : 1);
+}
+
+static int delta_verify (void)
+{
+	if (!fs_image_geometry_valid(m_size, m_erase_size))
+	{
+		return -1;
+	}
+	if (0 != ramflash_create(DELTA_PARTITION, m_size, m_erase_size))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return -1;
+	}
+	spiffs * fs = fs_image_mount(DELTA_PARTITION, true);
+	if ((NULL == fs) || (fs_image_add_dir(fs, m_old_dir, false) < 0))
+	{
+		fprintf(stderr, "cannot build the old image\n");
+		return -1;
+	}
+	fs_image_unmount();
+
+	osKernelInitialize();
+	const osThreadAttr_t attr = { .name = "verify" };
+	osThreadNew(delta_verify_thread, NULL, &attr);
+	osKernelStart();
+	return -1;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size [-e erase_size]] -o patch.bin old_dir new_dir\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	const char * output = NULL;
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "s:e:o:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'o':
+				output = optarg;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((NULL == output) || (optind + 2 != argc))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	m_old_dir = argv[optind];
+	if ((0 != delta_load_dir(&m_old, argv[optind], "")) || (0 != delta_load_dir(&m_new, argv[optind + 1], "")))
+	{
+		return 1;
+	}
+
+	delta_generate();
+
+	FILE * f = fopen(output, "wb");
+	if ((NULL == f) || (1 != fwrite(m_patch.data, m_patch.size, 1, f)) || (0 != fclose(f)))
+	{
+		perror(output);
+		return 1;
+	}
+	printf("%"PRIu32" added, %"PRIu32" changed, %"PRIu32" deleted, patch %"PRIu32" bytes\n",
+	       m_patch.added, m_patch.changed, m_patch.deleted, m_patch.size);
+	fflush(stdout);
+
+	if (0 != m_size)
+	{
+		return (0 == delta_verify()) ? 0 : 1;
+	}
+	return 0;
+}
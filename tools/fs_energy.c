@@ -0,0 +1,335 @@
+/**
+ * Flash energy model for a record workload.
+ *
+ * Runs record writes on the RAM-backed flash on a half full partition and
+ * converts the flash operations of every write, including the garbage
+ * collection it triggers, to energy with the currents of a flash part. The
+ * time between writes is spent awake in standby until fs.c suspends the
+ * flash (FS_MANAGE_FLASH_SLEEP), then in deep power-down. The suspend delay
+ * is measured from the build, without FS_MANAGE_FLASH_SLEEP the flash never
+ * leaves standby.
+ *
+ * Reports the energy per record write and per day for the given write rate,
+ * with the share of each flash state, so the configuration and the part can
+ * be chosen by numbers instead of guesswork.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define ENERGY_PARTITION    0
+#define ENERGY_STATIC_SIZE  1024
+#define ENERGY_STATIC_FILL  50 // Percent of the partition
+#define ENERGY_MAX_FILES    64
+#define ENERGY_MAX_RECORD   4096
+#define ENERGY_SUSPEND_WAIT 2000 // Longest suspend delay measured, ms
+
+// Currents of a flash part, typical datasheet values
+typedef struct energy_part
+{
+	const char * name;
+	double       volts;
+	double       read_ma;      // Also used for command overhead
+	double       program_ma;
+	double       erase_ma;
+	double       standby_ua;   // Awake, not busy
+	double       powerdown_ua; // Suspended
+	double       resume_us;    // Wakeup from power-down, spent at standby current
+} energy_part_t;
+
+static const energy_part_t m_parts[] = {
+	{ "mx25r6435f", 1.8, 3.0,  3.1,  3.1,  5.0,  0.007, 35.0 },
+	{ "w25q32jv",   3.3, 5.0,  20.0, 20.0, 10.0, 1.0,   3.0 },
+	{ "at25sf081",  3.3, 6.0,  12.0, 12.0, 25.0, 2.0,   3.0 },
+	{ "gd25q16",    3.3, 7.0,  15.0, 15.0, 14.0, 1.0,   20.0 },
+};
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_record_len = 64;
+static uint32_t m_file_count = 4;
+static uint32_t m_per_day = 1440;
+static uint32_t m_samples = 5000;
+static energy_part_t m_part;
+
+static osThreadId_t m_app_thread;
+static volatile int32_t m_written_len;
+static uint8_t m_data[ENERGY_MAX_RECORD];
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	m_written_len = len;
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static bool energy_write_record (uint32_t file)
+{
+	static char names[ENERGY_MAX_FILES][8];
+	snprintf(names[file], sizeof(names[file]), "e%02u", (unsigned int)file);
+	if (0 == fs_write_record(0, names[file], m_data, (int32_t)m_record_len, 1, record_done_cb, m_app_thread))
+	{
+		return false;
+	}
+	osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+	return m_written_len == (int32_t)m_record_len;
+}
+
+// Energy of the flash operations in the counters, uJ
+static double energy_active_uj (const ramflash_stats_t * s, const ramflash_timing_t * t)
+{
+	double read_us = (s->reads * (double)t->op_ns + s->read_bytes * (double)t->read_ns) / 1000.0;
+	double program_us = (s->programs * (double)t->op_ns + s->program_bytes * (double)t->program_ns) / 1000.0;
+	double erase_us = s->erases * ((double)t->op_ns / 1000.0 + t->erase_us);
+	// mA * us = nC, * V = nJ
+	return m_part.volts * (read_us * m_part.read_ma + program_us * m_part.program_ma + erase_us * m_part.erase_ma) / 1000.0;
+}
+
+static int energy_compare (const void * a, const void * b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Time from the last flash access to the suspend, 0 if the build never suspends
+static uint32_t energy_suspend_delay_ms (void)
+{
+	ramflash_stats_t before, now;
+	ramflash_get_stats(ENERGY_PARTITION, &before);
+	energy_write_record(0);
+	for (uint32_t ms = 0; ms < ENERGY_SUSPEND_WAIT; ms += 5)
+	{
+		osDelay(5);
+		ramflash_get_stats(ENERGY_PARTITION, &now);
+		if (now.suspends != before.suspends)
+		{
+			return ms + 5;
+		}
+	}
+	return 0;
+}
+
+static void energy_fill (void)
+{
+	char name[8];
+	uint32_t total = 0, used = 0;
+	for (uint32_t i = 0; (0 == fs_info(0, &total, &used)) && (used < (uint64_t)total * ENERGY_STATIC_FILL / 100); i++)
+	{
+		snprintf(name, sizeof(name), "s%03u", (unsigned int)i);
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd < 0)
+		{
+			break;
+		}
+		fs_write(0, fd, m_data, ENERGY_STATIC_SIZE);
+		fs_close(0, fd);
+	}
+}
+
+static void energy_thread (void * arg)
+{
+	ramflash_timing_t timing;
+	ramflash_stats_t before, after, total;
+	double * active = malloc(m_samples * sizeof(double));
+	double active_sum = 0, busy_us = 0;
+	uint32_t failures = 0;
+
+	ramflash_get_timing(&timing);
+	for (uint32_t i = 0; i < sizeof(m_data); i++)
+	{
+		m_data[i] = (uint8_t)(i * 5);
+	}
+	fs_init(0, ENERGY_PARTITION, ramflash_driver());
+	fs_start();
+	energy_fill();
+	uint32_t suspend_ms = energy_suspend_delay_ms();
+
+	// Write the partition over once before sampling, so GC is in steady state
+	for (uint32_t i = 0; i < m_size / m_record_len; i++)
+	{
+		m_data[0] = (uint8_t)i;
+		energy_write_record(i % m_file_count);
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (uint32_t i = 0; i < m_samples; i++)
+	{
+		m_data[0] = (uint8_t)i;
+		ramflash_get_stats(ENERGY_PARTITION, &before);
+		if (!energy_write_record(i % m_file_count))
+		{
+			failures++;
+		}
+		ramflash_get_stats(ENERGY_PARTITION, &after);
+		ramflash_stats_diff(&after, &before, &after);
+		active[i] = energy_active_uj(&after, &timing);
+		active_sum += active[i];
+		busy_us += ramflash_stats_time_us(&after);
+		total.reads += after.reads;
+		total.programs += after.programs;
+		total.erases += after.erases;
+	}
+	qsort(active, m_samples, sizeof(double), energy_compare);
+
+	// Idle time between two writes, awake until suspended, then powered down
+	double interval_us = 86400e6 / m_per_day;
+	double busy_avg_us = busy_us / m_samples;
+	double idle_us = (interval_us > busy_avg_us) ? interval_us - busy_avg_us : 0;
+	double awake_us = idle_us;
+	double down_us = 0;
+	double resume_us = 0;
+	if ((0 != suspend_ms) && (idle_us > suspend_ms * 1000.0))
+	{
+		awake_us = suspend_ms * 1000.0;
+		down_us = idle_us - awake_us;
+		resume_us = m_part.resume_us;
+	}
+	// uA * us = pC, * V = pJ
+	double standby_uj = m_part.volts * (awake_us + resume_us) * m_part.standby_ua / 1e6;
+	double down_uj = m_part.volts * down_us * m_part.powerdown_ua / 1e6;
+	double active_uj = active_sum / m_samples;
+	double write_uj = active_uj + standby_uj + down_uj;
+
+	printf("part %s: %.1f V, read %.1f mA, program %.1f mA, erase %.1f mA, standby %.3f uA, power-down %.3f uA\n",
+	       m_part.name, m_part.volts, m_part.read_ma, m_part.program_ma, m_part.erase_ma,
+	       m_part.standby_ua, m_part.powerdown_ua);
+	if (0 != suspend_ms)
+	{
+		printf("flash suspended %"PRIu32" ms after the last access\n", suspend_ms);
+	}
+	else
+	{
+		printf("flash is never suspended, build with FS_MANAGE_FLASH_SLEEP to use power-down\n");
+	}
+	printf("%"PRIu32" record writes of %"PRIu32" bytes to %"PRIu32" files, %"PRIu32" failed: "
+	       "%.2f reads, %.2f programs, %.3f erases per write\n",
+	       m_samples, m_record_len, m_file_count, failures,
+	       (double)total.reads / m_samples, (double)total.programs / m_samples, (double)total.erases / m_samples);
+	printf("active energy per record write: avg %.2f uJ, p50 %.2f uJ, p99 %.2f uJ, max %.2f uJ, busy %.0f us\n",
+	       active_uj, active[m_samples / 2], active[(uint32_t)(0.99 * (m_samples - 1) + 0.5)], active[m_samples - 1],
+	       busy_avg_us);
+	printf("energy per record write with idle time at %"PRIu32" writes per day: %.2f uJ\n", m_per_day, write_uj);
+	printf("%-12s %12s %10s %8s\n", "state", "uJ/day", "time%", "energy%");
+	printf("%-12s %12.1f %10.4f %8.2f\n", "active", active_uj * m_per_day,
+	       100.0 * busy_avg_us / interval_us, 100.0 * active_uj / write_uj);
+	printf("%-12s %12.1f %10.4f %8.2f\n", "standby", standby_uj * m_per_day,
+	       100.0 * (awake_us + resume_us) / interval_us, 100.0 * standby_uj / write_uj);
+	printf("%-12s %12.1f %10.4f %8.2f\n", "power-down", down_uj * m_per_day,
+	       100.0 * down_us / interval_us, 100.0 * down_uj / write_uj);
+	printf("%-12s %12.1f\n", "total", write_uj * m_per_day);
+	fflush(stdout);
+	free(active);
+	_exit((0 == failures) ? 0 : 1);
+}
+
+static int energy_custom_part (const char * spec)
+{
+	static energy_part_t custom = { .name = "custom" };
+	if (7 != sscanf(spec, "%lf,%lf,%lf,%lf,%lf,%lf,%lf", &custom.volts, &custom.read_ma, &custom.program_ma,
+	                &custom.erase_ma, &custom.standby_ua, &custom.powerdown_ua, &custom.resume_us))
+	{
+		return -1;
+	}
+	m_part = custom;
+	return 0;
+}
+
+static int energy_select_part (const char * name)
+{
+	for (unsigned int i = 0; i < sizeof(m_parts) / sizeof(m_parts[0]); i++)
+	{
+		if (0 == strcmp(m_parts[i].name, name))
+		{
+			m_part = m_parts[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-l record_len] [-f files] [-n writes_per_day]\n"
+	                "       [-w sample_writes] [-p part | -c volts,read_ma,program_ma,erase_ma,standby_ua,powerdown_ua,resume_us]\n"
+	                "parts:", name);
+	for (unsigned int i = 0; i < sizeof(m_parts) / sizeof(m_parts[0]); i++)
+	{
+		fprintf(stderr, " %s", m_parts[i].name);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	m_part = m_parts[0];
+	while (-1 != (opt = getopt(argc, argv, "s:e:l:f:n:w:p:c:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'l':
+				m_record_len = strtoul(optarg, NULL, 0);
+			break;
+			case 'f':
+				m_file_count = strtoul(optarg, NULL, 0);
+			break;
+			case 'n':
+				m_per_day = strtoul(optarg, NULL, 0);
+			break;
+			case 'w':
+				m_samples = strtoul(optarg, NULL, 0);
+			break;
+			case 'p':
+				if (0 != energy_select_part(optarg))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+			break;
+			case 'c':
+				if (0 != energy_custom_part(optarg))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((0 == m_record_len) || (m_record_len > ENERGY_MAX_RECORD) || (0 == m_file_count)
+	 || (m_file_count > ENERGY_MAX_FILES) || (0 == m_per_day) || (0 == m_samples))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (0 != ramflash_create(ENERGY_PARTITION, m_size, m_erase_size))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return 1;
+	}
+
+	osKernelInitialize();
+	const osThreadAttr_t attr = { .name = "energy" };
+	m_app_thread = osThreadNew(energy_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
@@ -0,0 +1,457 @@
+/**
+ * Error-path behaviour of the filesystem under flash faults.
+ *
+ * Runs a record write and read workload on the RAM-backed flash through the
+ * fault-injecting driver wrapper, for a range of fault rates, and restarts
+ * the filesystem from the resulting flash with faults injected during the
+ * mount. Reports how many operations failed, how many reads silently
+ * returned wrong data, the write latency, whether the workload hung or
+ * crashed, and how often a mount formatted the partition or lost files.
+ *
+ * Every run is a forked process with a timeout, so a hang is detected and the
+ * flash contents survive a crash.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "faultflash.h"
+#include "ramflash.h"
+
+#define FAULTS_PARTITION   0
+#define FAULTS_FILE_COUNT  8
+#define FAULTS_RECORD_SIZE 128
+#define FAULTS_FILL_SIZE   1024
+#define FAULTS_FILL        50 // Percent of the partition
+#define FAULTS_MAX_RATES   16
+
+#define FAULTS_HANG        -2 // Run status of a run that was killed after the timeout
+#define FAULTS_CRASH       -1
+
+// State shared with the forked runs
+typedef struct faults_shared
+{
+	faultflash_config_t config;
+	faultflash_stats_t  injected;
+	uint32_t acked[FAULTS_FILE_COUNT]; // Last acknowledged record version
+	uint32_t write_fails;
+	uint32_t read_fails;
+	uint32_t corrupt;
+	uint32_t latency_count;
+	uint32_t formatted;
+	uint32_t mount_failed;
+	uint32_t lost;
+	uint64_t mount_us;
+} faults_shared_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_ops = 2000;
+static uint32_t m_mounts = 20;
+static uint32_t m_timeout = 60;
+static uint32_t m_seed = 1;
+static const char * m_kinds = "rwefp";
+static int32_t m_fail_error = FS_ERR_TRANSIENT;
+static bool m_verify;
+
+static faults_shared_t * m_shared;
+static uint32_t * m_latencies; // Estimated device us of every record write, shared
+static osThreadId_t m_app_thread;
+static uint8_t m_record[FAULTS_RECORD_SIZE];
+static volatile int32_t m_record_len;
+
+static void faults_file_name (char * name, size_t size, uint32_t file)
+{
+	snprintf(name, size, "rec%u", (unsigned int)file);
+}
+
+// Record contents are derived from the file and the version
+static void faults_record_fill (uint8_t * record, uint32_t file, uint32_t version)
+{
+	memcpy(record, &version, sizeof(version));
+	for (uint32_t i = sizeof(version); i < FAULTS_RECORD_SIZE; i++)
+	{
+		record[i] = (uint8_t)(version * 31 + file + i);
+	}
+}
+
+// Returns the version of a record, 0 if the contents are not a valid record
+static uint32_t faults_record_version (const uint8_t * record, uint32_t file)
+{
+	uint8_t expected[FAULTS_RECORD_SIZE];
+	uint32_t version;
+	memcpy(&version, record, sizeof(version));
+	faults_record_fill(expected, file, version);
+	return (0 == memcmp(expected, record, FAULTS_RECORD_SIZE)) ? version : 0;
+}
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	m_record_len = len;
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static void faults_start_fs (void)
+{
+	fs_init(0, FAULTS_PARTITION, faultflash_driver(ramflash_driver()));
+	fs_write_verify(0, m_verify);
+	fs_start();
+}
+
+static void run_fill (void)
+{
+	char name[16];
+	uint32_t total = 0, used = 0;
+	faults_start_fs();
+	memset(m_record, 0x5A, sizeof(m_record));
+	for (uint32_t i = 0; (0 == fs_info(0, &total, &used)) && (used < (uint64_t)total * FAULTS_FILL / 100); i++)
+	{
+		snprintf(name, sizeof(name), "fill%03u", (unsigned int)i);
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd < 0)
+		{
+			break;
+		}
+		for (uint32_t j = 0; j < FAULTS_FILL_SIZE / sizeof(m_record); j++)
+		{
+			fs_write(0, fd, m_record, sizeof(m_record));
+		}
+		fs_close(0, fd);
+	}
+	for (uint32_t file = 0; file < FAULTS_FILE_COUNT; file++)
+	{
+		faults_file_name(name, sizeof(name), file);
+		faults_record_fill(m_record, file, 1);
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd >= 0)
+		{
+			fs_write(0, fd, m_record, sizeof(m_record));
+			fs_close(0, fd);
+		}
+		m_shared->acked[file] = 1;
+	}
+}
+
+static void run_workload (void)
+{
+	bool unknown[FAULTS_FILE_COUNT] = { false };
+	ramflash_stats_t before, after;
+	char name[16];
+
+	faults_start_fs();
+	faultflash_configure(&m_shared->config);
+	for (uint32_t i = 0; i < m_ops; i++)
+	{
+		uint32_t file = (i / 2) % FAULTS_FILE_COUNT;
+		faults_file_name(name, sizeof(name), file);
+		if (0 == i % 2)
+		{
+			uint32_t version = m_shared->acked[file] + 1;
+			faults_record_fill(m_record, file, version);
+			ramflash_get_stats(FAULTS_PARTITION, &before);
+			int32_t len = -1;
+			if (0 != fs_write_record(0, name, m_record, sizeof(m_record), 1, record_done_cb, m_app_thread))
+			{
+				osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+				len = m_record_len;
+			}
+			ramflash_get_stats(FAULTS_PARTITION, &after);
+			ramflash_stats_diff(&after, &before, &after);
+			m_latencies[m_shared->latency_count++] = (uint32_t)ramflash_stats_time_us(&after);
+			if (FAULTS_RECORD_SIZE == len)
+			{
+				m_shared->acked[file] = version;
+				unknown[file] = false;
+			}
+			else
+			{
+				// The record may be partly written
+				m_shared->write_fails++;
+				unknown[file] = true;
+			}
+		}
+		else
+		{
+			if (0 == fs_read_record(0, name, m_record, sizeof(m_record), 1, record_done_cb, m_app_thread))
+			{
+				m_shared->read_fails++;
+				continue;
+			}
+			osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+			if (FAULTS_RECORD_SIZE != m_record_len)
+			{
+				m_shared->read_fails++;
+			}
+			else if (!unknown[file] && (faults_record_version(m_record, file) != m_shared->acked[file]))
+			{
+				// Read succeeded, but returned something else than was written
+				m_shared->corrupt++;
+			}
+		}
+	}
+	faultflash_get_stats(&m_shared->injected);
+}
+
+static void run_mount (void)
+{
+	ramflash_stats_t stats;
+	uint32_t total, used;
+	char name[16];
+
+	// Faults are injected from the start, the mount runs in fs_start
+	faultflash_configure(&m_shared->config);
+	ramflash_reset_stats(FAULTS_PARTITION);
+	faults_start_fs();
+	ramflash_get_stats(FAULTS_PARTITION, &stats);
+	m_shared->mount_us = ramflash_stats_time_us(&stats);
+	// Formatting erases every block of the partition, mounting none
+	m_shared->formatted = (stats.erases >= m_size / m_erase_size);
+	m_shared->mount_failed = (0 != fs_info(0, &total, &used));
+
+	// Check the files without faults, only the mount is under test
+	faultflash_configure(&(faultflash_config_t){ .seed = 1 });
+	m_shared->lost = 0;
+	for (uint32_t file = 0; file < FAULTS_FILE_COUNT; file++)
+	{
+		faults_file_name(name, sizeof(name), file);
+		fs_fd fd = fs_open(0, name, FS_RDONLY);
+		bool found = false;
+		if (fd >= 0)
+		{
+			found = (FAULTS_RECORD_SIZE == fs_read(0, fd, m_record, sizeof(m_record)))
+			     && (0 != faults_record_version(m_record, file));
+			fs_close(0, fd);
+		}
+		if (!found)
+		{
+			m_shared->lost++;
+		}
+	}
+}
+
+static void app_thread (void * arg)
+{
+	((void (*)(void))arg)();
+	fflush(stdout);
+	_exit(0);
+}
+
+// Run in a forked process, returns the exit status, FAULTS_CRASH or FAULTS_HANG
+static int faults_run (void (*run)(void))
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == pid)
+	{
+		osKernelInitialize();
+		const osThreadAttr_t attr = { .name = "app" };
+		m_app_thread = osThreadNew(app_thread, (void *)run, &attr);
+		osKernelStart();
+		_exit(1);
+	}
+
+	int status;
+	for (uint32_t waited = 0; 0 == waitpid(pid, &status, WNOHANG); waited += 10)
+	{
+		if (waited >= m_timeout * 1000)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return FAULTS_HANG;
+		}
+		usleep(10000);
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : FAULTS_CRASH;
+}
+
+static int faults_compare (const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void faults_config (uint32_t ppm, uint32_t seed)
+{
+	faultflash_config_t * c = &m_shared->config;
+	memset(c, 0, sizeof(faultflash_config_t));
+	c->read_fail_ppm = (NULL != strchr(m_kinds, 'r')) ? ppm : 0;
+	c->write_fail_ppm = (NULL != strchr(m_kinds, 'w')) ? ppm : 0;
+	c->erase_fail_ppm = (NULL != strchr(m_kinds, 'e')) ? ppm : 0;
+	c->read_flip_ppm = (NULL != strchr(m_kinds, 'f')) ? ppm : 0;
+	c->write_flip_ppm = (NULL != strchr(m_kinds, 'p')) ? ppm : 0;
+	c->fail_error = m_fail_error;
+	c->seed = seed;
+}
+
+static const char * faults_status_name (int status)
+{
+	return (FAULTS_HANG == status) ? "hang" : ((0 != status) ? "crash" : "ok");
+}
+
+// Returns the number of hangs and crashes
+static uint32_t faults_rate (uint32_t ppm)
+{
+	uint8_t * flash = ramflash_data(FAULTS_PARTITION);
+	uint8_t * worked = malloc(m_size);
+	uint32_t failures = 0;
+
+	memset(flash, 0xFF, m_size);
+	memset(m_shared, 0, sizeof(faults_shared_t));
+	if (0 != faults_run(run_fill))
+	{
+		fprintf(stderr, "fill failed\n");
+		exit(1);
+	}
+
+	faults_config(ppm, m_seed);
+	int status = faults_run(run_workload);
+	const char * workload_status = faults_status_name(status);
+	if (0 != status)
+	{
+		fprintf(stderr, "rate %"PRIu32" seed %"PRIu32": workload %s\n", ppm, m_seed, faults_status_name(status));
+		failures++;
+	}
+	faults_shared_t workload = *m_shared;
+	qsort(m_latencies, workload.latency_count, sizeof(uint32_t), faults_compare);
+	memcpy(worked, flash, m_size);
+
+	uint32_t mounts = 0, formats = 0, mount_fails = 0, lost = 0;
+	uint64_t mount_us_max = 0;
+	for (uint32_t t = 0; t < m_mounts; t++)
+	{
+		memcpy(flash, worked, m_size);
+		faults_config(ppm, m_seed + 1 + t);
+		status = faults_run(run_mount);
+		if (0 != status)
+		{
+			fprintf(stderr, "rate %"PRIu32" seed %"PRIu32": mount %s\n", ppm, m_seed + 1 + t, faults_status_name(status));
+			failures++;
+			continue;
+		}
+		mounts++;
+		formats += m_shared->formatted;
+		mount_fails += m_shared->mount_failed;
+		lost += m_shared->lost;
+		if (m_shared->mount_us > mount_us_max)
+		{
+			mount_us_max = m_shared->mount_us;
+		}
+	}
+
+	uint32_t n = workload.latency_count;
+	printf("%8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8s %6"PRIu32"/%-4"PRIu32" %6"PRIu32" %6"PRIu32" %9"PRIu64"\n",
+	       ppm,
+	       workload.injected.read_fails + workload.injected.write_fails + workload.injected.erase_fails
+	       + workload.injected.read_flips + workload.injected.write_flips,
+	       workload.write_fails, workload.read_fails, workload.corrupt,
+	       (0 != n) ? m_latencies[n / 2] : 0,
+	       (0 != n) ? m_latencies[(uint32_t)(0.99 * (n - 1) + 0.5)] : 0,
+	       (0 != n) ? m_latencies[n - 1] : 0,
+	       workload_status,
+	       formats, mounts, mount_fails, lost, mount_us_max);
+	fflush(stdout);
+	free(worked);
+	return failures;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-R ppm,...] [-k kinds] [-n ops]\n"
+	                "       [-m mounts] [-t timeout_s] [-r seed] [-H] [-V]\n"
+	                "kinds: r read fail, w program fail, e erase fail, f read bit flip, p program bit flip\n"
+	                "-H: failures are hard errors instead of transient, -V: verify flash programs\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	uint32_t rates[FAULTS_MAX_RATES] = { 0, 100, 1000, 10000 };
+	uint32_t rate_count = 4;
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "s:e:R:k:n:m:t:r:HVh")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'R':
+				rate_count = 0;
+				for (char * tok = strtok(optarg, ","); (NULL != tok) && (rate_count < FAULTS_MAX_RATES); tok = strtok(NULL, ","))
+				{
+					rates[rate_count++] = strtoul(tok, NULL, 0);
+				}
+			break;
+			case 'k':
+				m_kinds = optarg;
+			break;
+			case 'n':
+				m_ops = strtoul(optarg, NULL, 0);
+			break;
+			case 'm':
+				m_mounts = strtoul(optarg, NULL, 0);
+			break;
+			case 't':
+				m_timeout = strtoul(optarg, NULL, 0);
+			break;
+			case 'r':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			case 'H':
+				m_fail_error = FS_ERR_HARD;
+			break;
+			case 'V':
+				m_verify = true;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((0 == rate_count) || (0 == m_ops) || (0 == m_timeout))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	m_shared = mmap(NULL, sizeof(faults_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	m_latencies = mmap(NULL, m_ops * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if ((MAP_FAILED == m_shared) || (MAP_FAILED == m_latencies) || (0 != ramflash_create(FAULTS_PARTITION, m_size, m_erase_size)))
+	{
+		fprintf(stderr, "cannot allocate memory\n");
+		return 1;
+	}
+
+	printf("partition %"PRIu32" erase %"PRIu32", faults %s (%s%s), %"PRIu32" ops, %"PRIu32" mounts per rate, seed %"PRIu32"\n",
+	       m_size, m_erase_size, m_kinds, (FS_ERR_HARD == m_fail_error) ? "hard" : "transient", m_verify ? ", verified" : "", m_ops, m_mounts, m_seed);
+	printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s %11s %6s %6s %9s\n",
+	       "rate_ppm", "injected", "wr_fail", "rd_fail", "corrupt", "wr_p50", "wr_p99", "wr_max", "workload",
+	       "formats", "no_fs", "lost", "mount_us");
+	fflush(stdout);
+
+	uint32_t failures = 0;
+	for (uint32_t i = 0; i < rate_count; i++)
+	{
+		failures += faults_rate(rates[i]);
+	}
+	return (0 == failures) ? 0 : 1;
+}
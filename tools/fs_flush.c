@@ -0,0 +1,234 @@
+/**
+ * Emergency flush check.
+ *
+ * Holds the fs thread in the callback of a record write, queues record
+ * writes that rewrite the same files with longer records and writes them out
+ * with fs_emergency_flush. Every request must get exactly one callback, with
+ * its own length also when it was superseded by a later write of the same
+ * record. The fs thread is then released: it wakes up for the writes queued
+ * while it was held and must find nothing left to do, so no further
+ * callbacks may come. Every file must read back as the newest record written
+ * to it, and a record write made after the flush must be handled normally.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define FLUSH_FILE_COUNT    3
+#define FLUSH_VERSION_COUNT 3
+#define FLUSH_COUNT         (FLUSH_FILE_COUNT * FLUSH_VERSION_COUNT)
+#define FLUSH_RECORD_SIZE   64
+#define FLUSH_WAIT_MS       5000
+#define FLUSH_IDLE_MS       200
+
+// Request slots, the hold and after requests follow the flushed ones
+#define FLUSH_HOLD          FLUSH_COUNT
+#define FLUSH_AFTER         (FLUSH_COUNT + 1)
+#define FLUSH_REQUESTS      (FLUSH_COUNT + 2)
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+
+static char m_names[FLUSH_REQUESTS][8];
+static uint8_t m_records[FLUSH_REQUESTS][FLUSH_RECORD_SIZE];
+static uint8_t m_record_rd[FLUSH_RECORD_SIZE];
+static int32_t m_lens[FLUSH_REQUESTS];
+
+static volatile uint32_t m_callbacks[FLUSH_REQUESTS];
+static volatile int32_t m_results[FLUSH_REQUESTS];
+static volatile bool m_held;
+static volatile bool m_release;
+static uint32_t m_failures;
+
+static void flush_record_fill (uint8_t * record, uint32_t file, uint32_t version)
+{
+	for (uint32_t i = 0; i < FLUSH_RECORD_SIZE; i++)
+	{
+		record[i] = (uint8_t)(version * 31 + file * 7 + i);
+	}
+}
+
+static void flush_done (int32_t len, void * p_user)
+{
+	uint32_t req = (uint32_t)(uintptr_t)p_user;
+	m_results[req] = len;
+	__atomic_add_fetch(&m_callbacks[req], 1, __ATOMIC_SEQ_CST);
+	if (FLUSH_HOLD == req)
+	{
+		// Keep the fs thread here until the flush has been made
+		m_held = true;
+		while (!m_release)
+		{
+			osDelay(1);
+		}
+	}
+}
+
+static bool flush_wait (volatile bool * p_flag)
+{
+	for (uint32_t i = 0; (i < FLUSH_WAIT_MS) && (!*p_flag); i++)
+	{
+		osDelay(1);
+	}
+	return *p_flag;
+}
+
+static void flush_queue (uint32_t req, uint32_t file, uint32_t version, int32_t len)
+{
+	snprintf(m_names[req], sizeof(m_names[req]), "fl%u", (unsigned int)file);
+	flush_record_fill(m_records[req], file, version);
+	m_lens[req] = len;
+	if (0 == fs_write_record(0, m_names[req], m_records[req], len, 0, flush_done, (void *)(uintptr_t)req))
+	{
+		printf("request %"PRIu32" not queued\n", req);
+		m_failures++;
+	}
+}
+
+// Every request up to count must have had one callback with its own length
+static void flush_check_callbacks (const char * when, uint32_t count)
+{
+	for (uint32_t req = 0; req < count; req++)
+	{
+		if (1 != m_callbacks[req])
+		{
+			printf("%s: request %"PRIu32" %"PRIu32" callbacks\n", when, req, m_callbacks[req]);
+			m_failures++;
+		}
+		else if (m_results[req] != m_lens[req])
+		{
+			printf("%s: request %"PRIu32" result %"PRIi32" expected %"PRIi32"\n", when, req, m_results[req], m_lens[req]);
+			m_failures++;
+		}
+	}
+}
+
+// The file must hold the newest record queued for it
+static void flush_check_file (uint32_t req)
+{
+	bool found = false;
+	fs_fd fd = fs_open(0, m_names[req], FS_RDONLY);
+	if (fd >= 0)
+	{
+		fs_stat st;
+		found = (0 == fs_fstat(0, fd, &st)) && (st.size == (uint32_t)m_lens[req])
+		     && (m_lens[req] == fs_read(0, fd, m_record_rd, m_lens[req]))
+		     && (0 == memcmp(m_records[req], m_record_rd, m_lens[req]));
+		fs_close(0, fd);
+	}
+	if (!found)
+	{
+		printf("%s does not hold request %"PRIu32"\n", m_names[req], req);
+		m_failures++;
+	}
+}
+
+static void app_thread (void * arg)
+{
+	// Hold the fs thread in a callback, so that the next writes stay queued
+	flush_queue(FLUSH_HOLD, FLUSH_FILE_COUNT, 0, 8);
+	if (!flush_wait(&m_held))
+	{
+		printf("fs thread not held\n");
+		fflush(stdout);
+		_exit(1);
+	}
+
+	// Every version of a file is longer than the one before, so the newest
+	// write of each file supersedes the others
+	for (uint32_t version = 0; version < FLUSH_VERSION_COUNT; version++)
+	{
+		for (uint32_t file = 0; file < FLUSH_FILE_COUNT; file++)
+		{
+			uint32_t req = version * FLUSH_FILE_COUNT + file;
+			flush_queue(req, file, version, 16 + version * 8 + file);
+		}
+	}
+
+	int32_t flushed = fs_emergency_flush();
+	if (FLUSH_COUNT != flushed)
+	{
+		printf("flushed %"PRIi32" expected %u\n", flushed, (unsigned int)FLUSH_COUNT);
+		m_failures++;
+	}
+	flush_check_callbacks("flush", FLUSH_COUNT);
+
+	// The fs thread wakes up for the flushed writes and must find none left
+	m_release = true;
+	osDelay(FLUSH_IDLE_MS);
+	flush_check_callbacks("resumed", FLUSH_COUNT);
+	if (1 != m_callbacks[FLUSH_HOLD])
+	{
+		printf("hold request %"PRIu32" callbacks\n", m_callbacks[FLUSH_HOLD]);
+		m_failures++;
+	}
+
+	for (uint32_t file = 0; file < FLUSH_FILE_COUNT; file++)
+	{
+		flush_check_file((FLUSH_VERSION_COUNT - 1) * FLUSH_FILE_COUNT + file);
+	}
+
+	// The queue works on as before
+	flush_queue(FLUSH_AFTER, 0, FLUSH_VERSION_COUNT, FLUSH_RECORD_SIZE);
+	for (uint32_t i = 0; (i < FLUSH_WAIT_MS) && (0 == m_callbacks[FLUSH_AFTER]); i++)
+	{
+		osDelay(1);
+	}
+	osDelay(FLUSH_IDLE_MS);
+	flush_check_callbacks("after", FLUSH_REQUESTS);
+	flush_check_file(FLUSH_AFTER);
+
+	printf("requests %u failures %"PRIu32"\n", (unsigned int)FLUSH_REQUESTS, m_failures);
+	fflush(stdout);
+	_exit((0 == m_failures) ? 0 : 1);
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (0 != ramflash_create(0, m_size, m_erase_size))
+	{
+		fprintf(stderr, "ramflash_create failed\n");
+		return 1;
+	}
+
+	osKernelInitialize();
+	fs_init(0, 0, ramflash_driver());
+	fs_start();
+
+	const osThreadAttr_t attr = { .name = "app" };
+	osThreadNew(app_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
@@ -0,0 +1,264 @@
+/**
+ * Filesystem image access for host tools.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include "fs_image.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "spiffs_nucleus.h"
+#include "ramflash.h"
+
+#define FS_IMAGE_DESCRIPTORS 4
+
+static int m_partition = -1;
+static spiffs m_fs;
+static spiffs_config m_cfg;
+static uint8_t m_work_buf[FS_SPIFFS_LOG_PAGE_SZ * 2];
+static spiffs_fd m_fds[FS_IMAGE_DESCRIPTORS];
+
+static s32_t fs_image_read (u32_t addr, u32_t size, u8_t * dst)
+{
+	if (ramflash_driver()->read(m_partition, addr, size, dst) < 0)
+	{
+		return SPIFFS_ERR_INTERNAL;
+	}
+	return SPIFFS_OK;
+}
+
+static s32_t fs_image_write (u32_t addr, u32_t size, u8_t * src)
+{
+	if (ramflash_driver()->write(m_partition, addr, size, src) < 0)
+	{
+		return SPIFFS_ERR_INTERNAL;
+	}
+	return SPIFFS_OK;
+}
+
+static s32_t fs_image_erase (u32_t addr, u32_t size)
+{
+	if (ramflash_driver()->erase(m_partition, addr, size) < 0)
+	{
+		return SPIFFS_ERR_INTERNAL;
+	}
+	return SPIFFS_OK;
+}
+
+bool fs_image_geometry_valid (uint32_t size, uint32_t erase_size)
+{
+	if ((0 == size) || (0 == erase_size)
+	 || (0 != size % FS_SPIFFS_LOG_BLOCK_SZ) || (0 != FS_SPIFFS_LOG_BLOCK_SZ % erase_size))
+	{
+		fprintf(stderr, "size must be a multiple of the %lu byte logical block, "
+		                "which must be a multiple of the erase size\n", (unsigned long)FS_SPIFFS_LOG_BLOCK_SZ);
+		return false;
+	}
+	return true;
+}
+
+void fs_image_config (uint32_t size, uint32_t erase_size, spiffs_config * p_cfg)
+{
+	memset(p_cfg, 0, sizeof(spiffs_config));
+	p_cfg->phys_size = FS_SPIFFS_SIZE(size, erase_size);
+	p_cfg->phys_addr = 0;
+	p_cfg->phys_erase_block = erase_size;
+	p_cfg->log_block_size = FS_SPIFFS_LOG_BLOCK_SZ;
+	p_cfg->log_page_size = FS_SPIFFS_LOG_PAGE_SZ;
+}
+
+spiffs * fs_image_mount (int partition, bool format)
+{
+	fs_driver_t * driver = ramflash_driver();
+	if (driver->size(partition) < 0)
+	{
+		return NULL;
+	}
+	fs_image_unmount();
+
+	m_partition = partition;
+	fs_image_config(driver->size(partition), driver->erase_size(partition), &m_cfg);
+	m_cfg.hal_read_f = fs_image_read;
+	m_cfg.hal_write_f = fs_image_write;
+	m_cfg.hal_erase_f = fs_image_erase;
+
+	if (format)
+	{
+		// SPIFFS_format needs a configured, but unmounted filesystem
+		s32_t ret = SPIFFS_mount(&m_fs, &m_cfg, m_work_buf, (u8_t *)m_fds, sizeof(m_fds), NULL, 0, NULL);
+		if (SPIFFS_OK == ret)
+		{
+			SPIFFS_unmount(&m_fs);
+		}
+		if (SPIFFS_OK != SPIFFS_format(&m_fs))
+		{
+			m_partition = -1;
+			return NULL;
+		}
+	}
+	if (SPIFFS_OK != SPIFFS_mount(&m_fs, &m_cfg, m_work_buf, (u8_t *)m_fds, sizeof(m_fds), NULL, 0, NULL))
+	{
+		m_partition = -1;
+		return NULL;
+	}
+	return &m_fs;
+}
+
+void fs_image_unmount (void)
+{
+	if (m_partition >= 0)
+	{
+		SPIFFS_unmount(&m_fs);
+		m_partition = -1;
+	}
+}
+
+static int fs_image_add_file (spiffs * fs, const char * path, const char * name)
+{
+	uint8_t buf[1024];
+
+	if (strlen(name) >= SPIFFS_OBJ_NAME_LEN)
+	{
+		fprintf(stderr, "%s: name too long, max %d characters\n", name, SPIFFS_OBJ_NAME_LEN - 1);
+		return -1;
+	}
+
+	FILE * f = fopen(path, "rb");
+	if (NULL == f)
+	{
+		perror(path);
+		return -1;
+	}
+
+	spiffs_file fd = SPIFFS_open(fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_WRONLY, 0);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: open %d\n", name, (int)fd);
+		fclose(f);
+		return -1;
+	}
+
+	int ret = 0;
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		s32_t wr = SPIFFS_write(fs, fd, buf, (s32_t)len);
+		if (wr != (s32_t)len)
+		{
+			fprintf(stderr, "%s: write %d\n", name, (int)wr);
+			ret = -1;
+			break;
+		}
+	}
+	SPIFFS_close(fs, fd);
+	fclose(f);
+	return ret;
+}
+
+static int fs_image_add_subdir (spiffs * fs, const char * dir, const char * prefix, bool verbose)
+{
+	char path[1024];
+	char name[SPIFFS_OBJ_NAME_LEN * 2];
+
+	DIR * d = opendir(dir);
+	if (NULL == d)
+	{
+		perror(dir);
+		return -1;
+	}
+
+	int count = 0;
+	struct dirent * e;
+	while ((count >= 0) && (NULL != (e = readdir(d))))
+	{
+		struct stat st;
+		if ((0 == strcmp(e->d_name, ".")) || (0 == strcmp(e->d_name, "..")))
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		snprintf(name, sizeof(name), "%s%s", prefix, e->d_name);
+		if (0 != stat(path, &st))
+		{
+			perror(path);
+			count = -1;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			char sub_prefix[sizeof(name) + 1];
+			snprintf(sub_prefix, sizeof(sub_prefix), "%s/", name);
+			int ret = fs_image_add_subdir(fs, path, sub_prefix, verbose);
+			count = (ret < 0) ? -1 : count + ret;
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			if (0 != fs_image_add_file(fs, path, name))
+			{
+				count = -1;
+			}
+			else
+			{
+				count++;
+				if (verbose)
+				{
+					printf("%s\n", name);
+				}
+			}
+		}
+	}
+	closedir(d);
+	return count;
+}
+
+int fs_image_add_dir (spiffs * fs, const char * dir, bool verbose)
+{
+	return fs_image_add_subdir(fs, dir, "", verbose);
+}
+
+int fs_image_load (int partition, const char * path, uint32_t erase_size)
+{
+	FILE * f = fopen(path, "rb");
+	if (NULL == f)
+	{
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	int ret = -1;
+	if ((size > 0) && (0 == ramflash_create(partition, (uint32_t)size, erase_size)))
+	{
+		if (1 == fread(ramflash_data(partition), (size_t)size, 1, f))
+		{
+			ret = 0;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+int fs_image_save (int partition, const char * path)
+{
+	uint8_t * data = ramflash_data(partition);
+	int32_t size = ramflash_driver()->size(partition);
+	if ((NULL == data) || (size <= 0))
+	{
+		return -1;
+	}
+	FILE * f = fopen(path, "wb");
+	if (NULL == f)
+	{
+		return -1;
+	}
+	int ret = (1 == fwrite(data, (size_t)size, 1, f)) ? 0 : -1;
+	if (0 != fclose(f))
+	{
+		ret = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,86 @@
+/**
+ * Access to filesystem images on the RAM-backed flash with the same SPIFFS
+ * build and geometry as fs.c, for host tools that work with images directly
+ * instead of going through the fs layer.
+ *
+ * One image can be mounted at a time.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef FS_IMAGE_H_
+#define FS_IMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "spiffs.h"
+
+/**
+ * Check that the partition geometry can be used with the logical block size,
+ * prints an error if not.
+ *
+ * @param size - Partition size.
+ * @param erase_size - Erase block size.
+ *
+ * @return true if the geometry is valid.
+ */
+bool fs_image_geometry_valid (uint32_t size, uint32_t erase_size);
+
+/**
+ * Mount the image in a ramflash partition, optionally formatting it first.
+ *
+ * @param partition - ramflash partition holding the image.
+ * @param format - Format before mounting.
+ *
+ * @return Mounted filesystem, NULL on failure.
+ */
+spiffs * fs_image_mount (int partition, bool format);
+
+/**
+ * Unmount the currently mounted image.
+ */
+void fs_image_unmount (void);
+
+/**
+ * Get the SPIFFS configuration fs.c would use for a partition of this size.
+ *
+ * @param size - Partition size.
+ * @param erase_size - Erase block size.
+ * @param p_cfg - Configuration to fill, HAL functions are left NULL.
+ */
+void fs_image_config (uint32_t size, uint32_t erase_size, spiffs_config * p_cfg);
+
+/**
+ * Copy the files in a directory tree into the mounted image. Files in
+ * subdirectories are stored with their relative path as the name.
+ *
+ * @param fs - Mounted image.
+ * @param dir - Directory to copy.
+ * @param verbose - Print the name of every added file.
+ *
+ * @return Number of files added, -1 on failure.
+ */
+int fs_image_add_dir (spiffs * fs, const char * dir, bool verbose);
+
+/**
+ * Create a ramflash partition from an image file.
+ *
+ * @param partition - ramflash partition to create.
+ * @param path - Image file.
+ * @param erase_size - Erase block size.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int fs_image_load (int partition, const char * path, uint32_t erase_size);
+
+/**
+ * Write the ramflash partition contents to an image file.
+ *
+ * @param partition - ramflash partition.
+ * @param path - Image file.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int fs_image_save (int partition, const char * path);
+
+#endif//FS_IMAGE_H_
@@ -0,0 +1,285 @@
+/**
+ * Inspect a raw filesystem partition dump.
+ *
+ * Reports the files with their size, data and index page counts, the live,
+ * deleted and free pages and the erase age of every block, the erase age
+ * distribution and the garbage collection candidates with their score and
+ * cost, using the same SPIFFS build and geometry as fs.c.
+ *
+ * The dump is mounted from a RAM copy, the dump file itself is not modified.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs_image.h"
+#include "spiffs_nucleus.h"
+#include "ramflash.h"
+
+#define INSPECT_PARTITION 0
+#define INSPECT_AGE_BUCKETS 8
+#define INSPECT_GC_CANDIDATES 8
+
+typedef struct inspect_block
+{
+	uint32_t      free;
+	uint32_t      used;
+	uint32_t      deleted;
+	spiffs_obj_id erase_count;
+	spiffs_obj_id erase_age;
+	int32_t       gc_score;
+} inspect_block_t;
+
+static inspect_block_t * m_blocks;
+
+// Erase age relative to the most erased block, the same way SPIFFS gc does it
+static spiffs_obj_id inspect_erase_age (spiffs * fs, spiffs_obj_id erase_count)
+{
+	if (fs->max_erase_count > erase_count)
+	{
+		return fs->max_erase_count - erase_count;
+	}
+	return SPIFFS_OBJ_ID_FREE - (erase_count - fs->max_erase_count);
+}
+
+static const spiffs_obj_id * inspect_lookup (spiffs * fs, uint32_t bix)
+{
+	return (const spiffs_obj_id *)&ramflash_data(INSPECT_PARTITION)[SPIFFS_BLOCK_TO_PADDR(fs, bix)];
+}
+
+static void inspect_blocks (spiffs * fs)
+{
+	const uint8_t * image = ramflash_data(INSPECT_PARTITION);
+	m_blocks = calloc(fs->block_count, sizeof(inspect_block_t));
+
+	for (uint32_t bix = 0; bix < fs->block_count; bix++)
+	{
+		inspect_block_t * b = &m_blocks[bix];
+		const spiffs_obj_id * lu = inspect_lookup(fs, bix);
+		for (uint32_t e = 0; e < SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs); e++)
+		{
+			if (SPIFFS_OBJ_ID_FREE == lu[e])
+			{
+				b->free++;
+			}
+			else if (SPIFFS_OBJ_ID_DELETED == lu[e])
+			{
+				b->deleted++;
+			}
+			else
+			{
+				b->used++;
+			}
+		}
+		memcpy(&b->erase_count, &image[SPIFFS_ERASE_COUNT_PADDR(fs, bix)], sizeof(spiffs_obj_id));
+		b->erase_age = inspect_erase_age(fs, b->erase_count);
+		b->gc_score = (int32_t)b->deleted * SPIFFS_GC_HEUR_W_DELET
+		            + (int32_t)b->used * SPIFFS_GC_HEUR_W_USED
+		            + (int32_t)b->erase_age * SPIFFS_GC_HEUR_W_ERASE_AGE;
+	}
+}
+
+// Count the live data and index pages of an object
+static void inspect_object_pages (spiffs * fs, spiffs_obj_id obj_id, uint32_t * p_data, uint32_t * p_index)
+{
+	*p_data = 0;
+	*p_index = 0;
+	obj_id &= ~SPIFFS_OBJ_ID_IX_FLAG;
+	for (uint32_t bix = 0; bix < fs->block_count; bix++)
+	{
+		const spiffs_obj_id * lu = inspect_lookup(fs, bix);
+		for (uint32_t e = 0; e < SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs); e++)
+		{
+			if (lu[e] == obj_id)
+			{
+				(*p_data)++;
+			}
+			else if (lu[e] == (obj_id | SPIFFS_OBJ_ID_IX_FLAG))
+			{
+				(*p_index)++;
+			}
+		}
+	}
+}
+
+static void inspect_files (spiffs * fs)
+{
+	spiffs_DIR d;
+	struct spiffs_dirent e;
+	uint32_t count = 0;
+
+	printf("%-*s %10s %6s %6s %6s\n", SPIFFS_OBJ_NAME_LEN - 1, "file", "size", "id", "data", "index");
+	if (NULL == SPIFFS_opendir(fs, "/", &d))
+	{
+		printf("opendir failed %d\n", (int)SPIFFS_errno(fs));
+		return;
+	}
+	while (NULL != SPIFFS_readdir(&d, &e))
+	{
+		uint32_t data_pages, index_pages;
+		inspect_object_pages(fs, e.obj_id, &data_pages, &index_pages);
+		// Index depth: the object index header page plus the index pages
+		printf("%-*s %10"PRIu32" %6u %6"PRIu32" %6"PRIu32"\n",
+		       SPIFFS_OBJ_NAME_LEN - 1, (const char *)e.name, (uint32_t)e.size,
+		       (unsigned int)e.obj_id, data_pages, index_pages);
+		count++;
+	}
+	SPIFFS_closedir(&d);
+	printf("%"PRIu32" files\n\n", count);
+}
+
+static void inspect_print_blocks (spiffs * fs)
+{
+	printf("%6s %6s %6s %6s %8s %8s %8s\n", "block", "used", "del", "free", "erases", "age", "gc_score");
+	for (uint32_t bix = 0; bix < fs->block_count; bix++)
+	{
+		inspect_block_t * b = &m_blocks[bix];
+		printf("%6"PRIu32" %6"PRIu32" %6"PRIu32" %6"PRIu32" %8u %8u %8"PRIi32"\n",
+		       bix, b->used, b->deleted, b->free,
+		       (unsigned int)b->erase_count, (unsigned int)b->erase_age, b->gc_score);
+	}
+	printf("\n");
+}
+
+static void inspect_summary (spiffs * fs)
+{
+	uint32_t used = 0, deleted = 0, free_pages = 0, free_blocks = 0;
+	uint32_t max_age = 0;
+	for (uint32_t bix = 0; bix < fs->block_count; bix++)
+	{
+		used += m_blocks[bix].used;
+		deleted += m_blocks[bix].deleted;
+		free_pages += m_blocks[bix].free;
+		if (m_blocks[bix].free == SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs))
+		{
+			free_blocks++;
+		}
+		if (m_blocks[bix].erase_age > max_age)
+		{
+			max_age = m_blocks[bix].erase_age;
+		}
+	}
+
+	u32_t total, used_bytes;
+	SPIFFS_info(fs, &total, &used_bytes);
+	printf("blocks %"PRIu32", free blocks %"PRIu32", pages per block %"PRIu32"\n",
+	       (uint32_t)fs->block_count, free_blocks, (uint32_t)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs));
+	printf("pages used %"PRIu32", deleted %"PRIu32", free %"PRIu32", deleted share of non-free %u%%\n",
+	       used, deleted, free_pages, (0 == used + deleted) ? 0 : (unsigned int)(100 * deleted / (used + deleted)));
+	printf("bytes used %"PRIu32" of %"PRIu32", max erase count %u\n\n",
+	       (uint32_t)used_bytes, (uint32_t)total, (unsigned int)fs->max_erase_count);
+
+	// Erase age distribution
+	uint32_t buckets[INSPECT_AGE_BUCKETS] = {0};
+	uint32_t bucket_size = max_age / INSPECT_AGE_BUCKETS + 1;
+	for (uint32_t bix = 0; bix < fs->block_count; bix++)
+	{
+		buckets[m_blocks[bix].erase_age / bucket_size]++;
+	}
+	printf("erase age distribution\n");
+	for (int i = 0; i < INSPECT_AGE_BUCKETS; i++)
+	{
+		printf("%6"PRIu32"..%-6"PRIu32" %6"PRIu32"\n", i * bucket_size, (i + 1) * bucket_size - 1, buckets[i]);
+	}
+	printf("\n");
+}
+
+static void inspect_gc_candidates (spiffs * fs)
+{
+	uint32_t * order = malloc(fs->block_count * sizeof(uint32_t));
+	uint32_t count = 0;
+
+	// Blocks holding deleted pages can be reclaimed, sorted by score
+	for (uint32_t bix = 0; bix < fs->block_count; bix++)
+	{
+		if (m_blocks[bix].deleted > 0)
+		{
+			uint32_t i = count++;
+			while ((i > 0) && (m_blocks[order[i - 1]].gc_score < m_blocks[bix].gc_score))
+			{
+				order[i] = order[i - 1];
+				i--;
+			}
+			order[i] = bix;
+		}
+	}
+
+	// Cost of collecting a block: live pages to be moved, then one block erase
+	printf("gc candidates (%"PRIu32" blocks with deleted pages)\n", count);
+	printf("%6s %8s %10s %10s %10s\n", "block", "score", "reclaimed", "moved", "move_bytes");
+	for (uint32_t i = 0; (i < count) && (i < INSPECT_GC_CANDIDATES); i++)
+	{
+		inspect_block_t * b = &m_blocks[order[i]];
+		printf("%6"PRIu32" %8"PRIi32" %10"PRIu32" %10"PRIu32" %10"PRIu32"\n",
+		       order[i], b->gc_score, b->deleted, b->used, b->used * (uint32_t)SPIFFS_CFG_LOG_PAGE_SZ(fs));
+	}
+	printf("\n");
+	free(order);
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-e erase_size] [-b] dump.bin\n"
+	                "  -b  print the page counts of every block\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	uint32_t erase_size = 4096;
+	bool print_blocks = false;
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "e:bh")))
+	{
+		switch (opt)
+		{
+			case 'e':
+				erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'b':
+				print_blocks = true;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind + 1 != argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (0 != fs_image_load(INSPECT_PARTITION, argv[optind], erase_size))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!fs_image_geometry_valid(ramflash_driver()->size(INSPECT_PARTITION), erase_size))
+	{
+		return 1;
+	}
+	spiffs * fs = fs_image_mount(INSPECT_PARTITION, false);
+	if (NULL == fs)
+	{
+		fprintf(stderr, "mount failed, not a filesystem of this geometry and configuration\n");
+		return 1;
+	}
+
+	inspect_blocks(fs);
+	inspect_summary(fs);
+	if (print_blocks)
+	{
+		inspect_print_blocks(fs);
+	}
+	inspect_gc_candidates(fs);
+	inspect_files(fs);
+
+	fs_image_unmount();
+	return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Build a ready-to-flash filesystem partition image from a directory.
+ *
+ * The image is formatted and populated with the same SPIFFS build and
+ * geometry fs.c uses, so the device mounts it directly instead of going
+ * through the format path and writing the files one by one. The partition
+ * size must match the size reported by the device driver for the partition,
+ * because the SPIFFS magic depends on it.
+ *
+ * Files in subdirectories are stored with their relative path as the name,
+ * SPIFFS has a flat namespace.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fs_image.h"
+#include "ramflash.h"
+
+#define MKFS_PARTITION 0
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s -s partition_size [-e erase_size] -o image.bin directory\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	uint32_t size = 0;
+	uint32_t erase_size = 4096;
+	const char * output = NULL;
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "s:e:o:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'o':
+				output = optarg;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((0 == size) || (NULL == output) || (optind + 1 != argc))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (!fs_image_geometry_valid(size, erase_size))
+	{
+		return 1;
+	}
+
+	if (0 != ramflash_create(MKFS_PARTITION, size, erase_size))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", size);
+		return 1;
+	}
+	spiffs * fs = fs_image_mount(MKFS_PARTITION, true);
+	if (NULL == fs)
+	{
+		fprintf(stderr, "format failed\n");
+		return 1;
+	}
+
+	int file_count = fs_image_add_dir(fs, argv[optind], true);
+	if (file_count < 0)
+	{
+		return 1;
+	}
+
+	u32_t total, used;
+	SPIFFS_info(fs, &total, &used);
+	fs_image_unmount();
+
+	if (0 != fs_image_save(MKFS_PARTITION, output))
+	{
+		perror(output);
+		return 1;
+	}
+	printf("%d files, %"PRIu32"/%"PRIu32" bytes used, image %s\n",
+	       file_count, (uint32_t)used, (uint32_t)total, output);
+	return 0;
+}
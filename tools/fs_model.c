@@ -0,0 +1,885 @@
+/**
+ * Model-based randomized test of the filesystem API.
+ *
+ * Runs a reproducible random sequence of fs_open, fs_write, fs_read,
+ * fs_lseek, fs_fstat, fs_flush, fs_close, fs_unlink and queued record
+ * operations against fs.c on the RAM-backed flash, and the same sequence
+ * against a trivial in-memory model of the files. Every result is compared
+ * with the model, all file contents are compared periodically and once more
+ * after remounting the filesystem at the end. The first mismatch stops the
+ * run and prints the operation and the seed to reproduce it.
+ *
+ * With a high operation count it doubles as a stress benchmark, reporting
+ * the operation rate and the flash operations per written byte.
+ *
+ * Files are only accessed through one descriptor at a time and never with
+ * the direct and the record API at the same time, because those cases are
+ * not coherent in SPIFFS and would not match the model.
+ *
+ * Built with FS_RECORD_CACHE_ENTRIES in FS_CFLAGS, half of the records are
+ * small enough to be cached, and an additional operation reads a record
+ * twice, changes the file with a direct write or unlink and reads it again:
+ * the second read must be a cache hit and the third must not be one. The
+ * run fails if no record read was served from the cache.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define MODEL_PARTITION  0
+#define MODEL_FILES      12
+#define MODEL_FDS        4   // The fs thread needs one more descriptor for records
+#define MODEL_MAX_SIZE   4096
+#define MODEL_MAX_WRITE  600
+#define MODEL_BURST      6
+
+#if FS_RECORD_CACHE_ENTRIES > 0
+#define MODEL_CACHE      1
+#ifndef FS_RECORD_CACHE_SIZE
+#define FS_RECORD_CACHE_SIZE 16 // Default of fs.c
+#endif//FS_RECORD_CACHE_SIZE
+#else
+#define MODEL_CACHE      0
+#endif//FS_RECORD_CACHE_ENTRIES
+
+typedef struct model_file
+{
+	bool     exists;
+	uint32_t size;
+	uint8_t  data[MODEL_MAX_SIZE];
+} model_file_t;
+
+typedef struct model_fd
+{
+	bool     open;
+	fs_fd    fd;
+	uint32_t file;
+	uint32_t flags;
+	uint32_t pos;
+} model_fd_t;
+
+enum model_ops
+{
+	MODEL_OP_OPEN,
+	MODEL_OP_CLOSE,
+	MODEL_OP_WRITE,
+	MODEL_OP_READ,
+	MODEL_OP_LSEEK,
+	MODEL_OP_FSTAT,
+	MODEL_OP_FLUSH,
+	MODEL_OP_UNLINK,
+	MODEL_OP_RECORD_WRITE,
+	MODEL_OP_RECORD_READ,
+	MODEL_OP_RECORD_BURST,
+	MODEL_OP_RECORD_CACHE,
+	MODEL_OP_COUNT
+};
+
+static const char * const m_op_names[MODEL_OP_COUNT] = {
+	"open", "close", "write", "read", "lseek", "fstat", "flush", "unlink",
+	"record_write", "record_read", "record_burst", "record_cache"
+};
+
+// Relative frequency of the operations, record_cache only with the cache
+static const uint8_t m_op_weights[MODEL_OP_COUNT] = { 12, 8, 20, 15, 8, 4, 3, 4, 12, 8, 6, MODEL_CACHE ? 6 : 0 };
+
+// The model lives in shared memory, so it can be checked after a remount
+// in another process.
+typedef struct model_shared
+{
+	model_file_t files[MODEL_FILES];
+	uint32_t     op_counts[MODEL_OP_COUNT];
+	uint64_t     written;
+	uint64_t     elapsed_us;
+	uint32_t     cache_hits;
+} model_shared_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_ops = 10000;
+static uint32_t m_check_interval = 1000;
+static uint32_t m_seed = 1;
+static bool m_verbose;
+
+static model_shared_t * m_shared;
+static model_fd_t m_fds[MODEL_FDS];
+static char m_names[MODEL_FILES][8];
+static uint32_t m_rand;
+static uint32_t m_op;
+static const char * m_op_name = "start";
+
+static osThreadId_t m_app_thread;
+static uint8_t m_buf[MODEL_MAX_SIZE + 1];
+static uint8_t m_burst_buf[MODEL_BURST][MODEL_MAX_WRITE];
+static volatile int32_t m_cb_len[MODEL_BURST];
+static volatile uint32_t m_cb_order[MODEL_BURST];
+static volatile uint32_t m_cb_count;
+
+static uint32_t model_rand (void)
+{
+	// xorshift32, reproducible across platforms
+	m_rand ^= m_rand << 13;
+	m_rand ^= m_rand >> 17;
+	m_rand ^= m_rand << 5;
+	return m_rand;
+}
+
+static uint32_t model_rand_range (uint32_t min, uint32_t max)
+{
+	return min + model_rand() % (max - min + 1);
+}
+
+static void model_rand_fill (uint8_t * buf, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++)
+	{
+		buf[i] = (uint8_t)model_rand();
+	}
+}
+
+// Length of a record, with the cache half of them are small enough for it
+static uint32_t model_record_len (void)
+{
+#if MODEL_CACHE
+	if (0 == model_rand() % 2)
+	{
+		return model_rand_range(1, FS_RECORD_CACHE_SIZE);
+	}
+#endif//MODEL_CACHE
+	return model_rand_range(1, MODEL_MAX_WRITE);
+}
+
+static void model_fail (const char * fmt, ...)
+{
+	va_list args;
+	fprintf(stderr, "op %"PRIu32" (%s): ", m_op, m_op_name);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fprintf(stderr, "\nreproduce with -r %"PRIu32" -n %"PRIu32"\n", m_seed, m_op + 1);
+	fflush(stderr);
+	_exit(1);
+}
+
+static bool model_file_busy (uint32_t file)
+{
+	for (int i = 0; i < MODEL_FDS; i++)
+	{
+		if (m_fds[i].open && (m_fds[i].file == file))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Pick a random file that is not open, -1 if all are
+static int model_pick_file (void)
+{
+	uint32_t start = model_rand() % MODEL_FILES;
+	for (uint32_t i = 0; i < MODEL_FILES; i++)
+	{
+		uint32_t file = (start + i) % MODEL_FILES;
+		if (!model_file_busy(file))
+		{
+			return (int)file;
+		}
+	}
+	return -1;
+}
+
+// Pick a random open or free descriptor slot, -1 if there is none
+static int model_pick_fd (bool open)
+{
+	uint32_t start = model_rand() % MODEL_FDS;
+	for (uint32_t i = 0; i < MODEL_FDS; i++)
+	{
+		uint32_t slot = (start + i) % MODEL_FDS;
+		if (m_fds[slot].open == open)
+		{
+			return (int)slot;
+		}
+	}
+	return -1;
+}
+
+static void model_write_data (model_file_t * file, uint32_t pos, const uint8_t * data, uint32_t len)
+{
+	memcpy(&file->data[pos], data, len);
+	if (pos + len > file->size)
+	{
+		file->size = pos + len;
+	}
+	m_shared->written += len;
+}
+
+static void model_compare (const uint8_t * actual, const model_file_t * file, uint32_t pos, uint32_t len, const char * what)
+{
+	for (uint32_t i = 0; i < len; i++)
+	{
+		if (actual[i] != file->data[pos + i])
+		{
+			model_fail("%s differs at %"PRIu32": %02X != %02X", what, pos + i, actual[i], file->data[pos + i]);
+		}
+	}
+}
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	uint32_t index = (uint32_t)(uintptr_t)p_user;
+	m_cb_len[index] = len;
+	m_cb_order[m_cb_count] = index;
+	m_cb_count++;
+	osThreadFlagsSet(m_app_thread, 1);
+}
+
+static void model_wait_callbacks (uint32_t count)
+{
+	while (m_cb_count < count)
+	{
+		osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+	}
+}
+
+static bool op_open (void)
+{
+	static const uint32_t modes[] = { FS_RDONLY, FS_WRONLY, FS_RDWR };
+	int slot = model_pick_fd(false);
+	int f = model_pick_file();
+	if ((slot < 0) || (f < 0))
+	{
+		return false;
+	}
+	model_file_t * file = &m_shared->files[f];
+	uint32_t flags = modes[model_rand() % 3];
+	if (flags & FS_WRONLY)
+	{
+		flags |= (model_rand() % 10 < 7) ? FS_CREAT : 0;
+		flags |= (model_rand() % 4 == 0) ? FS_TRUNC : 0;
+		flags |= (model_rand() % 4 == 0) ? FS_APPEND : 0;
+	}
+
+	fs_fd fd = fs_open(0, m_names[f], flags);
+	if (!file->exists && !(flags & FS_CREAT))
+	{
+		if (fd >= 0)
+		{
+			model_fail("open %s %"PRIX32" of a missing file succeeded", m_names[f], flags);
+		}
+		return true;
+	}
+	if (fd < 0)
+	{
+		model_fail("open %s %"PRIX32" failed %"PRIi32, m_names[f], flags, fd);
+	}
+	if (!file->exists || (flags & FS_TRUNC))
+	{
+		file->exists = true;
+		file->size = 0;
+	}
+	m_fds[slot].open = true;
+	m_fds[slot].fd = fd;
+	m_fds[slot].file = (uint32_t)f;
+	m_fds[slot].flags = flags;
+	m_fds[slot].pos = 0;
+	return true;
+}
+
+static bool op_close (void)
+{
+	int slot = model_pick_fd(true);
+	if (slot < 0)
+	{
+		return false;
+	}
+	fs_close(0, m_fds[slot].fd);
+	m_fds[slot].open = false;
+	return true;
+}
+
+static bool op_write (void)
+{
+	int slot = model_pick_fd(true);
+	if (slot < 0)
+	{
+		return false;
+	}
+	model_fd_t * mfd = &m_fds[slot];
+	model_file_t * file = &m_shared->files[mfd->file];
+	uint32_t pos = (mfd->flags & FS_APPEND) ? file->size : mfd->pos;
+	uint32_t len = model_rand_range(1, MODEL_MAX_WRITE);
+	if (len > MODEL_MAX_SIZE - pos)
+	{
+		len = MODEL_MAX_SIZE - pos;
+	}
+	if (0 == len)
+	{
+		return false;
+	}
+	model_rand_fill(m_buf, len);
+
+	int32_t ret = fs_write(0, mfd->fd, m_buf, (int32_t)len);
+	if (!(mfd->flags & FS_WRONLY))
+	{
+		if (ret >= 0)
+		{
+			model_fail("write to a read-only descriptor returned %"PRIi32, ret);
+		}
+		return true;
+	}
+	if (ret != (int32_t)len)
+	{
+		model_fail("write %"PRIu32" at %"PRIu32" returned %"PRIi32, len, pos, ret);
+	}
+	model_write_data(file, pos, m_buf, len);
+	mfd->pos = pos + len;
+	return true;
+}
+
+static bool op_read (void)
+{
+	int slot = model_pick_fd(true);
+	if (slot < 0)
+	{
+		return false;
+	}
+	model_fd_t * mfd = &m_fds[slot];
+	model_file_t * file = &m_shared->files[mfd->file];
+	uint32_t len = model_rand_range(1, MODEL_MAX_WRITE);
+	uint32_t avail = file->size - mfd->pos;
+
+	int32_t ret = fs_read(0, mfd->fd, m_buf, (int32_t)len);
+	if (!(mfd->flags & FS_RDONLY) || (0 == avail))
+	{
+		if (ret >= 0)
+		{
+			model_fail("read %"PRIu32" at %"PRIu32" of %"PRIu32" returned %"PRIi32", expected an error",
+			           len, mfd->pos, file->size, ret);
+		}
+		return true;
+	}
+	uint32_t expected = (len < avail) ? len : avail;
+	if (ret != (int32_t)expected)
+	{
+		model_fail("read %"PRIu32" at %"PRIu32" of %"PRIu32" returned %"PRIi32, len, mfd->pos, file->size, ret);
+	}
+	model_compare(m_buf, file, mfd->pos, expected, "read");
+	mfd->pos += expected;
+	return true;
+}
+
+static bool op_lseek (void)
+{
+	int slot = model_pick_fd(true);
+	if (slot < 0)
+	{
+		return false;
+	}
+	model_fd_t * mfd = &m_fds[slot];
+	model_file_t * file = &m_shared->files[mfd->file];
+	uint32_t target = model_rand_range(0, file->size);
+	int whence = (int)(model_rand() % 3);
+	int32_t offs;
+	switch (whence)
+	{
+		case 0:
+			whence = FS_SEEK_SET;
+			offs = (int32_t)target;
+		break;
+		case 1:
+			whence = FS_SEEK_CUR;
+			offs = (int32_t)target - (int32_t)mfd->pos;
+		break;
+		default:
+			whence = FS_SEEK_END;
+			offs = (int32_t)target - (int32_t)file->size;
+		break;
+	}
+
+	int32_t ret = fs_lseek(0, mfd->fd, offs, whence);
+	if (ret != (int32_t)target)
+	{
+		model_fail("lseek %"PRIi32" whence %d from %"PRIu32" of %"PRIu32" returned %"PRIi32,
+		           offs, whence, mfd->pos, file->size, ret);
+	}
+	mfd->pos = target;
+	return true;
+}
+
+static bool op_fstat (void)
+{
+	fs_stat st;
+	int slot = model_pick_fd(true);
+	if (slot < 0)
+	{
+		return false;
+	}
+	int32_t ret = fs_fstat(0, m_fds[slot].fd, &st);
+	if ((0 != ret) || (st.size != m_shared->files[m_fds[slot].file].size))
+	{
+		model_fail("fstat returned %"PRIi32" size %"PRIu32", expected %"PRIu32,
+		           ret, st.size, m_shared->files[m_fds[slot].file].size);
+	}
+	return true;
+}
+
+static bool op_flush (void)
+{
+	int slot = model_pick_fd(true);
+	if (slot < 0)
+	{
+		return false;
+	}
+	fs_flush(0, m_fds[slot].fd);
+	return true;
+}
+
+static bool op_unlink (void)
+{
+	int f = model_pick_file();
+	if (f < 0)
+	{
+		return false;
+	}
+	fs_unlink(0, m_names[f]);
+	m_shared->files[f].exists = false;
+	m_shared->files[f].size = 0;
+	return true;
+}
+
+// Record writes overwrite the start of an existing file, like fs.c does
+static void model_record_write (uint32_t f, const uint8_t * data, uint32_t len, int32_t ret)
+{
+	model_file_t * file = &m_shared->files[f];
+	if (ret != (int32_t)len)
+	{
+		model_fail("record write %s %"PRIu32" returned %"PRIi32, m_names[f], len, ret);
+	}
+	if (!file->exists)
+	{
+		file->exists = true;
+		file->size = 0;
+	}
+	model_write_data(file, 0, data, len);
+}
+
+static bool op_record_write (void)
+{
+	int f = model_pick_file();
+	if (f < 0)
+	{
+		return false;
+	}
+	uint32_t len = model_record_len();
+	model_rand_fill(m_burst_buf[0], len);
+
+	m_cb_count = 0;
+	if (0 == fs_write_record(0, m_names[f], m_burst_buf[0], (int32_t)len, 1, record_done_cb, (void *)0))
+	{
+		model_fail("record write %s not queued", m_names[f]);
+	}
+	model_wait_callbacks(1);
+	model_record_write((uint32_t)f, m_burst_buf[0], len, m_cb_len[0]);
+	return true;
+}
+
+// Queue a record read and compare the result with the model
+static void model_record_read (uint32_t f, uint32_t len)
+{
+	model_file_t * file = &m_shared->files[f];
+
+	m_cb_count = 0;
+	if (0 == fs_read_record(0, m_names[f], m_buf, (int32_t)len, 1, record_done_cb, (void *)0))
+	{
+		model_fail("record read %s not queued", m_names[f]);
+	}
+	model_wait_callbacks(1);
+
+	int32_t ret = m_cb_len[0];
+	if (!file->exists)
+	{
+		if (0 != ret)
+		{
+			model_fail("record read of missing %s returned %"PRIi32, m_names[f], ret);
+		}
+	}
+	else if (0 == file->size)
+	{
+		if (ret > 0)
+		{
+			model_fail("record read of empty %s returned %"PRIi32, m_names[f], ret);
+		}
+	}
+	else
+	{
+		uint32_t expected = (len < file->size) ? len : file->size;
+		if (ret != (int32_t)expected)
+		{
+			model_fail("record read %s %"PRIu32" of %"PRIu32" returned %"PRIi32, m_names[f], len, file->size, ret);
+		}
+		model_compare(m_buf, file, 0, expected, "record read");
+	}
+}
+
+static bool op_record_read (void)
+{
+	int f = model_pick_file();
+	if (f < 0)
+	{
+		return false;
+	}
+	model_record_read((uint32_t)f, model_record_len());
+	return true;
+}
+
+// Several queued record writes, possibly to the same files, completed in order
+static bool op_record_burst (void)
+{
+	uint32_t files[MODEL_BURST];
+	uint32_t lens[MODEL_BURST];
+	uint32_t count = model_rand_range(2, MODEL_BURST);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		int f = model_pick_file();
+		if (f < 0)
+		{
+			return false;
+		}
+		files[i] = (uint32_t)f;
+		lens[i] = model_record_len();
+		model_rand_fill(m_burst_buf[i], lens[i]);
+	}
+
+	m_cb_count = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (0 == fs_write_record(0, m_names[files[i]], m_burst_buf[i], (int32_t)lens[i], 1,
+		                         record_done_cb, (void *)(uintptr_t)i))
+		{
+			model_fail("record write %s not queued", m_names[files[i]]);
+		}
+	}
+	model_wait_callbacks(count);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (m_cb_order[i] != i)
+		{
+			model_fail("record write %"PRIu32" completed as %"PRIu32, m_cb_order[i], i);
+		}
+		model_record_write(files[i], m_burst_buf[i], lens[i], m_cb_len[i]);
+	}
+	return true;
+}
+
+#if MODEL_CACHE
+// A record written and read again is cached, a direct write or unlink of the
+// file must drop it, so that the next read comes from the flash
+static bool op_record_cache (void)
+{
+	int f = model_pick_file();
+	if (f < 0)
+	{
+		return false;
+	}
+	model_file_t * file = &m_shared->files[f];
+	uint32_t len = model_rand_range(1, FS_RECORD_CACHE_SIZE);
+	model_rand_fill(m_burst_buf[0], len);
+
+	m_cb_count = 0;
+	if (0 == fs_write_record(0, m_names[f], m_burst_buf[0], (int32_t)len, 1, record_done_cb, (void *)0))
+	{
+		model_fail("record write %s not queued", m_names[f]);
+	}
+	model_wait_callbacks(1);
+	model_record_write((uint32_t)f, m_burst_buf[0], len, m_cb_len[0]);
+
+	uint32_t hits = fs_record_cache_hits(0);
+	model_record_read((uint32_t)f, len);
+	if (fs_record_cache_hits(0) != hits + 1)
+	{
+		model_fail("record read %s %"PRIu32" after a record write missed the cache", m_names[f], len);
+	}
+
+	const char * change = "unlink";
+	if (0 == model_rand() % 2)
+	{
+		uint32_t wlen = model_rand_range(1, FS_RECORD_CACHE_SIZE);
+		model_rand_fill(m_buf, wlen);
+		change = "write";
+		fs_fd fd = fs_open(0, m_names[f], FS_WRONLY);
+		int32_t ret = (fd >= 0) ? fs_write(0, fd, m_buf, (int32_t)wlen) : fd;
+		if (fd >= 0)
+		{
+			fs_close(0, fd);
+		}
+		if (ret != (int32_t)wlen)
+		{
+			model_fail("write %s %"PRIu32" returned %"PRIi32, m_names[f], wlen, ret);
+		}
+		model_write_data(file, 0, m_buf, wlen);
+	}
+	else
+	{
+		fs_unlink(0, m_names[f]);
+		file->exists = false;
+		file->size = 0;
+	}
+
+	hits = fs_record_cache_hits(0);
+	model_record_read((uint32_t)f, len);
+	if (fs_record_cache_hits(0) != hits)
+	{
+		model_fail("record read %s %"PRIu32" after a direct %s hit the cache", m_names[f], len, change);
+	}
+	return true;
+}
+#else
+static bool op_record_cache (void)
+{
+	return false;
+}
+#endif//MODEL_CACHE
+
+static bool (* const m_op_funcs[MODEL_OP_COUNT])(void) = {
+	op_open, op_close, op_write, op_read, op_lseek, op_fstat, op_flush, op_unlink,
+	op_record_write, op_record_read, op_record_burst, op_record_cache
+};
+
+// Compare the contents of all files that are not open with the model
+static void model_check_files (void)
+{
+	for (uint32_t f = 0; f < MODEL_FILES; f++)
+	{
+		model_file_t * file = &m_shared->files[f];
+		if (model_file_busy(f))
+		{
+			continue;
+		}
+		fs_fd fd = fs_open(0, m_names[f], FS_RDONLY);
+		if (!file->exists)
+		{
+			if (fd >= 0)
+			{
+				model_fail("check: deleted %s exists", m_names[f]);
+			}
+			continue;
+		}
+		if (fd < 0)
+		{
+			model_fail("check: %s missing %"PRIi32, m_names[f], fd);
+		}
+		int32_t ret = fs_read(0, fd, m_buf, MODEL_MAX_SIZE + 1);
+		fs_close(0, fd);
+		if (((0 == file->size) && (ret > 0)) || ((0 != file->size) && (ret != (int32_t)file->size)))
+		{
+			model_fail("check: %s size %"PRIi32", expected %"PRIu32, m_names[f], ret, file->size);
+		}
+		model_compare(m_buf, file, 0, file->size, "check");
+	}
+}
+
+static uint64_t model_time_us (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void model_start_fs (void)
+{
+	fs_init(0, MODEL_PARTITION, ramflash_driver());
+	fs_start();
+}
+
+static void run_ops (void)
+{
+	uint32_t weight_total = 0;
+	for (int i = 0; i < MODEL_OP_COUNT; i++)
+	{
+		weight_total += m_op_weights[i];
+	}
+
+	model_start_fs();
+	ramflash_reset_stats(MODEL_PARTITION);
+	uint64_t start = model_time_us();
+	for (m_op = 0; m_op < m_ops; m_op++)
+	{
+		bool done = false;
+		while (!done)
+		{
+			uint32_t pick = model_rand() % weight_total;
+			int op = 0;
+			while (pick >= m_op_weights[op])
+			{
+				pick -= m_op_weights[op++];
+			}
+			m_op_name = m_op_names[op];
+			if (m_verbose)
+			{
+				printf("%"PRIu32" %s\n", m_op, m_op_name);
+			}
+			done = m_op_funcs[op]();
+			if (done)
+			{
+				m_shared->op_counts[op]++;
+			}
+		}
+		if ((0 != m_check_interval) && (0 == (m_op + 1) % m_check_interval))
+		{
+			m_op_name = "check";
+			model_check_files();
+		}
+	}
+	for (int i = 0; i < MODEL_FDS; i++)
+	{
+		if (m_fds[i].open)
+		{
+			fs_close(0, m_fds[i].fd);
+			m_fds[i].open = false;
+		}
+	}
+	m_op_name = "check";
+	model_check_files();
+	m_shared->elapsed_us = model_time_us() - start;
+#if MODEL_CACHE
+	m_shared->cache_hits = fs_record_cache_hits(0);
+#endif//MODEL_CACHE
+}
+
+static void run_remount_check (void)
+{
+	m_op = m_ops;
+	m_op_name = "remount check";
+	model_start_fs();
+	model_check_files();
+}
+
+static void app_thread (void * arg)
+{
+	// Set here, the thread may wait for a callback before osThreadNew returns
+	m_app_thread = osThreadGetId();
+	((void (*)(void))arg)();
+	fflush(stdout);
+	_exit(0);
+}
+
+static int model_run (void (*run)(void))
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == pid)
+	{
+		osKernelInitialize();
+		const osThreadAttr_t attr = { .name = "app" };
+		osThreadNew(app_thread, (void *)run, &attr);
+		osKernelStart();
+		_exit(1);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	return (WIFEXITED(status) && (0 == WEXITSTATUS(status))) ? 0 : -1;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-n ops] [-r seed] [-c check_interval] [-v]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:n:r:c:vh")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'n':
+				m_ops = strtoul(optarg, NULL, 0);
+			break;
+			case 'r':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			case 'c':
+				m_check_interval = strtoul(optarg, NULL, 0);
+			break;
+			case 'v':
+				m_verbose = true;
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	m_rand = (0 != m_seed) ? m_seed : 1;
+	for (int i = 0; i < MODEL_FILES; i++)
+	{
+		snprintf(m_names[i], sizeof(m_names[i]), "m%02d", i);
+	}
+	m_shared = mmap(NULL, sizeof(model_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if ((MAP_FAILED == m_shared) || (0 != ramflash_create(MODEL_PARTITION, m_size, m_erase_size)))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return 1;
+	}
+	memset(m_shared, 0, sizeof(model_shared_t));
+
+	printf("partition %"PRIu32" erase %"PRIu32", %"PRIu32" operations, seed %"PRIu32"\n", m_size, m_erase_size, m_ops, m_seed);
+	fflush(stdout);
+	if (0 != model_run(run_ops))
+	{
+		return 1;
+	}
+	ramflash_stats_t stats;
+	ramflash_get_stats(MODEL_PARTITION, &stats);
+	if (0 != model_run(run_remount_check))
+	{
+		fprintf(stderr, "contents differ after remount\n");
+		return 1;
+	}
+
+	for (int i = 0; i < MODEL_OP_COUNT; i++)
+	{
+		printf("%-14s %8"PRIu32"\n", m_op_names[i], m_shared->op_counts[i]);
+	}
+	double seconds = (double)m_shared->elapsed_us / 1e6;
+	printf("%.0f ops/s, %"PRIu64" bytes written, %.2f bytes programmed per byte, %"PRIu32" erases\n",
+	       (seconds > 0) ? m_ops / seconds : 0.0, m_shared->written,
+	       (0 != m_shared->written) ? (double)stats.program_bytes / m_shared->written : 0.0, stats.erases);
+#if MODEL_CACHE
+	printf("%"PRIu32" record reads from the cache\n", m_shared->cache_hits);
+	if (0 == m_shared->cache_hits)
+	{
+		fprintf(stderr, "record cache never hit\n");
+		return 1;
+	}
+#endif//MODEL_CACHE
+	printf("passed\n");
+	return 0;
+}
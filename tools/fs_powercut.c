@@ -0,0 +1,385 @@
+/**
+ * Power-loss recovery harness.
+ *
+ * Fills the filesystem to the requested levels, then repeatedly runs a record
+ * write workload and cuts the power in the middle of one of its flash program
+ * or erase operations, tearing the operation. After every cut the filesystem
+ * is started again like after a reset, measuring the mount time and flash
+ * reads, whether fs_start had to format the partition, how many acknowledged
+ * records were lost and the time of the first write after the reset.
+ *
+ * Every run is a forked process on the shared RAM-backed flash, so a power
+ * cut is simply the process exiting in the middle of a flash operation.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define POWERCUT_PARTITION   0
+#define POWERCUT_FILE_COUNT  8
+#define POWERCUT_RECORD_SIZE 256
+#define POWERCUT_FILL_SIZE   1024
+#define POWERCUT_MAX_LEVELS  16
+
+// State shared with the forked runs
+typedef struct powercut_shared
+{
+	uint32_t acked[POWERCUT_FILE_COUNT]; // Last acknowledged record version
+	uint32_t fill;                       // Fill level in percent
+	uint32_t formatted;
+	uint32_t lost;
+	uint64_t mount_us;
+	uint64_t first_write_us;
+	ramflash_stats_t mount_stats;
+} powercut_shared_t;
+
+typedef struct powercut_result
+{
+	uint32_t trials;
+	uint32_t cuts;
+	uint32_t formats;
+	uint32_t lost;
+	uint64_t mount_us;
+	uint64_t mount_us_max;
+	uint64_t mount_reads;
+	uint64_t first_write_us;
+} powercut_result_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_writes = 100;
+static uint32_t m_trials = 20;
+static uint32_t m_cut_op;
+static unsigned int m_seed = 1;
+
+static powercut_shared_t * m_shared;
+static osThreadId_t m_app_thread;
+static uint8_t m_record[POWERCUT_RECORD_SIZE];
+static volatile int32_t m_record_len;
+
+static uint64_t powercut_time_us (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void powercut_file_name (char * name, size_t size, uint32_t file)
+{
+	snprintf(name, size, "rec%u", (unsigned int)file);
+}
+
+// Record contents are derived from the file and the version
+static void powercut_record_fill (uint8_t * record, uint32_t file, uint32_t version)
+{
+	memcpy(record, &version, sizeof(version));
+	for (uint32_t i = sizeof(version); i < POWERCUT_RECORD_SIZE; i++)
+	{
+		record[i] = (uint8_t)(version * 31 + file + i);
+	}
+}
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	m_record_len = len;
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static int32_t powercut_record_write (const char * name)
+{
+	if (0 == fs_write_record(0, name, m_record, sizeof(m_record), 1, record_done_cb, m_app_thread))
+	{
+		return -1;
+	}
+	osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+	return m_record_len;
+}
+
+static void powercut_start_fs (void)
+{
+	fs_init(0, POWERCUT_PARTITION, ramflash_driver());
+	fs_start();
+}
+
+static void run_fill (void)
+{
+	char name[16];
+	uint32_t total = 0, used = 0;
+	powercut_start_fs();
+	memset(m_record, 0x5A, sizeof(m_record));
+	for (uint32_t i = 0; (0 == fs_info(0, &total, &used)) && (used < (uint64_t)total * m_shared->fill / 100); i++)
+	{
+		snprintf(name, sizeof(name), "fill%03u", (unsigned int)i);
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd < 0)
+		{
+			break;
+		}
+		for (uint32_t j = 0; j < POWERCUT_FILL_SIZE / sizeof(m_record); j++)
+		{
+			fs_write(0, fd, m_record, sizeof(m_record));
+		}
+		fs_close(0, fd);
+	}
+}
+
+static void run_workload (void)
+{
+	char name[16];
+	powercut_start_fs();
+	for (uint32_t i = 0; i < m_writes; i++)
+	{
+		uint32_t file = i % POWERCUT_FILE_COUNT;
+		uint32_t version = m_shared->acked[file] + 1;
+		powercut_file_name(name, sizeof(name), file);
+		powercut_record_fill(m_record, file, version);
+		if (POWERCUT_RECORD_SIZE == powercut_record_write(name))
+		{
+			m_shared->acked[file] = version;
+		}
+	}
+}
+
+static void run_recovery (void)
+{
+	char name[16];
+	uint8_t expected[POWERCUT_RECORD_SIZE];
+
+	ramflash_reset_stats(POWERCUT_PARTITION);
+	uint64_t start = powercut_time_us();
+	powercut_start_fs();
+	m_shared->mount_us = powercut_time_us() - start;
+	ramflash_get_stats(POWERCUT_PARTITION, &m_shared->mount_stats);
+	// Formatting erases every block of the partition, mounting none
+	m_shared->formatted = (m_shared->mount_stats.erases >= m_size / m_erase_size);
+
+	// The record on flash must be the acknowledged version, or the one that
+	// was being written when the power was cut.
+	m_shared->lost = 0;
+	for (uint32_t file = 0; file < POWERCUT_FILE_COUNT; file++)
+	{
+		uint32_t acked = m_shared->acked[file];
+		uint32_t version = 0;
+		powercut_file_name(name, sizeof(name), file);
+		fs_fd fd = fs_open(0, name, FS_RDONLY);
+		if (fd >= 0)
+		{
+			if (POWERCUT_RECORD_SIZE == fs_read(0, fd, m_record, sizeof(m_record)))
+			{
+				memcpy(&version, m_record, sizeof(version));
+				powercut_record_fill(expected, file, version);
+				if (0 != memcmp(expected, m_record, sizeof(m_record)))
+				{
+					version = 0;
+				}
+			}
+			fs_close(0, fd);
+		}
+		if ((0 != acked) && (version != acked) && (version != acked + 1))
+		{
+			m_shared->lost++;
+		}
+	}
+
+	start = powercut_time_us();
+	powercut_record_fill(m_record, 0, 0);
+	powercut_record_write("after");
+	m_shared->first_write_us = powercut_time_us() - start;
+}
+
+static void app_thread (void * arg)
+{
+	((void (*)(void))arg)();
+	fflush(stdout);
+	_exit(0);
+}
+
+// Run in a forked process, returns the exit status, -1 if killed
+static int powercut_run (void (*run)(void))
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == pid)
+	{
+		osKernelInitialize();
+		const osThreadAttr_t attr = { .name = "app" };
+		m_app_thread = osThreadNew(app_thread, (void *)run, &attr);
+		osKernelStart();
+		_exit(1);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int powercut_level (uint32_t fill, powercut_result_t * p_result)
+{
+	ramflash_stats_t stats;
+	uint8_t * flash = ramflash_data(POWERCUT_PARTITION);
+	uint8_t * filled = malloc(m_size);
+
+	memset(p_result, 0, sizeof(powercut_result_t));
+	memset(flash, 0xFF, m_size);
+	m_shared->fill = fill;
+	if (0 != powercut_run(run_fill))
+	{
+		free(filled);
+		return -1;
+	}
+	memcpy(filled, flash, m_size);
+
+	// Count the flash modifications of an uninterrupted workload
+	memset(m_shared->acked, 0, sizeof(m_shared->acked));
+	ramflash_reset_stats(POWERCUT_PARTITION);
+	if (0 != powercut_run(run_workload))
+	{
+		free(filled);
+		return -1;
+	}
+	ramflash_get_stats(POWERCUT_PARTITION, &stats);
+	uint32_t ops = stats.programs + stats.erases;
+
+	for (uint32_t t = 0; t < m_trials; t++)
+	{
+		unsigned int seed = m_seed + t;
+		unsigned int pick = seed;
+		uint32_t cut = (0 != m_cut_op) ? m_cut_op : 1 + (uint32_t)rand_r(&pick) % ops;
+
+		memcpy(flash, filled, m_size);
+		memset(m_shared->acked, 0, sizeof(m_shared->acked));
+		ramflash_power_cut(POWERCUT_PARTITION, cut, seed);
+		int status = powercut_run(run_workload);
+		ramflash_power_cut(POWERCUT_PARTITION, 0, 0);
+		if (RAMFLASH_POWER_CUT_STATUS == status)
+		{
+			p_result->cuts++;
+		}
+		else if (0 != status)
+		{
+			fprintf(stderr, "workload failed %d\n", status);
+			continue;
+		}
+
+		if (0 != powercut_run(run_recovery))
+		{
+			fprintf(stderr, "recovery failed, fill %"PRIu32" cut %"PRIu32" seed %u\n", fill, cut, seed);
+			continue;
+		}
+		if ((0 != m_shared->formatted) || (0 != m_shared->lost))
+		{
+			fprintf(stderr, "fill %"PRIu32" cut %"PRIu32" seed %u: formatted %"PRIu32" lost %"PRIu32"\n",
+			        fill, cut, seed, m_shared->formatted, m_shared->lost);
+		}
+		p_result->trials++;
+		p_result->formats += m_shared->formatted;
+		p_result->lost += m_shared->lost;
+		p_result->mount_us += m_shared->mount_us;
+		p_result->mount_reads += m_shared->mount_stats.reads;
+		p_result->first_write_us += m_shared->first_write_us;
+		if (m_shared->mount_us > p_result->mount_us_max)
+		{
+			p_result->mount_us_max = m_shared->mount_us;
+		}
+	}
+	free(filled);
+	return 0;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-l fill%%,...] [-n trials]\n"
+	                "       [-w writes] [-c cut_op] [-r seed]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	uint32_t levels[POWERCUT_MAX_LEVELS] = { 0, 50, 80 };
+	uint32_t level_count = 3;
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "s:e:l:n:w:c:r:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'l':
+				level_count = 0;
+				for (char * tok = strtok(optarg, ","); (NULL != tok) && (level_count < POWERCUT_MAX_LEVELS); tok = strtok(NULL, ","))
+				{
+					levels[level_count++] = strtoul(tok, NULL, 0);
+				}
+			break;
+			case 'n':
+				m_trials = strtoul(optarg, NULL, 0);
+			break;
+			case 'w':
+				m_writes = strtoul(optarg, NULL, 0);
+			break;
+			case 'c':
+				m_cut_op = strtoul(optarg, NULL, 0);
+			break;
+			case 'r':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	m_shared = mmap(NULL, sizeof(powercut_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if ((MAP_FAILED == m_shared) || (0 != ramflash_create(POWERCUT_PARTITION, m_size, m_erase_size)))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return 1;
+	}
+
+	printf("partition %"PRIu32" erase %"PRIu32", %"PRIu32" record writes of %u bytes per trial\n",
+	       m_size, m_erase_size, m_writes, POWERCUT_RECORD_SIZE);
+	printf("%5s %6s %5s %8s %8s %10s %10s %11s %8s\n",
+	       "fill", "trials", "cuts", "formats", "lost", "mount_us", "mount_max", "mount_reads", "write_us");
+	fflush(stdout);
+
+	int ret = 0;
+	for (uint32_t i = 0; i < level_count; i++)
+	{
+		powercut_result_t r;
+		if ((0 != powercut_level(levels[i], &r)) || (0 == r.trials))
+		{
+			printf("%4"PRIu32"%% FAILED\n", levels[i]);
+			ret = 1;
+			continue;
+		}
+		printf("%4"PRIu32"%% %6"PRIu32" %5"PRIu32" %8"PRIu32" %8"PRIu32" %10"PRIu64" %10"PRIu64" %11"PRIu64" %8"PRIu64"\n",
+		       levels[i], r.trials, r.cuts, r.formats, r.lost,
+		       r.mount_us / r.trials, r.mount_us_max, r.mount_reads / r.trials, r.first_write_us / r.trials);
+		fflush(stdout);
+		if ((0 != r.formats) || (0 != r.lost))
+		{
+			ret = 1;
+		}
+	}
+	return ret;
+}
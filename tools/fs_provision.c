@@ -0,0 +1,499 @@
+/**
+ * Generate per-node filesystem partition images for provisioning.
+ *
+ * A base image is built once from the common directory contents plus
+ * placeholder files for the per-node records. The locations of the data
+ * bytes of the placeholder files in the image are then resolved from the
+ * SPIFFS page headers, and every node image is produced by copying the base
+ * image and patching only those bytes, in parallel worker threads.
+ *
+ * Per-node records are fixed size, declared with -f name:size. The node list
+ * has one node per line: node-id,name=hexdata[,name=hexdata...], where every
+ * declared record must be given with exactly the declared number of bytes.
+ * Lines starting with # are ignored. Images are written as outdir/node-id.bin.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs_image.h"
+#include "spiffs_nucleus.h"
+#include "ramflash.h"
+
+#define PROVISION_PARTITION 0
+#define PROVISION_MAX_RECORDS 16
+#define PROVISION_MAX_THREADS 64
+#define PROVISION_NODE_ID_LEN 64
+
+// Per-node record file and the image location of each of its data pages
+typedef struct provision_record
+{
+	char       name[SPIFFS_OBJ_NAME_LEN];
+	uint32_t   size;
+	uint32_t   page_count;
+	uint32_t * page_addrs; // Image address of the data of span index i
+} provision_record_t;
+
+typedef struct provision_node
+{
+	char      id[PROVISION_NODE_ID_LEN];
+	uint8_t * data[PROVISION_MAX_RECORDS];
+} provision_node_t;
+
+static provision_record_t m_records[PROVISION_MAX_RECORDS];
+static uint32_t m_record_count;
+
+static provision_node_t * m_nodes;
+static uint32_t m_node_count;
+
+static const uint8_t * m_base;
+static uint32_t m_size;
+static const char * m_outdir;
+
+static pthread_mutex_t m_next_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t m_next_node;
+static int m_failed;
+
+static int hex_nibble (char c)
+{
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+static int provision_add_record (const char * spec)
+{
+	const char * colon = strrchr(spec, ':');
+	if ((NULL == colon) || (colon == spec) || ((size_t)(colon - spec) >= SPIFFS_OBJ_NAME_LEN))
+	{
+		fprintf(stderr, "bad record %s, expected name:size\n", spec);
+		return -1;
+	}
+	if (m_record_count >= PROVISION_MAX_RECORDS)
+	{
+		fprintf(stderr, "too many records\n");
+		return -1;
+	}
+	provision_record_t * r = &m_records[m_record_count];
+	memcpy(r->name, spec, colon - spec);
+	r->name[colon - spec] = '\0';
+	r->size = strtoul(colon + 1, NULL, 0);
+	if (0 == r->size)
+	{
+		fprintf(stderr, "bad record size %s\n", spec);
+		return -1;
+	}
+	m_record_count++;
+	return 0;
+}
+
+static int provision_find_record (const char * name, size_t len)
+{
+	for (uint32_t i = 0; i < m_record_count; i++)
+	{
+		if ((strlen(m_records[i].name) == len) && (0 == strncmp(m_records[i].name, name, len)))
+		{
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Parse one node line, node-id,name=hexdata,...
+static int provision_parse_node (char * line, unsigned int line_nr, provision_node_t * node)
+{
+	char * save;
+	char * tok = strtok_r(line, ",", &save);
+	if ((NULL == tok) || (strlen(tok) >= PROVISION_NODE_ID_LEN))
+	{
+		fprintf(stderr, "line %u: bad node id\n", line_nr);
+		return -1;
+	}
+	for (const char * c = tok; *c; c++)
+	{
+		if (!isalnum((unsigned char)*c) && ('-' != *c) && ('_' != *c))
+		{
+			fprintf(stderr, "line %u: node id may only contain a-z, 0-9, - and _\n", line_nr);
+			return -1;
+		}
+	}
+	strcpy(node->id, tok);
+
+	while (NULL != (tok = strtok_r(NULL, ",", &save)))
+	{
+		char * eq = strchr(tok, '=');
+		int r = (NULL != eq) ? provision_find_record(tok, eq - tok) : -1;
+		if (r < 0)
+		{
+			fprintf(stderr, "line %u: unknown record in %s\n", line_nr, tok);
+			return -1;
+		}
+		const char * hex = eq + 1;
+		if (strlen(hex) != 2 * m_records[r].size)
+		{
+			fprintf(stderr, "line %u: %s must be %"PRIu32" bytes\n", line_nr, m_records[r].name, m_records[r].size);
+			return -1;
+		}
+		node->data[r] = malloc(m_records[r].size);
+		for (uint32_t i = 0; i < m_records[r].size; i++)
+		{
+			int hi = hex_nibble(hex[2 * i]);
+			int lo = hex_nibble(hex[2 * i + 1]);
+			if ((hi < 0) || (lo < 0))
+			{
+				fprintf(stderr, "line %u: bad hex in %s\n", line_nr, m_records[r].name);
+				return -1;
+			}
+			node->data[r][i] = (uint8_t)((hi << 4) | lo);
+		}
+	}
+
+	for (uint32_t r = 0; r < m_record_count; r++)
+	{
+		if (NULL == node->data[r])
+		{
+			fprintf(stderr, "line %u: %s missing\n", line_nr, m_records[r].name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int provision_load_nodes (const char * path)
+{
+	char line[4096];
+	unsigned int line_nr = 0;
+	uint32_t allocated = 0;
+
+	FILE * f = fopen(path, "r");
+	if (NULL == f)
+	{
+		perror(path);
+		return -1;
+	}
+	while (NULL != fgets(line, sizeof(line), f))
+	{
+		line_nr++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (('\0' == line[0]) || ('#' == line[0]))
+		{
+			continue;
+		}
+		if (m_node_count == allocated)
+		{
+			allocated = (0 == allocated) ? 256 : 2 * allocated;
+			m_nodes = realloc(m_nodes, allocated * sizeof(provision_node_t));
+		}
+		memset(&m_nodes[m_node_count], 0, sizeof(provision_node_t));
+		if (0 != provision_parse_node(line, line_nr, &m_nodes[m_node_count]))
+		{
+			fclose(f);
+			return -1;
+		}
+		m_node_count++;
+	}
+	fclose(f);
+	return 0;
+}
+
+// Create the placeholder files for the per-node records in the base image
+static int provision_create_placeholders (spiffs * fs)
+{
+	for (uint32_t r = 0; r < m_record_count; r++)
+	{
+		uint8_t * zero = calloc(1, m_records[r].size);
+		spiffs_file fd = SPIFFS_open(fs, m_records[r].name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_WRONLY, 0);
+		s32_t wr = (fd >= 0) ? SPIFFS_write(fs, fd, zero, (s32_t)m_records[r].size) : fd;
+		if (fd >= 0)
+		{
+			SPIFFS_close(fs, fd);
+		}
+		free(zero);
+		if (wr != (s32_t)m_records[r].size)
+		{
+			fprintf(stderr, "%s: write %d\n", m_records[r].name, (int)wr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Find the image address of every data page of the record files by going
+// through the object lookup entries of all blocks.
+static int provision_map_records (spiffs * fs)
+{
+	const uint8_t * image = ramflash_data(PROVISION_PARTITION);
+	const uint32_t data_page_size = SPIFFS_DATA_PAGE_SIZE(fs);
+
+	for (uint32_t r = 0; r < m_record_count; r++)
+	{
+		provision_record_t * rec = &m_records[r];
+		spiffs_stat st;
+		if (SPIFFS_OK != SPIFFS_stat(fs, rec->name, &st))
+		{
+			fprintf(stderr, "%s: stat failed\n", rec->name);
+			return -1;
+		}
+		rec->page_count = (rec->size + data_page_size - 1) / data_page_size;
+		rec->page_addrs = calloc(rec->page_count, sizeof(uint32_t));
+
+		uint32_t found = 0;
+		for (uint32_t bix = 0; bix < fs->block_count; bix++)
+		{
+			const spiffs_obj_id * lu = (const spiffs_obj_id *)&image[SPIFFS_BLOCK_TO_PADDR(fs, bix)];
+			for (uint32_t e = 0; e < SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs); e++)
+			{
+				// Data pages are listed with the plain object id, index pages with the flag set
+				if (lu[e] != (st.obj_id & ~SPIFFS_OBJ_ID_IX_FLAG))
+				{
+					continue;
+				}
+				uint32_t paddr = SPIFFS_PAGE_TO_PADDR(fs, SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, e));
+				spiffs_page_header ph;
+				memcpy(&ph, &image[paddr], sizeof(ph));
+				// Page flags are cleared when set: used, final, not deleted data page
+				if ((0 == (ph.flags & (SPIFFS_PH_FLAG_USED | SPIFFS_PH_FLAG_FINAL)))
+				 && (0 != (ph.flags & SPIFFS_PH_FLAG_DELET)) && (0 != (ph.flags & SPIFFS_PH_FLAG_INDEX))
+				 && (ph.span_ix < rec->page_count) && (0 == rec->page_addrs[ph.span_ix]))
+				{
+					rec->page_addrs[ph.span_ix] = paddr + sizeof(spiffs_page_header);
+					found++;
+				}
+			}
+		}
+		if (found != rec->page_count)
+		{
+			fprintf(stderr, "%s: found %"PRIu32"/%"PRIu32" data pages\n", rec->name, found, rec->page_count);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void provision_patch (uint8_t * image, const provision_node_t * node)
+{
+	const uint32_t data_page_size = FS_SPIFFS_LOG_PAGE_SZ - sizeof(spiffs_page_header);
+	for (uint32_t r = 0; r < m_record_count; r++)
+	{
+		const provision_record_t * rec = &m_records[r];
+		for (uint32_t p = 0; p < rec->page_count; p++)
+		{
+			uint32_t offset = p * data_page_size;
+			uint32_t len = rec->size - offset;
+			if (len > data_page_size)
+			{
+				len = data_page_size;
+			}
+			memcpy(&image[rec->page_addrs[p]], &node->data[r][offset], len);
+		}
+	}
+}
+
+static void * provision_worker (void * arg)
+{
+	char path[1024];
+	uint8_t * image = malloc(m_size);
+	if (NULL == image)
+	{
+		m_failed = 1;
+		return NULL;
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&m_next_mutex);
+		uint32_t n = m_next_node++;
+		int failed = m_failed;
+		pthread_mutex_unlock(&m_next_mutex);
+		if ((n >= m_node_count) || failed)
+		{
+			break;
+		}
+
+		memcpy(image, m_base, m_size);
+		provision_patch(image, &m_nodes[n]);
+
+		snprintf(path, sizeof(path), "%s/%s.bin", m_outdir, m_nodes[n].id);
+		FILE * f = fopen(path, "wb");
+		if ((NULL == f) || (1 != fwrite(image, m_size, 1, f)) || (0 != fclose(f)))
+		{
+			perror(path);
+			pthread_mutex_lock(&m_next_mutex);
+			m_failed = 1;
+			pthread_mutex_unlock(&m_next_mutex);
+		}
+	}
+	free(image);
+	return NULL;
+}
+
+// Mount the first generated image and check the record contents
+static int provision_verify (uint32_t erase_size)
+{
+	char path[1024];
+	uint8_t buf[1024];
+
+	snprintf(path, sizeof(path), "%s/%s.bin", m_outdir, m_nodes[0].id);
+	if ((0 != fs_image_load(PROVISION_PARTITION + 1, path, erase_size)))
+	{
+		perror(path);
+		return -1;
+	}
+	spiffs * fs = fs_image_mount(PROVISION_PARTITION + 1, false);
+	if (NULL == fs)
+	{
+		fprintf(stderr, "%s: mount failed\n", path);
+		return -1;
+	}
+	int ret = 0;
+	for (uint32_t r = 0; (r < m_record_count) && (0 == ret); r++)
+	{
+		spiffs_file fd = SPIFFS_open(fs, m_records[r].name, SPIFFS_RDONLY, 0);
+		for (uint32_t offset = 0; (fd >= 0) && (offset < m_records[r].size); offset += sizeof(buf))
+		{
+			s32_t len = m_records[r].size - offset;
+			if (len > (s32_t)sizeof(buf))
+			{
+				len = sizeof(buf);
+			}
+			if ((len != SPIFFS_read(fs, fd, buf, len)) || (0 != memcmp(buf, &m_nodes[0].data[r][offset], len)))
+			{
+				ret = -1;
+			}
+		}
+		if (fd < 0)
+		{
+			ret = -1;
+		}
+		else
+		{
+			SPIFFS_close(fs, fd);
+		}
+		if (0 != ret)
+		{
+			fprintf(stderr, "%s: %s does not match\n", path, m_records[r].name);
+		}
+	}
+	fs_image_unmount();
+	ramflash_destroy(PROVISION_PARTITION + 1);
+	return ret;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s -s partition_size [-e erase_size] [-b base_dir] -f name:size [-f ...]\n"
+	                "       -n nodes.csv -o output_dir [-j threads]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	uint32_t erase_size = 4096;
+	const char * base_dir = NULL;
+	const char * nodes = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "s:e:b:f:n:o:j:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'b':
+				base_dir = optarg;
+			break;
+			case 'f':
+				if (0 != provision_add_record(optarg))
+				{
+					return 1;
+				}
+			break;
+			case 'n':
+				nodes = optarg;
+			break;
+			case 'o':
+				m_outdir = optarg;
+			break;
+			case 'j':
+				threads = strtol(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((0 == m_size) || (NULL == nodes) || (NULL == m_outdir) || (0 == m_record_count))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (!fs_image_geometry_valid(m_size, erase_size))
+	{
+		return 1;
+	}
+	if ((threads < 1) || (threads > PROVISION_MAX_THREADS))
+	{
+		threads = 1;
+	}
+
+	if ((0 != provision_load_nodes(nodes)) || (0 == m_node_count))
+	{
+		fprintf(stderr, "no nodes\n");
+		return 1;
+	}
+
+	// Build the base image
+	if (0 != ramflash_create(PROVISION_PARTITION, m_size, erase_size))
+	{
+		fprintf(stderr, "cannot allocate %"PRIu32" bytes\n", m_size);
+		return 1;
+	}
+	spiffs * fs = fs_image_mount(PROVISION_PARTITION, true);
+	if (NULL == fs)
+	{
+		fprintf(stderr, "format failed\n");
+		return 1;
+	}
+	int file_count = (NULL != base_dir) ? fs_image_add_dir(fs, base_dir, false) : 0;
+	if ((file_count < 0) || (0 != provision_create_placeholders(fs)) || (0 != provision_map_records(fs)))
+	{
+		return 1;
+	}
+	fs_image_unmount();
+	m_base = ramflash_data(PROVISION_PARTITION);
+
+	// Generate the node images
+	pthread_t workers[PROVISION_MAX_THREADS];
+	for (long i = 0; i < threads; i++)
+	{
+		pthread_create(&workers[i], NULL, provision_worker, NULL);
+	}
+	for (long i = 0; i < threads; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	if (m_failed)
+	{
+		return 1;
+	}
+
+	if (0 != provision_verify(erase_size))
+	{
+		return 1;
+	}
+	printf("%"PRIu32" images, %d common files, %"PRIu32" records per node\n",
+	       m_node_count, file_count, m_record_count);
+	return 0;
+}
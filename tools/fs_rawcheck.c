@@ -0,0 +1,305 @@
+/**
+ * Raw range check.
+ *
+ * Builds fs.c with FS_BAD_BLOCKS, reserves a raw range and checks that
+ * fs_raw_reserve, fs_raw_write and fs_raw_read reject every size, offset and
+ * length outside of it, including ones that wrap around. The whole range is
+ * then written, and only the bytes of the expected window of the flash, the
+ * end of the SPIFFS part just before the bad block spares, may change. Files
+ * are then written until the filesystem is full, through the fault-injecting
+ * driver wrapper with hard erase failures, so that spare blocks are taken:
+ * the window must not change. The filesystem is then started again from the
+ * resulting flash without faults, with the same reservation, and the raw
+ * range must read back as written.
+ *
+ * Every run is a forked process, so the flash contents survive it, like the
+ * flash survives a reset.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "faultflash.h"
+#include "ramflash.h"
+
+#define RAWCHECK_PARTITION   0
+#define RAWCHECK_RECORD_SIZE 512
+#define RAWCHECK_MAX_FILES   1000
+
+// State shared with the forked runs
+typedef struct rawcheck_shared
+{
+	uint32_t failures;
+	uint32_t files;    // Files written until the filesystem was full
+	uint32_t replaced; // Spares taken while filling
+	uint32_t replaced_mnt;
+} rawcheck_shared_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static uint32_t m_raw_blocks = 8;
+static uint32_t m_ppm = 20000;
+static uint32_t m_target = 1;
+static uint32_t m_seed = 1;
+
+static rawcheck_shared_t * m_shared;
+static uint8_t * m_raw;
+static uint8_t * m_raw_rd;
+static uint8_t m_record[RAWCHECK_RECORD_SIZE];
+
+static uint32_t rawcheck_raw_size (void)
+{
+	return m_raw_blocks * m_erase_size;
+}
+
+// Start of the raw range in the partition, before the spares and their table
+static uint32_t rawcheck_raw_addr (void)
+{
+	return FS_SPIFFS_SIZE(m_size, m_erase_size) - rawcheck_raw_size();
+}
+
+static void rawcheck_fail (const char * what, int32_t ret)
+{
+	printf("%s: %"PRIi32"\n", what, ret);
+	m_shared->failures++;
+}
+
+static void rawcheck_expect (const char * what, int32_t ret, int32_t expected)
+{
+	if (ret != expected)
+	{
+		printf("%s: %"PRIi32" expected %"PRIi32"\n", what, ret, expected);
+		m_shared->failures++;
+	}
+}
+
+static void rawcheck_reserve (void)
+{
+	// Not whole blocks, or nothing left for SPIFFS
+	rawcheck_expect("reserve part of a block", fs_raw_reserve(0, m_erase_size / 2), FS_ERR_RANGE);
+	rawcheck_expect("reserve everything", fs_raw_reserve(0, FS_SPIFFS_SIZE(m_size, m_erase_size)), FS_ERR_RANGE);
+	rawcheck_expect("reserve", fs_raw_reserve(0, rawcheck_raw_size()), 0);
+}
+
+static void rawcheck_bounds (void)
+{
+	uint32_t size = rawcheck_raw_size();
+	const struct { uint32_t offset; uint32_t len; } outside[] = {
+		{ size, 1 }, { size - 10, 11 }, { size + 1, 0 }, { 0, size + 1 },
+		{ UINT32_MAX, 2 }, { 1, UINT32_MAX }, { size / 2, UINT32_MAX - size / 2 + 1 },
+	};
+	for (uint32_t i = 0; i < sizeof(outside) / sizeof(outside[0]); i++)
+	{
+		rawcheck_expect("write outside", fs_raw_write(0, outside[i].offset, m_raw, outside[i].len), FS_ERR_RANGE);
+		rawcheck_expect("read outside", fs_raw_read(0, outside[i].offset, m_raw_rd, outside[i].len), FS_ERR_RANGE);
+	}
+	rawcheck_expect("write at the end", fs_raw_write(0, size, m_raw, 0), 0);
+	rawcheck_expect("read at the end", fs_raw_read(0, size, m_raw_rd, 0), 0);
+	rawcheck_expect("reserve when started", fs_raw_reserve(0, size), FS_ERR_RANGE);
+}
+
+static void rawcheck_read_back (const char * what)
+{
+	uint32_t size = rawcheck_raw_size();
+	memset(m_raw_rd, 0, size);
+	int32_t ret = fs_raw_read(0, 0, m_raw_rd, size);
+	if ((ret != (int32_t)size) || (0 != memcmp(m_raw, m_raw_rd, size)))
+	{
+		rawcheck_fail(what, ret);
+	}
+}
+
+static void run_fill (void)
+{
+	uint8_t * flash = ramflash_data(RAWCHECK_PARTITION);
+	uint8_t * before = malloc(m_size);
+	uint32_t addr = rawcheck_raw_addr();
+	uint32_t size = rawcheck_raw_size();
+	char name[16];
+
+	fs_init(0, RAWCHECK_PARTITION, faultflash_driver(ramflash_driver()));
+	rawcheck_reserve();
+	fs_start();
+	rawcheck_bounds();
+
+	// Unaligned pieces, so that the block erases are made by the writes
+	memcpy(before, flash, m_size);
+	for (uint32_t offset = 0; offset < size; )
+	{
+		uint32_t len = (size - offset > 1000) ? 1000 : size - offset;
+		rawcheck_expect("raw write", fs_raw_write(0, offset, &m_raw[offset], len), (int32_t)len);
+		offset += len;
+	}
+	if ((0 != memcmp(before, flash, addr)) || (0 != memcmp(&before[addr + size], &flash[addr + size], m_size - addr - size)))
+	{
+		rawcheck_fail("raw write outside the window", 0);
+	}
+	if (0 != memcmp(&flash[addr], m_raw, size))
+	{
+		rawcheck_fail("raw data not in the window", 0);
+	}
+	rawcheck_read_back("raw read");
+
+	faultflash_config_t config = { .erase_fail_ppm = m_ppm, .fail_error = FS_ERR_HARD, .seed = m_seed };
+	faultflash_configure(&config);
+	for (uint32_t i = 0; i < RAWCHECK_MAX_FILES; i++)
+	{
+		snprintf(name, sizeof(name), "raw%u", (unsigned int)i);
+		memset(m_record, (int)i, sizeof(m_record));
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		bool ok = (fd >= 0) && (RAWCHECK_RECORD_SIZE == fs_write(0, fd, m_record, sizeof(m_record)));
+		if (fd >= 0)
+		{
+			fs_close(0, fd);
+		}
+		if (!ok)
+		{
+			break;
+		}
+		m_shared->files++;
+	}
+	faultflash_configure(&(faultflash_config_t){ .seed = 1 });
+	m_shared->replaced = fs_bad_block_count(0);
+
+	if (0 != memcmp(&flash[addr], m_raw, size))
+	{
+		rawcheck_fail("filesystem wrote into the raw window", 0);
+	}
+	rawcheck_read_back("raw read when full");
+	free(before);
+}
+
+static void run_mount (void)
+{
+	fs_init(0, RAWCHECK_PARTITION, ramflash_driver());
+	rawcheck_expect("reserve", fs_raw_reserve(0, rawcheck_raw_size()), 0);
+	fs_start();
+	m_shared->replaced_mnt = fs_bad_block_count(0);
+	rawcheck_read_back("raw read after restart");
+}
+
+static void app_thread (void * arg)
+{
+	((void (*)(void))arg)();
+	fflush(stdout);
+	_exit(0);
+}
+
+// Run in a forked process, returns the exit status
+static int rawcheck_run (void (*run)(void))
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == pid)
+	{
+		osKernelInitialize();
+		const osThreadAttr_t attr = { .name = "app" };
+		osThreadNew(app_thread, (void *)run, &attr);
+		osKernelStart();
+		_exit(1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-n raw_blocks] [-R ppm] [-b spares_to_use] [-r seed]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:n:R:b:r:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'n':
+				m_raw_blocks = strtoul(optarg, NULL, 0);
+			break;
+			case 'R':
+				m_ppm = strtoul(optarg, NULL, 0);
+			break;
+			case 'b':
+				m_target = strtoul(optarg, NULL, 0);
+			break;
+			case 'r':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (0 != ramflash_create(RAWCHECK_PARTITION, m_size, m_erase_size))
+	{
+		fprintf(stderr, "ramflash_create failed\n");
+		return 1;
+	}
+	m_shared = mmap(NULL, sizeof(rawcheck_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	m_raw = malloc(rawcheck_raw_size());
+	m_raw_rd = malloc(rawcheck_raw_size());
+	if ((MAP_FAILED == m_shared) || (NULL == m_raw) || (NULL == m_raw_rd))
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(m_shared, 0, sizeof(rawcheck_shared_t));
+	srand(m_seed);
+	for (uint32_t i = 0; i < rawcheck_raw_size(); i++)
+	{
+		m_raw[i] = (uint8_t)rand();
+	}
+
+	uint32_t failures = 0;
+	if (0 != rawcheck_run(run_fill))
+	{
+		printf("fill crashed\n");
+		failures++;
+	}
+	printf("raw %"PRIu32"@%"PRIu32" files %"PRIu32" spares taken %"PRIu32"\n",
+	       rawcheck_raw_size(), rawcheck_raw_addr(), m_shared->files, m_shared->replaced);
+	if (0 != rawcheck_run(run_mount))
+	{
+		printf("mount crashed\n");
+		failures++;
+	}
+	printf("after restart: spares taken %"PRIu32"\n", m_shared->replaced_mnt);
+
+	failures += m_shared->failures;
+	if (m_shared->replaced < m_target)
+	{
+		printf("FAIL: fewer than %"PRIu32" spares taken\n", m_target);
+		failures++;
+	}
+	if (m_shared->replaced_mnt != m_shared->replaced)
+	{
+		printf("FAIL: replacement table not kept\n");
+		failures++;
+	}
+	printf("failures %"PRIu32"\n", failures);
+	return (0 == failures) ? 0 : 1;
+}
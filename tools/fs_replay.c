@@ -0,0 +1,397 @@
+/**
+ * Replay a captured filesystem workload.
+ *
+ * Reads a trace captured on a device with FS_TRACE (see fs_trace.h) and runs
+ * the same calls against fs.c on the RAM-backed flash, starting from an
+ * empty partition or a partition dump. Reports the latency distribution of
+ * every operation type and the flash operations per written byte, so
+ * configuration and code changes can be compared on field workloads.
+ *
+ * File names are replaced by names derived from their hash and written data
+ * by a pattern, the trace contains neither.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "fs_image.h"
+#include "fs_trace.h"
+#include "ramflash.h"
+
+#define REPLAY_PARTITION  0
+#define REPLAY_OP_COUNT   (FS_TRACE_WRITE_RECORD + 1)
+#define REPLAY_MAX_LEN    65536
+#define REPLAY_HANDLES    65536
+
+_Static_assert(sizeof(fs_trace_entry_t) == 12, "trace entries must be packed");
+
+typedef struct replay_latencies
+{
+	uint32_t * us;
+	uint32_t   count;
+	uint32_t   capacity;
+} replay_latencies_t;
+
+static const char * const m_op_names[REPLAY_OP_COUNT] = {
+	"?", "open", "read", "write", "lseek", "fstat", "flush", "close", "unlink", "read_record", "write_record"
+};
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+static const char * m_image;
+static int m_file_sys_nr;
+static bool m_timed;
+static double m_speed = 1.0;
+static uint32_t m_tick_hz = 1000;
+
+static fs_trace_entry_t * m_entries;
+static uint32_t m_entry_count;
+
+static replay_latencies_t m_latencies[REPLAY_OP_COUNT];
+static fs_fd m_handles[REPLAY_HANDLES];
+static uint64_t m_written;
+static uint32_t m_skipped;
+static uint32_t m_failed;
+
+static osThreadId_t m_app_thread;
+static uint8_t m_buf[REPLAY_MAX_LEN];
+static volatile int32_t m_record_len;
+
+static uint64_t replay_time_us (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void replay_latency_add (uint8_t op, uint64_t us)
+{
+	replay_latencies_t * l = &m_latencies[op];
+	if (l->count == l->capacity)
+	{
+		l->capacity = (0 == l->capacity) ? 1024 : 2 * l->capacity;
+		l->us = realloc(l->us, l->capacity * sizeof(uint32_t));
+	}
+	l->us[l->count++] = (uint32_t)us;
+}
+
+static int replay_compare (const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t replay_percentile (const replay_latencies_t * l, double p)
+{
+	uint32_t i = (uint32_t)(p * (l->count - 1) / 100.0 + 0.5);
+	return l->us[i];
+}
+
+static void replay_name (char * name, size_t size, uint16_t id)
+{
+	snprintf(name, size, "t%04x", id);
+}
+
+static uint32_t replay_len (int32_t value)
+{
+	if (value < 0)
+	{
+		return 0;
+	}
+	return ((uint32_t)value > REPLAY_MAX_LEN) ? REPLAY_MAX_LEN : (uint32_t)value;
+}
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	m_record_len = len;
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static fs_fd replay_handle (const fs_trace_entry_t * e)
+{
+	fs_fd fd = m_handles[e->id];
+	if (fd < 0)
+	{
+		m_skipped++;
+	}
+	return fd;
+}
+
+// Run one captured call, returns false if it was not run
+static bool replay_entry (const fs_trace_entry_t * e)
+{
+	char name[8];
+	fs_stat st;
+	fs_fd fd;
+	int32_t ret;
+	uint32_t len = replay_len(e->value);
+
+	switch (e->op & FS_TRACE_OP_MASK)
+	{
+		case FS_TRACE_OPEN:
+			replay_name(name, sizeof(name), e->id);
+			fd = fs_open(0, name, e->arg);
+			if (e->value >= 0)
+			{
+				m_handles[(uint16_t)e->value] = fd;
+				if (fd < 0)
+				{
+					m_failed++;
+				}
+			}
+			else if (fd >= 0)
+			{
+				// Failed on the device, but not here
+				fs_close(0, fd);
+				m_failed++;
+			}
+		break;
+
+		case FS_TRACE_READ:
+			if ((fd = replay_handle(e)) < 0)
+			{
+				return false;
+			}
+			fs_read(0, fd, m_buf, (int32_t)len);
+		break;
+
+		case FS_TRACE_WRITE:
+			if ((fd = replay_handle(e)) < 0)
+			{
+				return false;
+			}
+			ret = fs_write(0, fd, m_buf, (int32_t)len);
+			if (ret != (int32_t)len)
+			{
+				m_failed++;
+			}
+			m_written += len;
+		break;
+
+		case FS_TRACE_LSEEK:
+			if ((fd = replay_handle(e)) < 0)
+			{
+				return false;
+			}
+			fs_lseek(0, fd, e->value, e->arg);
+		break;
+
+		case FS_TRACE_FSTAT:
+			if ((fd = replay_handle(e)) < 0)
+			{
+				return false;
+			}
+			fs_fstat(0, fd, &st);
+		break;
+
+		case FS_TRACE_FLUSH:
+			if ((fd = replay_handle(e)) < 0)
+			{
+				return false;
+			}
+			fs_flush(0, fd);
+		break;
+
+		case FS_TRACE_CLOSE:
+			if ((fd = replay_handle(e)) < 0)
+			{
+				return false;
+			}
+			fs_close(0, fd);
+			m_handles[e->id] = -1;
+		break;
+
+		case FS_TRACE_UNLINK:
+			replay_name(name, sizeof(name), e->id);
+			fs_unlink(0, name);
+		break;
+
+		case FS_TRACE_READ_RECORD:
+		case FS_TRACE_WRITE_RECORD:
+			replay_name(name, sizeof(name), e->id);
+			if (FS_TRACE_WRITE_RECORD == (e->op & FS_TRACE_OP_MASK))
+			{
+				ret = fs_write_record(0, name, m_buf, (int32_t)len, 1, record_done_cb, m_app_thread);
+				m_written += len;
+			}
+			else
+			{
+				ret = fs_read_record(0, name, m_buf, (int32_t)len, 1, record_done_cb, m_app_thread);
+			}
+			if (0 == ret)
+			{
+				m_failed++;
+				return false;
+			}
+			// Latency of a record operation is from queuing to the callback
+			osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+		break;
+
+		default:
+			m_skipped++;
+			return false;
+	}
+	return true;
+}
+
+static void replay_thread (void * arg)
+{
+	ramflash_stats_t stats;
+
+	for (uint32_t i = 0; i < REPLAY_HANDLES; i++)
+	{
+		m_handles[i] = -1;
+	}
+	for (uint32_t i = 0; i < sizeof(m_buf); i++)
+	{
+		m_buf[i] = (uint8_t)(i * 7);
+	}
+
+	fs_init(0, REPLAY_PARTITION, ramflash_driver());
+	fs_start();
+	ramflash_reset_stats(REPLAY_PARTITION);
+
+	uint64_t start = replay_time_us();
+	uint32_t replayed = 0;
+	for (uint32_t i = 0; i < m_entry_count; i++)
+	{
+		const fs_trace_entry_t * e = &m_entries[i];
+		if ((e->op >> FS_TRACE_FS_SHIFT) != m_file_sys_nr)
+		{
+			continue;
+		}
+		if (m_timed)
+		{
+			// Keep the captured spacing of the calls, scaled by the speed
+			uint64_t due = start + (uint64_t)((e->time - m_entries[0].time) * 1e6 / m_tick_hz / m_speed);
+			uint64_t now = replay_time_us();
+			if (due > now)
+			{
+				usleep((useconds_t)(due - now));
+			}
+		}
+		uint64_t t0 = replay_time_us();
+		if (replay_entry(e))
+		{
+			replay_latency_add(e->op & FS_TRACE_OP_MASK, replay_time_us() - t0);
+			replayed++;
+		}
+	}
+	uint64_t elapsed = replay_time_us() - start;
+	ramflash_get_stats(REPLAY_PARTITION, &stats);
+
+	printf("%"PRIu32" calls replayed in %"PRIu64" ms, %"PRIu32" skipped, %"PRIu32" failed\n",
+	       replayed, elapsed / 1000, m_skipped, m_failed);
+	printf("%-13s %8s %8s %8s %8s %8s %8s\n", "op", "count", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	for (int op = 1; op < REPLAY_OP_COUNT; op++)
+	{
+		replay_latencies_t * l = &m_latencies[op];
+		if (0 == l->count)
+		{
+			continue;
+		}
+		qsort(l->us, l->count, sizeof(uint32_t), replay_compare);
+		printf("%-13s %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32"\n",
+		       m_op_names[op], l->count, replay_percentile(l, 50), replay_percentile(l, 90),
+		       replay_percentile(l, 99), replay_percentile(l, 99.9), l->us[l->count - 1]);
+	}
+	printf("%"PRIu64" bytes written, %"PRIu32" bytes programmed (%.2f per byte), %"PRIu32" erases, %"PRIu32" bytes read\n",
+	       m_written, stats.program_bytes,
+	       (0 != m_written) ? (double)stats.program_bytes / m_written : 0.0,
+	       stats.erases, stats.read_bytes);
+	fflush(stdout);
+	_exit(0);
+}
+
+static int replay_load (const char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (NULL == f)
+	{
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	m_entry_count = (uint32_t)(size / sizeof(fs_trace_entry_t));
+	m_entries = malloc(m_entry_count * sizeof(fs_trace_entry_t) + 1);
+	int ret = ((0 == m_entry_count) || (1 == fread(m_entries, m_entry_count * sizeof(fs_trace_entry_t), 1, f))) ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size] [-i image.bin] [-f file_sys_nr]\n"
+	                "       [-t] [-x speed] [-k tick_hz] trace.bin\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:i:f:tx:k:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'i':
+				m_image = optarg;
+			break;
+			case 'f':
+				m_file_sys_nr = atoi(optarg);
+			break;
+			case 't':
+				m_timed = true;
+			break;
+			case 'x':
+				m_speed = atof(optarg);
+			break;
+			case 'k':
+				m_tick_hz = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if ((optind + 1 != argc) || (m_speed <= 0) || (0 == m_tick_hz))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (0 != replay_load(argv[optind]))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// Start from the partition dump, or let fs_start format an empty partition
+	int ret = (NULL != m_image) ? fs_image_load(REPLAY_PARTITION, m_image, m_erase_size)
+	                            : ramflash_create(REPLAY_PARTITION, m_size, m_erase_size);
+	if (0 != ret)
+	{
+		fprintf(stderr, "cannot create the partition\n");
+		return 1;
+	}
+
+	osKernelInitialize();
+	const osThreadAttr_t attr = { .name = "replay" };
+	m_app_thread = osThreadNew(replay_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
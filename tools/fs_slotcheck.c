@@ -0,0 +1,341 @@
+/**
+ * Slot store power cut and read error check.
+ *
+ * Runs a sequence of fs_slots_set calls on the RAM-backed flash and cuts the
+ * power during every program and erase operation of it in turn, starting
+ * from erased flash, so that every entry is torn once and every compaction
+ * to the other block is interrupted at each of its steps. After each cut
+ * fs_slots_init must succeed, every slot must hold the last value that was
+ * acknowledged for it, or the value that was being set when the power was
+ * cut, and setting a value must still work and survive another init.
+ *
+ * The completed sequence is then loaded through the fault-injecting driver
+ * wrapper with failing reads. A failed fs_slots_init must leave the flash
+ * untouched, the slots are never set up anew because of a read error, and a
+ * successful one must load every value.
+ *
+ * Every run that can lose power is a forked process, so the flash contents
+ * survive it, like the flash survives a reset.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fs_slots.h"
+#include "faultflash.h"
+#include "ramflash.h"
+
+#define SLOTCHECK_PARTITION  0
+#define SLOTCHECK_SLOTS      5
+#define SLOTCHECK_NONE       0xFF
+// Entry size of the layout in fs_slots.h, to tell when a set compacts
+#define SLOTCHECK_ENTRY_SIZE (4 + FS_SLOTS_VALUE_SIZE)
+#define SLOTCHECK_MARKER     0xA5
+
+typedef struct slotcheck_value
+{
+	uint8_t len; // SLOTCHECK_NONE for a slot that has never been set
+	uint8_t data[FS_SLOTS_VALUE_SIZE];
+} slotcheck_value_t;
+
+// State shared with the forked runs
+typedef struct slotcheck_shared
+{
+	slotcheck_value_t acked[SLOTCHECK_SLOTS]; // Last acknowledged values
+	slotcheck_value_t pending;                // Value being set
+	uint8_t  pending_slot;
+	bool     compacting;                      // The pending set compacts
+	uint32_t failures;
+} slotcheck_shared_t;
+
+static uint32_t m_erase_size = 256;
+static uint32_t m_sets = 100;
+static uint32_t m_read_runs = 200;
+static uint32_t m_read_ppm = 100000;
+static uint32_t m_seed = 1;
+
+static slotcheck_shared_t * m_shared;
+
+static void slotcheck_value (slotcheck_value_t * p_value, uint32_t set)
+{
+	// Lengths vary, including empty values
+	p_value->len = (uint8_t)(set % (FS_SLOTS_VALUE_SIZE + 1));
+	memset(p_value->data, 0xFF, sizeof(p_value->data));
+	for (uint32_t i = 0; i < p_value->len; i++)
+	{
+		p_value->data[i] = (uint8_t)(set * 13 + i);
+	}
+}
+
+static bool slotcheck_equal (fs_slots_t * p_slots, uint8_t slot, const slotcheck_value_t * p_value)
+{
+	uint8_t data[FS_SLOTS_VALUE_SIZE];
+	int32_t len = fs_slots_get(p_slots, slot, data, sizeof(data));
+	if (SLOTCHECK_NONE == p_value->len)
+	{
+		return FS_SLOTS_ERR_EMPTY == len;
+	}
+	return (len == p_value->len) && (0 == memcmp(data, p_value->data, len));
+}
+
+static void slotcheck_fail (const char * what, uint32_t slot)
+{
+	printf("%s %"PRIu32"\n", what, slot);
+	m_shared->failures++;
+}
+
+static void run_sets (void)
+{
+	fs_slots_t slots;
+	if (0 != fs_slots_init(&slots, ramflash_driver(), SLOTCHECK_PARTITION, 0))
+	{
+		slotcheck_fail("init", 0);
+		return;
+	}
+	for (uint32_t set = 0; set < m_sets; set++)
+	{
+		uint8_t slot = (uint8_t)(set % SLOTCHECK_SLOTS);
+		slotcheck_value(&m_shared->pending, set);
+		m_shared->pending_slot = slot;
+		m_shared->compacting = (slots.offset + SLOTCHECK_ENTRY_SIZE > slots.block_size);
+		if (0 != fs_slots_set(&slots, slot, m_shared->pending.data, m_shared->pending.len))
+		{
+			slotcheck_fail("set", slot);
+			return;
+		}
+		m_shared->acked[slot] = m_shared->pending;
+		m_shared->pending_slot = SLOTCHECK_NONE;
+	}
+}
+
+// The slots after a power cut
+static void run_check (void)
+{
+	fs_slots_t slots;
+	int32_t ret = fs_slots_init(&slots, ramflash_driver(), SLOTCHECK_PARTITION, 0);
+	if (0 != ret)
+	{
+		slotcheck_fail("init after cut", (uint32_t)ret);
+		return;
+	}
+	for (uint8_t slot = 0; slot < SLOTCHECK_SLOTS; slot++)
+	{
+		if (!slotcheck_equal(&slots, slot, &m_shared->acked[slot])
+		 && ((slot != m_shared->pending_slot) || !slotcheck_equal(&slots, slot, &m_shared->pending)))
+		{
+			slotcheck_fail("lost slot", slot);
+		}
+	}
+
+	// The store must go on working from here
+	slotcheck_value_t marker = { .len = FS_SLOTS_VALUE_SIZE };
+	memset(marker.data, SLOTCHECK_MARKER, sizeof(marker.data));
+	if (0 != fs_slots_set(&slots, 0, marker.data, marker.len))
+	{
+		slotcheck_fail("set after cut", 0);
+		return;
+	}
+	fs_slots_t again;
+	if ((0 != fs_slots_init(&again, ramflash_driver(), SLOTCHECK_PARTITION, 0))
+	 || !slotcheck_equal(&again, 0, &marker))
+	{
+		slotcheck_fail("set after cut not kept", 0);
+	}
+}
+
+// Run in a forked process, returns the exit status, -1 if killed
+static int slotcheck_run (void (*run)(void), uint32_t cut_op, uint32_t seed)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (0 == pid)
+	{
+		ramflash_power_cut(SLOTCHECK_PARTITION, cut_op, seed);
+		run();
+		fflush(stdout);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void slotcheck_reset (void)
+{
+	memset(ramflash_data(SLOTCHECK_PARTITION), 0xFF, 2 * m_erase_size);
+	memset(m_shared, 0, sizeof(slotcheck_shared_t));
+	for (uint8_t slot = 0; slot < SLOTCHECK_SLOTS; slot++)
+	{
+		m_shared->acked[slot].len = SLOTCHECK_NONE;
+	}
+	m_shared->pending_slot = SLOTCHECK_NONE;
+}
+
+// Cut the power at every operation of the sequence, returns the failures
+static uint32_t slotcheck_cuts (void)
+{
+	uint32_t failures = 0;
+	uint32_t cuts = 0;
+	uint32_t compaction_cuts = 0;
+	for (uint32_t op = 1; ; op++)
+	{
+		slotcheck_reset();
+		int status = slotcheck_run(run_sets, op, m_seed + op);
+		if (0 == status)
+		{
+			// The sequence has fewer operations
+			failures += m_shared->failures;
+			break;
+		}
+		if (RAMFLASH_POWER_CUT_STATUS != status)
+		{
+			printf("op %"PRIu32": sets exited with %d\n", op, status);
+			failures++;
+			continue;
+		}
+		cuts++;
+		if (m_shared->compacting)
+		{
+			compaction_cuts++;
+		}
+		if (0 != slotcheck_run(run_check, 0, 0))
+		{
+			printf("op %"PRIu32": check crashed\n", op);
+			failures++;
+		}
+		if (0 != m_shared->failures)
+		{
+			printf("op %"PRIu32": slot %u %s\n", op, (unsigned int)m_shared->pending_slot,
+			       m_shared->compacting ? "compacting" : "entry");
+			failures += m_shared->failures;
+		}
+	}
+	printf("power cuts %"PRIu32", %"PRIu32" during compaction\n", cuts, compaction_cuts);
+	if (0 == compaction_cuts)
+	{
+		printf("FAIL: no compaction was interrupted\n");
+		failures++;
+	}
+	return failures;
+}
+
+// Load the slots through failing reads, returns the failures
+static uint32_t slotcheck_read_errors (void)
+{
+	uint32_t failures = 0;
+	uint32_t errors = 0;
+	uint8_t * flash = ramflash_data(SLOTCHECK_PARTITION);
+	uint8_t * image = malloc(2 * m_erase_size);
+	fs_driver_t * driver = faultflash_driver(ramflash_driver());
+
+	slotcheck_reset();
+	if ((NULL == image) || (0 != slotcheck_run(run_sets, 0, 0)) || (0 != m_shared->failures))
+	{
+		printf("FAIL: sets without power cuts\n");
+		free(image);
+		return 1;
+	}
+	memcpy(image, flash, 2 * m_erase_size);
+
+	// The last run fails every read
+	for (uint32_t run = 0; run <= m_read_runs; run++)
+	{
+		faultflash_config_t config = { .read_fail_ppm = (run < m_read_runs) ? m_read_ppm : 1000000UL,
+		                               .seed = m_seed + run };
+		fs_slots_t slots;
+		faultflash_configure(&config);
+		int32_t ret = fs_slots_init(&slots, driver, SLOTCHECK_PARTITION, 0);
+		faultflash_configure(&(faultflash_config_t){ .seed = 1 });
+		if (0 != memcmp(image, flash, 2 * m_erase_size))
+		{
+			printf("run %"PRIu32": flash changed, init %"PRIi32"\n", run, ret);
+			memcpy(flash, image, 2 * m_erase_size);
+			failures++;
+		}
+		if (0 != ret)
+		{
+			errors++;
+			continue;
+		}
+		if (run == m_read_runs)
+		{
+			printf("FAIL: init succeeded without reads\n");
+			failures++;
+		}
+		for (uint8_t slot = 0; slot < SLOTCHECK_SLOTS; slot++)
+		{
+			if (!slotcheck_equal(&slots, slot, &m_shared->acked[slot]))
+			{
+				printf("run %"PRIu32": slot %u wrong\n", run, (unsigned int)slot);
+				failures++;
+			}
+		}
+	}
+	printf("read error runs %"PRIu32", init failed %"PRIu32"\n", m_read_runs + 1, errors);
+	free(image);
+	return failures;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-e erase_size] [-n sets] [-t read_runs] [-R read_fail_ppm] [-r seed]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "e:n:t:R:r:h")))
+	{
+		switch (opt)
+		{
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'n':
+				m_sets = strtoul(optarg, NULL, 0);
+			break;
+			case 't':
+				m_read_runs = strtoul(optarg, NULL, 0);
+			break;
+			case 'R':
+				m_read_ppm = strtoul(optarg, NULL, 0);
+			break;
+			case 'r':
+				m_seed = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (0 != ramflash_create(SLOTCHECK_PARTITION, 2 * m_erase_size, m_erase_size))
+	{
+		fprintf(stderr, "ramflash_create failed\n");
+		return 1;
+	}
+	m_shared = mmap(NULL, sizeof(slotcheck_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == m_shared)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	uint32_t failures = slotcheck_cuts();
+	failures += slotcheck_read_errors();
+	printf("failures %"PRIu32"\n", failures);
+	return (0 == failures) ? 0 : 1;
+}
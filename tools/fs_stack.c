@@ -0,0 +1,227 @@
+/**
+ * Filesystem stack usage report.
+ *
+ * Runs the worst-case filesystem paths on the RAM-backed flash and reports
+ * the peak stack usage of the fs thread, which runs queued record operations
+ * and their callbacks, and of the calling thread, which runs fs_start (mount
+ * and format) and the direct API. Every scenario runs in a forked process, so
+ * the watermarks are independent of each other.
+ *
+ * The numbers are measured on the host with the fs build configuration given
+ * to the Makefile, so they are indicative of the relative cost of the paths
+ * and configurations, a Cortex-M build uses less stack for the same code.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define STACK_FILE_COUNT  8
+#define STACK_RECORD_SIZE 200
+#define STACK_CHURN       4 // Write this many times the partition size to force GC
+
+typedef struct stack_scenario
+{
+	const char * name;
+	void (*run)(void);
+} stack_scenario_t;
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+
+static osThreadId_t m_app_thread;
+static uint8_t m_record[STACK_RECORD_SIZE];
+static uint8_t m_record_rd[STACK_RECORD_SIZE];
+
+static void record_done_cb (int32_t len, void * p_user)
+{
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+// Callback that uses the direct API from the fs thread, like applications do
+// when processing the result of a record operation.
+static void record_nested_cb (int32_t len, void * p_user)
+{
+	uint32_t total, used;
+	fs_stat st;
+	fs_info(0, &total, &used);
+	fs_fd fd = fs_open(0, "f00", FS_RDONLY);
+	if (fd >= 0)
+	{
+		fs_fstat(0, fd, &st);
+		fs_read(0, fd, m_record_rd, sizeof(m_record_rd));
+		fs_close(0, fd);
+	}
+	osThreadFlagsSet((osThreadId_t)p_user, 1);
+}
+
+static void start_fs (void)
+{
+	fs_init(0, 0, ramflash_driver());
+	fs_start();
+}
+
+static void record_write (const char * name, fs_rw_done_f cb)
+{
+	if (0 == fs_write_record(0, name, m_record, sizeof(m_record), 1, cb, m_app_thread))
+	{
+		fprintf(stderr, "record write failed\n");
+		exit(1);
+	}
+	osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+}
+
+static void scenario_format (void)
+{
+	start_fs();
+}
+
+static void scenario_direct_gc (void)
+{
+	char name[8];
+	start_fs();
+	for (uint32_t i = 0; i < STACK_CHURN * m_size / sizeof(m_record); i++)
+	{
+		snprintf(name, sizeof(name), "f%02u", (unsigned int)(i % STACK_FILE_COUNT));
+		fs_fd fd = fs_open(0, name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+		if (fd >= 0)
+		{
+			m_record[0] = (uint8_t)i;
+			fs_write(0, fd, m_record, sizeof(m_record));
+			fs_close(0, fd);
+		}
+	}
+}
+
+static void scenario_record_gc (void)
+{
+	char name[8];
+	start_fs();
+	for (uint32_t i = 0; i < STACK_CHURN * m_size / sizeof(m_record); i++)
+	{
+		snprintf(name, sizeof(name), "f%02u", (unsigned int)(i % STACK_FILE_COUNT));
+		m_record[0] = (uint8_t)i;
+		record_write(name, record_done_cb);
+	}
+}
+
+static void scenario_record_read (void)
+{
+	start_fs();
+	record_write("f00", record_done_cb);
+	for (int i = 0; i < 10; i++)
+	{
+		fs_read_record(0, "f00", m_record_rd, sizeof(m_record_rd), 1, record_done_cb, m_app_thread);
+		osThreadFlagsWait(1, osFlagsWaitAny, osWaitForever);
+	}
+}
+
+static void scenario_nested_callback (void)
+{
+	start_fs();
+	for (int i = 0; i < 10; i++)
+	{
+		record_write("f00", record_nested_cb);
+	}
+}
+
+static const stack_scenario_t m_scenarios[] = {
+	{ "mount-format",    scenario_format },
+	{ "direct-gc",       scenario_direct_gc },
+	{ "record-gc",       scenario_record_gc },
+	{ "record-read",     scenario_record_read },
+	{ "record-callback", scenario_nested_callback },
+};
+
+static void app_thread (void * arg)
+{
+	const stack_scenario_t * scenario = (const stack_scenario_t *)arg;
+	scenario->run();
+
+	uint32_t app_used = osThreadGetStackSize(m_app_thread) - osThreadGetStackSpace(m_app_thread);
+	uint32_t fs_free = fs_thread_stack_free();
+	uint32_t fs_used = (0 != fs_free) ? OS_HOST_STACK_SIZE - fs_free : 0;
+	printf("%-16s %10"PRIu32" %10"PRIu32"\n", scenario->name, app_used, fs_used);
+	fflush(stdout);
+	_exit(0);
+}
+
+static int run_scenario (const stack_scenario_t * scenario)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		return -1;
+	}
+	if (0 == pid)
+	{
+		if (0 != ramflash_create(0, m_size, m_erase_size))
+		{
+			fprintf(stderr, "ramflash_create failed\n");
+			_exit(1);
+		}
+		osKernelInitialize();
+		const osThreadAttr_t attr = { .name = "app" };
+		m_app_thread = osThreadNew(app_thread, (void *)scenario, &attr);
+		osKernelStart();
+		_exit(1);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || (0 != WEXITSTATUS(status)))
+	{
+		printf("%-16s %10s %10s\n", scenario->name, "FAILED", "FAILED");
+		return -1;
+	}
+	return 0;
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	printf("partition %"PRIu32" erase %"PRIu32"\n", m_size, m_erase_size);
+	printf("%-16s %10s %10s\n", "scenario", "app_stack", "fs_stack");
+	fflush(stdout);
+
+	int ret = 0;
+	for (unsigned int i = 0; i < sizeof(m_scenarios) / sizeof(m_scenarios[0]); i++)
+	{
+		if (0 != run_scenario(&m_scenarios[i]))
+		{
+			ret = 1;
+		}
+	}
+	return ret;
+}
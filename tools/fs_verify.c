@@ -0,0 +1,161 @@
+/**
+ * Write verify check.
+ *
+ * Runs file creation, overwrites, appends, deletes and enough churn to drive
+ * garbage collection with fs_write_verify enabled on the RAM-backed flash,
+ * which does not fail any operation. SPIFFS updates page flags by writing
+ * over already programmed bytes, so every one of these operations must pass
+ * the verify and, with FS_BAD_BLOCKS, no block may be replaced.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmsis_os2.h"
+#include "fs.h"
+#include "ramflash.h"
+
+#define VERIFY_FILE_COUNT  8
+#define VERIFY_RECORD_SIZE 200
+#define VERIFY_CHURN       4 // Write this many times the partition size to force GC
+
+static uint32_t m_size = 256UL * 1024UL;
+static uint32_t m_erase_size = 4096;
+
+static uint8_t m_data[VERIFY_RECORD_SIZE];
+static uint8_t m_data_rd[VERIFY_RECORD_SIZE];
+static uint32_t m_failures;
+
+static void verify_check (const char * what, const char * name, int32_t ret)
+{
+	if (ret < 0)
+	{
+		printf("%s %s: %"PRIi32"\n", what, name, ret);
+		m_failures++;
+	}
+}
+
+static void verify_file (const char * name, uint32_t i)
+{
+	memset(m_data, (uint8_t)i, sizeof(m_data));
+
+	// Create and write, the data pages are finalized
+	fs_fd fd = fs_open(0, (char *)name, FS_TRUNC | FS_CREAT | FS_WRONLY);
+	verify_check("create", name, fd);
+	if (fd < 0)
+	{
+		return;
+	}
+	verify_check("write", name, fs_write(0, fd, m_data, sizeof(m_data)));
+	fs_close(0, fd);
+
+	// Overwrite the middle, the replaced page is deleted
+	fd = fs_open(0, (char *)name, FS_RDWR);
+	verify_check("open", name, fd);
+	if (fd >= 0)
+	{
+		m_data[sizeof(m_data) / 2] ^= 0xFF;
+		verify_check("seek", name, fs_lseek(0, fd, sizeof(m_data) / 2, FS_SEEK_SET));
+		verify_check("overwrite", name, fs_write(0, fd, &m_data[sizeof(m_data) / 2], 1));
+		fs_close(0, fd);
+	}
+
+	// Append, the object index is updated
+	fd = fs_open(0, (char *)name, FS_APPEND | FS_WRONLY);
+	verify_check("open", name, fd);
+	if (fd >= 0)
+	{
+		verify_check("append", name, fs_write(0, fd, m_data, sizeof(m_data) / 4));
+		fs_close(0, fd);
+	}
+
+	fd = fs_open(0, (char *)name, FS_RDONLY);
+	verify_check("open", name, fd);
+	if (fd >= 0)
+	{
+		int32_t len = fs_read(0, fd, m_data_rd, sizeof(m_data_rd));
+		verify_check("read", name, len);
+		if ((len >= 0) && (0 != memcmp(m_data, m_data_rd, sizeof(m_data))))
+		{
+			printf("read %s: wrong data\n", name);
+			m_failures++;
+		}
+		fs_close(0, fd);
+	}
+}
+
+static void app_thread (void * arg)
+{
+	char name[8];
+	fs_init(0, 0, ramflash_driver());
+	fs_write_verify(0, true);
+	fs_start();
+
+	uint32_t rounds = VERIFY_CHURN * m_size / VERIFY_RECORD_SIZE;
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		snprintf(name, sizeof(name), "f%02u", (unsigned int)(i % VERIFY_FILE_COUNT));
+		verify_file(name, i);
+		// Delete every other file, the index and data pages are deleted
+		if (0 == i % 2)
+		{
+			fs_unlink(0, name);
+		}
+	}
+
+	ramflash_stats_t stats;
+	ramflash_get_stats(0, &stats);
+	printf("rounds %"PRIu32" programs %"PRIu32" erases %"PRIu32" failures %"PRIu32"\n",
+	       rounds, stats.programs, stats.erases, m_failures);
+#ifdef FS_BAD_BLOCKS
+	uint32_t bad = fs_bad_block_count(0);
+	printf("replaced blocks %"PRIu32"\n", bad);
+	if (0 != bad)
+	{
+		m_failures++;
+	}
+#endif//FS_BAD_BLOCKS
+	fflush(stdout);
+	_exit((0 == m_failures) ? 0 : 1);
+}
+
+static void usage (const char * name)
+{
+	fprintf(stderr, "usage: %s [-s partition_size] [-e erase_size]\n", name);
+}
+
+int main (int argc, char * argv[])
+{
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:e:h")))
+	{
+		switch (opt)
+		{
+			case 's':
+				m_size = strtoul(optarg, NULL, 0);
+			break;
+			case 'e':
+				m_erase_size = strtoul(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (0 != ramflash_create(0, m_size, m_erase_size))
+	{
+		fprintf(stderr, "ramflash_create failed\n");
+		return 1;
+	}
+	osKernelInitialize();
+	const osThreadAttr_t attr = { .name = "app" };
+	osThreadNew(app_thread, NULL, &attr);
+	osKernelStart();
+	return 1;
+}
@@ -0,0 +1,644 @@
+/**
+ * Host stand-in for the subset of CMSIS-RTOS2 used by the filesystem.
+ *
+ * Threads are pthreads, thread flags and message queues use a mutex and
+ * condition variable each, timers are served by a single timer thread.
+ * Timer callbacks run in the timer thread like in the CMSIS-FreeRTOS daemon.
+ * Threads created before osKernelStart only run once it has been called.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#define _GNU_SOURCE
+#include "cmsis_os2.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OS_HOST_STACK_PAINT 0xA5
+
+typedef struct os_thread
+{
+	pthread_t       thread;
+	osThreadFunc_t  func;
+	void *          argument;
+	uint8_t *       stack;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	uint32_t        flags;
+} os_thread_t;
+
+typedef struct os_timer
+{
+	struct os_timer * next;
+	osTimerFunc_t     func;
+	void *            argument;
+	osTimerType_t     type;
+	uint32_t          period;
+	uint64_t          deadline;
+	bool              running;
+} os_timer_t;
+
+typedef struct os_queue
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	uint32_t        msg_count;
+	uint32_t        msg_size;
+	uint32_t        count;
+	uint8_t *       prios;
+	uint8_t *       msgs;
+} os_queue_t;
+
+static __thread os_thread_t * m_current;
+
+static pthread_mutex_t m_kernel_lock;
+static __thread int32_t m_kernel_lock_depth;
+static pthread_once_t m_kernel_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t m_timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_timer_cond;
+static os_timer_t * m_timers;
+static bool m_timer_thread_started;
+
+static osKernelState_t m_kernel_state = osKernelInactive;
+// Threads created before osKernelStart wait here, like they do on the target
+static pthread_mutex_t m_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_start_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t os_now_ms (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Absolute CLOCK_MONOTONIC time after the specified number of ticks
+static struct timespec os_deadline (uint32_t ticks)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ticks / 1000;
+	ts.tv_nsec += (long)(ticks % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+static void os_cond_init (pthread_cond_t * cond)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void os_kernel_init_once (void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m_kernel_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	os_cond_init(&m_timer_cond);
+}
+
+osStatus_t osKernelInitialize (void)
+{
+	pthread_once(&m_kernel_once, os_kernel_init_once);
+	m_kernel_state = osKernelReady;
+	return osOK;
+}
+
+osKernelState_t osKernelGetState (void)
+{
+	return m_kernel_state;
+}
+
+osStatus_t osKernelStart (void)
+{
+	pthread_mutex_lock(&m_start_mutex);
+	m_kernel_state = osKernelRunning;
+	pthread_cond_broadcast(&m_start_cond);
+	pthread_mutex_unlock(&m_start_mutex);
+	// The threads run now, the caller becomes idle
+	for (;;)
+	{
+		pause();
+	}
+	return osOK;
+}
+
+int32_t osKernelLock (void)
+{
+	pthread_once(&m_kernel_once, os_kernel_init_once);
+	pthread_mutex_lock(&m_kernel_lock);
+	m_kernel_lock_depth++;
+	return (m_kernel_lock_depth > 1) ? 1 : 0;
+}
+
+int32_t osKernelUnlock (void)
+{
+	int32_t prev = (m_kernel_lock_depth > 0) ? 1 : 0;
+	while (m_kernel_lock_depth > 0)
+	{
+		m_kernel_lock_depth--;
+		pthread_mutex_unlock(&m_kernel_lock);
+	}
+	return prev;
+}
+
+int32_t osKernelRestoreLock (int32_t lock)
+{
+	if ((0 == lock) && (m_kernel_lock_depth > 0))
+	{
+		m_kernel_lock_depth--;
+		pthread_mutex_unlock(&m_kernel_lock);
+	}
+	return lock;
+}
+
+uint32_t osKernelGetTickCount (void)
+{
+	return (uint32_t)os_now_ms();
+}
+
+uint32_t osKernelGetTickFreq (void)
+{
+	return 1000;
+}
+
+static void * os_thread_main (void * arg)
+{
+	os_thread_t * t = (os_thread_t *)arg;
+	m_current = t;
+	pthread_mutex_lock(&m_start_mutex);
+	while (osKernelRunning != m_kernel_state)
+	{
+		pthread_cond_wait(&m_start_cond, &m_start_mutex);
+	}
+	pthread_mutex_unlock(&m_start_mutex);
+	t->func(t->argument);
+	return NULL;
+}
+
+osThreadId_t osThreadNew (osThreadFunc_t func, void *argument, const osThreadAttr_t *attr)
+{
+	(void)attr;
+	pthread_once(&m_kernel_once, os_kernel_init_once);
+
+	os_thread_t * t = calloc(1, sizeof(os_thread_t));
+	if (NULL == t)
+	{
+		return NULL;
+	}
+	t->func = func;
+	t->argument = argument;
+	pthread_mutex_init(&t->mutex, NULL);
+	os_cond_init(&t->cond);
+
+	if (0 != posix_memalign((void **)&t->stack, 4096, OS_HOST_STACK_SIZE))
+	{
+		free(t);
+		return NULL;
+	}
+	memset(t->stack, OS_HOST_STACK_PAINT, OS_HOST_STACK_SIZE);
+
+	pthread_attr_t pattr;
+	pthread_attr_init(&pattr);
+	pthread_attr_setstack(&pattr, t->stack, OS_HOST_STACK_SIZE);
+	pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
+	int ret = pthread_create(&t->thread, &pattr, os_thread_main, t);
+	pthread_attr_destroy(&pattr);
+	if (0 != ret)
+	{
+		free(t->stack);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+osThreadId_t osThreadGetId (void)
+{
+	return m_current;
+}
+
+uint32_t osThreadGetStackSize (osThreadId_t thread_id)
+{
+	return (NULL != thread_id) ? OS_HOST_STACK_SIZE : 0;
+}
+
+uint32_t osThreadGetStackSpace (osThreadId_t thread_id)
+{
+	os_thread_t * t = (os_thread_t *)thread_id;
+	if (NULL == t)
+	{
+		return 0;
+	}
+	// Stack grows down, count untouched bytes from the bottom
+	uint32_t space = 0;
+	while ((space < OS_HOST_STACK_SIZE) && (OS_HOST_STACK_PAINT == t->stack[space]))
+	{
+		space++;
+	}
+	return space;
+}
+
+uint32_t osThreadFlagsSet (osThreadId_t thread_id, uint32_t flags)
+{
+	os_thread_t * t = (os_thread_t *)thread_id;
+	if ((NULL == t) || (flags & osFlagsError))
+	{
+		return osFlagsErrorParameter;
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->flags |= flags;
+	uint32_t ret = t->flags;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->mutex);
+	return ret;
+}
+
+uint32_t osThreadFlagsClear (uint32_t flags)
+{
+	os_thread_t * t = m_current;
+	if (NULL == t)
+	{
+		return osFlagsErrorUnknown;
+	}
+	pthread_mutex_lock(&t->mutex);
+	uint32_t ret = t->flags;
+	t->flags &= ~flags;
+	pthread_mutex_unlock(&t->mutex);
+	return ret;
+}
+
+uint32_t osThreadFlagsWait (uint32_t flags, uint32_t options, uint32_t timeout)
+{
+	os_thread_t * t = m_current;
+	if (NULL == t)
+	{
+		return osFlagsErrorUnknown;
+	}
+	struct timespec deadline = os_deadline(timeout);
+	uint32_t ret;
+
+	pthread_mutex_lock(&t->mutex);
+	for (;;)
+	{
+		uint32_t match = t->flags & flags;
+		bool done = (options & osFlagsWaitAll) ? (match == flags) : (0 != match);
+		if (done)
+		{
+			ret = t->flags;
+			if (0 == (options & osFlagsNoClear))
+			{
+				t->flags &= ~flags;
+			}
+			break;
+		}
+		if (0 == timeout)
+		{
+			ret = osFlagsErrorResource;
+			break;
+		}
+		if (osWaitForever == timeout)
+		{
+			pthread_cond_wait(&t->cond, &t->mutex);
+		}
+		else if (ETIMEDOUT == pthread_cond_timedwait(&t->cond, &t->mutex, &deadline))
+		{
+			ret = osFlagsErrorTimeout;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->mutex);
+	return ret;
+}
+
+osStatus_t osDelay (uint32_t ticks)
+{
+	struct timespec deadline = os_deadline(ticks);
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL));
+	return osOK;
+}
+
+static void * os_timer_thread (void * arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&m_timer_mutex);
+	for (;;)
+	{
+		uint64_t now = os_now_ms();
+		uint64_t next = UINT64_MAX;
+		os_timer_t * expired = NULL;
+
+		for (os_timer_t * t = m_timers; NULL != t; t = t->next)
+		{
+			if (t->running)
+			{
+				if (t->deadline <= now)
+				{
+					expired = t;
+					break;
+				}
+				if (t->deadline < next)
+				{
+					next = t->deadline;
+				}
+			}
+		}
+
+		if (NULL != expired)
+		{
+			if (osTimerPeriodic == expired->type)
+			{
+				expired->deadline += expired->period;
+			}
+			else
+			{
+				expired->running = false;
+			}
+			// Callback may start or stop timers
+			pthread_mutex_unlock(&m_timer_mutex);
+			expired->func(expired->argument);
+			pthread_mutex_lock(&m_timer_mutex);
+		}
+		else if (UINT64_MAX == next)
+		{
+			pthread_cond_wait(&m_timer_cond, &m_timer_mutex);
+		}
+		else
+		{
+			struct timespec deadline = os_deadline((uint32_t)(next - now));
+			pthread_cond_timedwait(&m_timer_cond, &m_timer_mutex, &deadline);
+		}
+	}
+	return NULL;
+}
+
+osTimerId_t osTimerNew (osTimerFunc_t func, osTimerType_t type, void *argument, const osTimerAttr_t *attr)
+{
+	(void)attr;
+	pthread_once(&m_kernel_once, os_kernel_init_once);
+
+	os_timer_t * t = calloc(1, sizeof(os_timer_t));
+	if (NULL == t)
+	{
+		return NULL;
+	}
+	t->func = func;
+	t->type = type;
+	t->argument = argument;
+
+	pthread_mutex_lock(&m_timer_mutex);
+	if (!m_timer_thread_started)
+	{
+		pthread_t thread;
+		if (0 != pthread_create(&thread, NULL, os_timer_thread, NULL))
+		{
+			pthread_mutex_unlock(&m_timer_mutex);
+			free(t);
+			return NULL;
+		}
+		pthread_detach(thread);
+		m_timer_thread_started = true;
+	}
+	t->next = m_timers;
+	m_timers = t;
+	pthread_mutex_unlock(&m_timer_mutex);
+	return t;
+}
+
+osStatus_t osTimerStart (osTimerId_t timer_id, uint32_t ticks)
+{
+	os_timer_t * t = (os_timer_t *)timer_id;
+	if ((NULL == t) || (0 == ticks))
+	{
+		return osErrorParameter;
+	}
+	pthread_mutex_lock(&m_timer_mutex);
+	t->period = ticks;
+	t->deadline = os_now_ms() + ticks;
+	t->running = true;
+	pthread_cond_broadcast(&m_timer_cond);
+	pthread_mutex_unlock(&m_timer_mutex);
+	return osOK;
+}
+
+osStatus_t osTimerStop (osTimerId_t timer_id)
+{
+	os_timer_t * t = (os_timer_t *)timer_id;
+	if (NULL == t)
+	{
+		return osErrorParameter;
+	}
+	pthread_mutex_lock(&m_timer_mutex);
+	bool running = t->running;
+	t->running = false;
+	pthread_mutex_unlock(&m_timer_mutex);
+	return running ? osOK : osErrorResource;
+}
+
+uint32_t osTimerIsRunning (osTimerId_t timer_id)
+{
+	os_timer_t * t = (os_timer_t *)timer_id;
+	return (NULL != t) && t->running;
+}
+
+osMutexId_t osMutexNew (const osMutexAttr_t *attr)
+{
+	pthread_mutex_t * m = malloc(sizeof(pthread_mutex_t));
+	if (NULL == m)
+	{
+		return NULL;
+	}
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init(&mattr);
+	if ((NULL != attr) && (attr->attr_bits & osMutexRecursive))
+	{
+		pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	}
+	pthread_mutex_init(m, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	return m;
+}
+
+osStatus_t osMutexAcquire (osMutexId_t mutex_id, uint32_t timeout)
+{
+	pthread_mutex_t * m = (pthread_mutex_t *)mutex_id;
+	if (NULL == m)
+	{
+		return osErrorParameter;
+	}
+	if (osWaitForever == timeout)
+	{
+		return (0 == pthread_mutex_lock(m)) ? osOK : osError;
+	}
+	if (0 == timeout)
+	{
+		return (0 == pthread_mutex_trylock(m)) ? osOK : osErrorResource;
+	}
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (long)(timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	return (0 == pthread_mutex_timedlock(m, &deadline)) ? osOK : osErrorTimeout;
+}
+
+osStatus_t osMutexRelease (osMutexId_t mutex_id)
+{
+	pthread_mutex_t * m = (pthread_mutex_t *)mutex_id;
+	if (NULL == m)
+	{
+		return osErrorParameter;
+	}
+	return (0 == pthread_mutex_unlock(m)) ? osOK : osErrorResource;
+}
+
+osMessageQueueId_t osMessageQueueNew (uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr)
+{
+	(void)attr;
+	if ((0 == msg_count) || (0 == msg_size))
+	{
+		return NULL;
+	}
+	os_queue_t * q = calloc(1, sizeof(os_queue_t));
+	if (NULL == q)
+	{
+		return NULL;
+	}
+	q->msg_count = msg_count;
+	q->msg_size = msg_size;
+	q->prios = calloc(msg_count, 1);
+	q->msgs = calloc(msg_count, msg_size);
+	if ((NULL == q->prios) || (NULL == q->msgs))
+	{
+		free(q->prios);
+		free(q->msgs);
+		free(q);
+		return NULL;
+	}
+	pthread_mutex_init(&q->mutex, NULL);
+	os_cond_init(&q->cond);
+	return q;
+}
+
+osStatus_t osMessageQueuePut (osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout)
+{
+	os_queue_t * q = (os_queue_t *)mq_id;
+	if ((NULL == q) || (NULL == msg_ptr))
+	{
+		return osErrorParameter;
+	}
+	struct timespec deadline = os_deadline(timeout);
+	osStatus_t ret = osOK;
+
+	pthread_mutex_lock(&q->mutex);
+	while (q->count >= q->msg_count)
+	{
+		if (0 == timeout)
+		{
+			ret = osErrorResource;
+			break;
+		}
+		if (osWaitForever == timeout)
+		{
+			pthread_cond_wait(&q->cond, &q->mutex);
+		}
+		else if (ETIMEDOUT == pthread_cond_timedwait(&q->cond, &q->mutex, &deadline))
+		{
+			ret = osErrorTimeout;
+			break;
+		}
+	}
+	if (osOK == ret)
+	{
+		// Keep the queue sorted by priority, FIFO within the same priority
+		uint32_t pos = q->count;
+		while ((pos > 0) && (q->prios[pos - 1] < msg_prio))
+		{
+			pos--;
+		}
+		memmove(&q->msgs[(pos + 1) * q->msg_size], &q->msgs[pos * q->msg_size], (q->count - pos) * q->msg_size);
+		memmove(&q->prios[pos + 1], &q->prios[pos], q->count - pos);
+		memcpy(&q->msgs[pos * q->msg_size], msg_ptr, q->msg_size);
+		q->prios[pos] = msg_prio;
+		q->count++;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return ret;
+}
+
+osStatus_t osMessageQueueGet (osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout)
+{
+	os_queue_t * q = (os_queue_t *)mq_id;
+	if ((NULL == q) || (NULL == msg_ptr))
+	{
+		return osErrorParameter;
+	}
+	struct timespec deadline = os_deadline(timeout);
+	osStatus_t ret = osOK;
+
+	pthread_mutex_lock(&q->mutex);
+	while (0 == q->count)
+	{
+		if (0 == timeout)
+		{
+			ret = osErrorResource;
+			break;
+		}
+		if (osWaitForever == timeout)
+		{
+			pthread_cond_wait(&q->cond, &q->mutex);
+		}
+		else if (ETIMEDOUT == pthread_cond_timedwait(&q->cond, &q->mutex, &deadline))
+		{
+			ret = osErrorTimeout;
+			break;
+		}
+	}
+	if (osOK == ret)
+	{
+		memcpy(msg_ptr, q->msgs, q->msg_size);
+		if (NULL != msg_prio)
+		{
+			*msg_prio = q->prios[0];
+		}
+		q->count--;
+		memmove(q->msgs, &q->msgs[q->msg_size], q->count * q->msg_size);
+		memmove(q->prios, &q->prios[1], q->count);
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return ret;
+}
+
+uint32_t osMessageQueueGetCount (osMessageQueueId_t mq_id)
+{
+	os_queue_t * q = (os_queue_t *)mq_id;
+	if (NULL == q)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&q->mutex);
+	uint32_t count = q->count;
+	pthread_mutex_unlock(&q->mutex);
+	return count;
+}
@@ -0,0 +1,162 @@
+/**
+ * Host stand-in for the subset of CMSIS-RTOS2 used by the filesystem,
+ * implemented with pthreads. Only meant for running fs.c on a Linux host
+ * for tools, benchmarks and tests, not a complete RTOS emulation.
+ *
+ * One tick is one millisecond. Every thread gets a stack of OS_HOST_STACK_SIZE
+ * bytes regardless of the requested size, the stack is painted so the
+ * watermark can be reported by osThreadGetStackSpace.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef CMSIS_OS2_H_
+#define CMSIS_OS2_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OS_HOST_STACK_SIZE (256U * 1024U)
+
+#define osWaitForever       0xFFFFFFFFU
+
+#define osFlagsWaitAny      0x00000000U
+#define osFlagsWaitAll      0x00000001U
+#define osFlagsNoClear      0x00000002U
+
+#define osFlagsError          0x80000000U
+#define osFlagsErrorUnknown   0xFFFFFFFFU
+#define osFlagsErrorTimeout   0xFFFFFFFEU
+#define osFlagsErrorResource  0xFFFFFFFDU
+#define osFlagsErrorParameter 0xFFFFFFFCU
+
+#define osMutexRecursive    0x00000001U
+#define osMutexPrioInherit  0x00000002U
+#define osMutexRobust       0x00000008U
+
+typedef enum
+{
+	osOK                  =  0,
+	osError               = -1,
+	osErrorTimeout        = -2,
+	osErrorResource       = -3,
+	osErrorParameter      = -4,
+	osErrorNoMemory       = -5,
+	osErrorISR            = -6,
+	osStatusReserved      = 0x7FFFFFFF
+} osStatus_t;
+
+typedef enum
+{
+	osKernelInactive      =  0,
+	osKernelReady         =  1,
+	osKernelRunning       =  2,
+	osKernelLocked        =  3,
+	osKernelSuspended     =  4,
+	osKernelError         = -1,
+	osKernelReserved      = 0x7FFFFFFF
+} osKernelState_t;
+
+typedef enum
+{
+	osPriorityNone        =  0,
+	osPriorityIdle        =  1,
+	osPriorityLow         =  8,
+	osPriorityBelowNormal = 16,
+	osPriorityNormal      = 24,
+	osPriorityAboveNormal = 32,
+	osPriorityHigh        = 40,
+	osPriorityRealtime    = 48,
+	osPriorityISR         = 56,
+	osPriorityError       = -1,
+	osPriorityReserved    = 0x7FFFFFFF
+} osPriority_t;
+
+typedef enum
+{
+	osTimerOnce           = 0,
+	osTimerPeriodic       = 1
+} osTimerType_t;
+
+typedef void *osThreadId_t;
+typedef void *osTimerId_t;
+typedef void *osMutexId_t;
+typedef void *osMessageQueueId_t;
+
+typedef void (*osThreadFunc_t) (void *argument);
+typedef void (*osTimerFunc_t) (void *argument);
+
+typedef struct
+{
+	const char *  name;
+	uint32_t      attr_bits;
+	void *        cb_mem;
+	uint32_t      cb_size;
+	void *        stack_mem;
+	uint32_t      stack_size;
+	osPriority_t  priority;
+	uint32_t      tz_module;
+	uint32_t      reserved;
+} osThreadAttr_t;
+
+typedef struct
+{
+	const char *  name;
+	uint32_t      attr_bits;
+	void *        cb_mem;
+	uint32_t      cb_size;
+} osTimerAttr_t;
+
+typedef struct
+{
+	const char *  name;
+	uint32_t      attr_bits;
+	void *        cb_mem;
+	uint32_t      cb_size;
+} osMutexAttr_t;
+
+typedef struct
+{
+	const char *  name;
+	uint32_t      attr_bits;
+	void *        cb_mem;
+	uint32_t      cb_size;
+	void *        mq_mem;
+	uint32_t      mq_size;
+} osMessageQueueAttr_t;
+
+osStatus_t osKernelInitialize (void);
+osKernelState_t osKernelGetState (void);
+osStatus_t osKernelStart (void);
+int32_t osKernelLock (void);
+int32_t osKernelUnlock (void);
+int32_t osKernelRestoreLock (int32_t lock);
+uint32_t osKernelGetTickCount (void);
+uint32_t osKernelGetTickFreq (void);
+
+osThreadId_t osThreadNew (osThreadFunc_t func, void *argument, const osThreadAttr_t *attr);
+osThreadId_t osThreadGetId (void);
+uint32_t osThreadGetStackSize (osThreadId_t thread_id);
+uint32_t osThreadGetStackSpace (osThreadId_t thread_id);
+
+uint32_t osThreadFlagsSet (osThreadId_t thread_id, uint32_t flags);
+uint32_t osThreadFlagsClear (uint32_t flags);
+uint32_t osThreadFlagsWait (uint32_t flags, uint32_t options, uint32_t timeout);
+
+osStatus_t osDelay (uint32_t ticks);
+
+osTimerId_t osTimerNew (osTimerFunc_t func, osTimerType_t type, void *argument, const osTimerAttr_t *attr);
+osStatus_t osTimerStart (osTimerId_t timer_id, uint32_t ticks);
+osStatus_t osTimerStop (osTimerId_t timer_id);
+uint32_t osTimerIsRunning (osTimerId_t timer_id);
+
+osMutexId_t osMutexNew (const osMutexAttr_t *attr);
+osStatus_t osMutexAcquire (osMutexId_t mutex_id, uint32_t timeout);
+osStatus_t osMutexRelease (osMutexId_t mutex_id);
+
+osMessageQueueId_t osMessageQueueNew (uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr);
+osStatus_t osMessageQueuePut (osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout);
+osStatus_t osMessageQueueGet (osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout);
+uint32_t osMessageQueueGetCount (osMessageQueueId_t mq_id);
+
+#endif//CMSIS_OS2_H_
@@ -0,0 +1,41 @@
+/**
+ * Host stand-in for the LowLevelLogging macros. Logging is compiled out
+ * unless HOST_LOGGING is defined, then messages of enabled levels are
+ * printed to stderr. Keeping printf out of the fs paths also keeps the
+ * host stack measurements closer to a device build without logging.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdio.h>
+
+#define LOG_LEVEL_ERROR  0x0001
+#define LOG_LEVEL_WARN   0x0002
+#define LOG_LEVEL_INFO   0x0004
+#define LOG_LEVEL_DEBUG  0x00FF
+
+#define LOG_ERR1    0x0001
+#define LOG_WARN1   0x0002
+#define LOG_INFO1   0x0004
+#define LOG_DEBUG1  0x0008
+#define LOG_DEBUG2  0x0010
+
+#ifdef __LOG_LEVEL__
+#ifdef HOST_LOGGING
+#define logger(level, fmt, ...) do { if (__LOG_LEVEL__ & (level)) { \
+	fprintf(stderr, "%s: " fmt "\n", __MODUUL__, ##__VA_ARGS__); } } while (0)
+#else
+#define logger(level, fmt, ...) do { if (0) { printf(fmt, ##__VA_ARGS__); } } while (0)
+#endif//HOST_LOGGING
+
+#define err1(fmt, ...)   logger(LOG_ERR1, fmt, ##__VA_ARGS__)
+#define warn1(fmt, ...)  logger(LOG_WARN1, fmt, ##__VA_ARGS__)
+#define info1(fmt, ...)  logger(LOG_INFO1, fmt, ##__VA_ARGS__)
+#define debug1(fmt, ...) logger(LOG_DEBUG1, fmt, ##__VA_ARGS__)
+#define debug2(fmt, ...) logger(LOG_DEBUG2, fmt, ##__VA_ARGS__)
+#endif//__LOG_LEVEL__
+
+#endif//_LOG_H_
@@ -0,0 +1,10 @@
+#ifndef _LOGLEVELS_H_
+#define _LOGLEVELS_H_
+
+#define LOG_LEVEL_fs                    0xFFFF
+
+#ifndef BASE_LOG_LEVEL
+#define BASE_LOG_LEVEL                  0xFFFF
+#endif
+
+#endif
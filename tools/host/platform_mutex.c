@@ -0,0 +1,24 @@
+/**
+ * Host stand-in for the node-platform mutex.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include "platform_mutex.h"
+#include "cmsis_os2.h"
+
+platform_mutex_t platform_mutex_new (const char * name)
+{
+	const osMutexAttr_t attr = { .name = name, .attr_bits = osMutexRecursive | osMutexPrioInherit };
+	return osMutexNew(&attr);
+}
+
+void platform_mutex_acquire (platform_mutex_t mutex)
+{
+	osMutexAcquire(mutex, osWaitForever);
+}
+
+void platform_mutex_release (platform_mutex_t mutex)
+{
+	osMutexRelease(mutex);
+}
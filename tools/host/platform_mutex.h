@@ -0,0 +1,19 @@
+/**
+ * Host stand-in for the node-platform mutex, backed by the host CMSIS-RTOS2
+ * mutex like the device implementation.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef PLATFORM_MUTEX_H_
+#define PLATFORM_MUTEX_H_
+
+typedef void * platform_mutex_t;
+
+platform_mutex_t platform_mutex_new (const char * name);
+
+void platform_mutex_acquire (platform_mutex_t mutex);
+
+void platform_mutex_release (platform_mutex_t mutex);
+
+#endif//PLATFORM_MUTEX_H_
@@ -0,0 +1,11 @@
+/**
+ * Host stand-in for the node-platform spi_flash, the host tools use the
+ * RAM-backed flash driver instead.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef SPI_FLASH_H_
+#define SPI_FLASH_H_
+
+#endif//SPI_FLASH_H_
@@ -0,0 +1,16 @@
+/**
+ * Host stand-in for the node-platform sys_panic, aborts the process.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include "sys_panic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void sys_panic (const char * msg)
+{
+	fprintf(stderr, "PANIC: %s\n", msg);
+	abort();
+}
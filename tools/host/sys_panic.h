@@ -0,0 +1,12 @@
+/**
+ * Host stand-in for the node-platform sys_panic.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef SYS_PANIC_H_
+#define SYS_PANIC_H_
+
+void sys_panic (const char * msg) __attribute__((noreturn));
+
+#endif//SYS_PANIC_H_
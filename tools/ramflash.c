@@ -0,0 +1,291 @@
+/**
+ * RAM-backed simulated NOR flash.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#include "ramflash.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct ramflash_partition
+{
+	uint8_t *        data;
+	uint32_t         size;
+	uint32_t         erase_size;
+	ramflash_stats_t stats;
+	uint32_t         cut_countdown;
+	unsigned int     cut_seed;
+} ramflash_partition_t;
+
+// Partition descriptors are also kept in shared memory so the counters
+// updated by a forked child are visible to the parent.
+static ramflash_partition_t * m_partitions[RAMFLASH_MAX_PARTITIONS];
+
+static ramflash_timing_t m_timing = {
+	.op_ns = 10000,
+	.read_ns = 1000,
+	.program_ns = 4000,
+	.erase_us = 50000,
+};
+
+static pthread_mutex_t m_lock;
+static pthread_once_t m_lock_once = PTHREAD_ONCE_INIT;
+
+static void ramflash_lock_init (void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void * ramflash_shared_alloc (size_t size)
+{
+	void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return (MAP_FAILED == p) ? NULL : p;
+}
+
+static ramflash_partition_t * ramflash_get (int partition)
+{
+	if ((partition < 0) || (partition >= RAMFLASH_MAX_PARTITIONS))
+	{
+		return NULL;
+	}
+	return m_partitions[partition];
+}
+
+int ramflash_create (int partition, uint32_t size, uint32_t erase_size)
+{
+	if ((partition < 0) || (partition >= RAMFLASH_MAX_PARTITIONS)
+	 || (0 == erase_size) || (0 == size) || (0 != (size % erase_size)))
+	{
+		return -1;
+	}
+	ramflash_destroy(partition);
+
+	ramflash_partition_t * p = ramflash_shared_alloc(sizeof(ramflash_partition_t));
+	if (NULL == p)
+	{
+		return -1;
+	}
+	p->data = ramflash_shared_alloc(size);
+	if (NULL == p->data)
+	{
+		munmap(p, sizeof(ramflash_partition_t));
+		return -1;
+	}
+	p->size = size;
+	p->erase_size = erase_size;
+	memset(p->data, 0xFF, size);
+	memset(&p->stats, 0, sizeof(p->stats));
+	p->cut_countdown = 0;
+	m_partitions[partition] = p;
+	return 0;
+}
+
+void ramflash_destroy (int partition)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if (NULL != p)
+	{
+		munmap(p->data, p->size);
+		munmap(p, sizeof(ramflash_partition_t));
+		m_partitions[partition] = NULL;
+	}
+}
+
+uint8_t * ramflash_data (int partition)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	return (NULL != p) ? p->data : NULL;
+}
+
+void ramflash_get_stats (int partition, ramflash_stats_t * p_stats)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if (NULL != p)
+	{
+		*p_stats = p->stats;
+	}
+	else
+	{
+		memset(p_stats, 0, sizeof(ramflash_stats_t));
+	}
+}
+
+void ramflash_reset_stats (int partition)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if (NULL != p)
+	{
+		memset(&p->stats, 0, sizeof(p->stats));
+	}
+}
+
+void ramflash_set_timing (const ramflash_timing_t * p_timing)
+{
+	m_timing = *p_timing;
+}
+
+void ramflash_get_timing (ramflash_timing_t * p_timing)
+{
+	*p_timing = m_timing;
+}
+
+uint64_t ramflash_stats_time_us (const ramflash_stats_t * p_stats)
+{
+	uint64_t ns = (uint64_t)(p_stats->reads + p_stats->programs + p_stats->erases) * m_timing.op_ns
+	            + (uint64_t)p_stats->read_bytes * m_timing.read_ns
+	            + (uint64_t)p_stats->program_bytes * m_timing.program_ns;
+	return ns / 1000 + (uint64_t)p_stats->erases * m_timing.erase_us;
+}
+
+void ramflash_stats_diff (const ramflash_stats_t * p_after, const ramflash_stats_t * p_before, ramflash_stats_t * p_diff)
+{
+	p_diff->reads = p_after->reads - p_before->reads;
+	p_diff->read_bytes = p_after->read_bytes - p_before->read_bytes;
+	p_diff->programs = p_after->programs - p_before->programs;
+	p_diff->program_bytes = p_after->program_bytes - p_before->program_bytes;
+	p_diff->erases = p_after->erases - p_before->erases;
+	p_diff->erase_bytes = p_after->erase_bytes - p_before->erase_bytes;
+	p_diff->suspends = p_after->suspends - p_before->suspends;
+}
+
+void ramflash_power_cut (int partition, uint32_t op, uint32_t seed)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if (NULL != p)
+	{
+		p->cut_countdown = op;
+		p->cut_seed = seed;
+	}
+}
+
+// Check if the power is cut during this operation, returns the number of
+// bytes of the operation that are carried out.
+static uint32_t ramflash_cut_point (ramflash_partition_t * p, uint32_t size)
+{
+	if ((0 == p->cut_countdown) || (0 == size) || (0 != --p->cut_countdown))
+	{
+		return size;
+	}
+	return (uint32_t)rand_r(&p->cut_seed) % size;
+}
+
+static void ramflash_power_off (void)
+{
+	_exit(RAMFLASH_POWER_CUT_STATUS);
+}
+
+static int32_t ramflash_read (int partition, uint32_t addr, uint32_t size, uint8_t * dst)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if ((NULL == p) || (addr > p->size) || (size > p->size - addr))
+	{
+		return -1;
+	}
+	memcpy(dst, &p->data[addr], size);
+	p->stats.reads++;
+	p->stats.read_bytes += size;
+	return size;
+}
+
+static int32_t ramflash_write (int partition, uint32_t addr, uint32_t size, uint8_t * src)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if ((NULL == p) || (addr > p->size) || (size > p->size - addr))
+	{
+		return -1;
+	}
+	// NOR programming can only clear bits
+	uint32_t done = ramflash_cut_point(p, size);
+	for (uint32_t i = 0; i < done; i++)
+	{
+		p->data[addr + i] &= src[i];
+	}
+	if (done < size)
+	{
+		// The byte being programmed gets some of its bits
+		p->data[addr + done] &= src[done] | (uint8_t)rand_r(&p->cut_seed);
+		ramflash_power_off();
+	}
+	p->stats.programs++;
+	p->stats.program_bytes += size;
+	return size;
+}
+
+static int32_t ramflash_erase (int partition, uint32_t addr, uint32_t size)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	if ((NULL == p) || (addr > p->size) || (size > p->size - addr)
+	 || (0 != (addr % p->erase_size)) || (0 != (size % p->erase_size)))
+	{
+		return -1;
+	}
+	uint32_t done = ramflash_cut_point(p, size);
+	memset(&p->data[addr], 0xFF, done);
+	if (done < size)
+	{
+		ramflash_power_off();
+	}
+	p->stats.erases += size / p->erase_size;
+	p->stats.erase_bytes += size;
+	return size;
+}
+
+static int32_t ramflash_size (int partition)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	return (NULL != p) ? (int32_t)p->size : -1;
+}
+
+static int32_t ramflash_erase_size (int partition)
+{
+	ramflash_partition_t * p = ramflash_get(partition);
+	return (NULL != p) ? (int32_t)p->erase_size : -1;
+}
+
+static void ramflash_suspend ()
+{
+	for (int i = 0; i < RAMFLASH_MAX_PARTITIONS; i++)
+	{
+		if (NULL != m_partitions[i])
+		{
+			m_partitions[i]->stats.suspends++;
+		}
+	}
+}
+
+static void ramflash_lock ()
+{
+	pthread_once(&m_lock_once, ramflash_lock_init);
+	pthread_mutex_lock(&m_lock);
+}
+
+static void ramflash_unlock ()
+{
+	pthread_mutex_unlock(&m_lock);
+}
+
+static fs_driver_t m_driver = {
+	.read = ramflash_read,
+	.write = ramflash_write,
+	.erase = ramflash_erase,
+	.size = ramflash_size,
+	.erase_size = ramflash_erase_size,
+	.suspend = ramflash_suspend,
+	.lock = ramflash_lock,
+	.unlock = ramflash_unlock,
+};
+
+fs_driver_t * ramflash_driver (void)
+{
+	return &m_driver;
+}
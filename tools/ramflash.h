@@ -0,0 +1,142 @@
+/**
+ * RAM-backed simulated NOR flash, provides an fs_driver_t for running the
+ * filesystem on a host.
+ *
+ * Programming can only clear bits and erasing sets the whole erase block to
+ * 0xFF, like on a real NOR flash. Partition memory is shared between forked
+ * processes, so a child can modify the flash and the parent can inspect it.
+ * A power cut can be scheduled to tear a later program or erase operation.
+ *
+ * Copyright Thinnect Inc. 2020
+ * @license MIT
+ */
+#ifndef RAMFLASH_H_
+#define RAMFLASH_H_
+
+#include <stdint.h>
+#include "fs.h"
+
+#define RAMFLASH_MAX_PARTITIONS 3
+
+// Exit status of a process that lost power, see ramflash_power_cut
+#define RAMFLASH_POWER_CUT_STATUS 42
+
+typedef struct ramflash_stats
+{
+	uint32_t reads;
+	uint32_t read_bytes;
+	uint32_t programs;
+	uint32_t program_bytes;
+	uint32_t erases;
+	uint32_t erase_bytes;
+	uint32_t suspends;
+} ramflash_stats_t;
+
+// Flash timing used to estimate the device time of operations
+typedef struct ramflash_timing
+{
+	uint32_t op_ns;           // Command and address overhead of every operation
+	uint32_t read_ns;         // Per byte read
+	uint32_t program_ns;      // Per byte programmed
+	uint32_t erase_us;        // Per erase block
+} ramflash_timing_t;
+
+/**
+ * Create a partition, its contents will be erased.
+ *
+ * @param partition - Partition number 0..RAMFLASH_MAX_PARTITIONS-1.
+ * @param size - Partition size, must be a multiple of erase_size.
+ * @param erase_size - Erase block size.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ramflash_create (int partition, uint32_t size, uint32_t erase_size);
+
+/**
+ * Free the memory of a partition.
+ *
+ * @param partition - Partition number.
+ */
+void ramflash_destroy (int partition);
+
+/**
+ * Direct access to the partition contents.
+ *
+ * @param partition - Partition number.
+ *
+ * @return Pointer to the partition memory, NULL if the partition does not exist.
+ */
+uint8_t * ramflash_data (int partition);
+
+/**
+ * Get the driver for use with fs_init.
+ *
+ * @return Driver for all ramflash partitions.
+ */
+fs_driver_t * ramflash_driver (void);
+
+/**
+ * Get the operation counters of a partition.
+ *
+ * @param partition - Partition number.
+ * @param p_stats - Memory to store the counters.
+ */
+void ramflash_get_stats (int partition, ramflash_stats_t * p_stats);
+
+/**
+ * Clear the operation counters of a partition.
+ *
+ * @param partition - Partition number.
+ */
+void ramflash_reset_stats (int partition);
+
+/**
+ * Set the flash timing used by ramflash_stats_time_us. The default is a
+ * typical SPI NOR flash on an 8 MHz bus: 10 us per operation, 1 us per byte
+ * read, 4 us per byte programmed and 50 ms per 4 KiB erase block.
+ *
+ * @param p_timing - Flash timing.
+ */
+void ramflash_set_timing (const ramflash_timing_t * p_timing);
+
+/**
+ * Get the flash timing used by ramflash_stats_time_us.
+ *
+ * @param p_timing - Memory to store the flash timing.
+ */
+void ramflash_get_timing (ramflash_timing_t * p_timing);
+
+/**
+ * Estimate the device time spent on the flash operations of a set of
+ * counters, like the difference of two snapshots.
+ *
+ * @param p_stats - Operation counters.
+ *
+ * @return Estimated time in microseconds.
+ */
+uint64_t ramflash_stats_time_us (const ramflash_stats_t * p_stats);
+
+/**
+ * Subtract two snapshots of the operation counters.
+ *
+ * @param p_after - Later snapshot.
+ * @param p_before - Earlier snapshot.
+ * @param p_diff - Memory to store the difference, may be one of the snapshots.
+ */
+void ramflash_stats_diff (const ramflash_stats_t * p_after, const ramflash_stats_t * p_before, ramflash_stats_t * p_diff);
+
+/**
+ * Cut the power during a later program or erase operation of a partition.
+ * The operation is only partially carried out: a program writes a random
+ * number of bytes and some of the bits of the next byte, an erase erases a
+ * random number of bytes from the start of the range. The process then exits
+ * immediately with RAMFLASH_POWER_CUT_STATUS.
+ *
+ * @param partition - Partition number.
+ * @param op - Cut during this program or erase operation, counted from 1
+ *             starting with the next one, 0 cancels a scheduled cut.
+ * @param seed - Seed for how much of the operation is carried out.
+ */
+void ramflash_power_cut (int partition, uint32_t op, uint32_t seed);
+
+#endif//RAMFLASH_H_